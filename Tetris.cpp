@@ -3,25 +3,93 @@
 #include "SDL_image/SDL_image.h"
 #include <string>
 #include <vector>
-#include <queue>
 #include "SDL_ttf/SDL_ttf.h"
 #include <sstream>
 #include <fstream>
 #include <algorithm>
 #include <utility>
+#include <type_traits>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdio>
+#include <cctype>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <ctime>
+#include <unordered_set>
+#include <map>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
-//The attributes of the screen
+//The attributes of the screen, everything is laid out for this size and scaled to the window
 const int SCREEN_WIDTH = 640;
 const int SCREEN_HEIGHT = 480;
 const int SCREEN_BPP = 32;
 const int BOARD_WIDTH = 10;
-const int BOARD_HEIGHT = 24; //4 "invisible" rows at the top, where objects spawn, included
+const int BOARD_HEIGHT = 20; //Visible rows, the "invisible" rows are added on top of these
+const int HIDDEN_ROWS = 4; //"Invisible" rows at the top, where objects spawn
 const int BLOCK_SIZE = 20; //One block = 20x20 px
 const int BOARD_XPOS = 220; //Gameboard is placed 220px from left
 const int BOARD_YPOS = -40; //Gameboard actually starts 40px on top of the screen
 
+//The panels beside the board, placed to match the labels of the background image
+const int NEXT_XPOS = BOARD_XPOS + (BOARD_WIDTH + 1)*BLOCK_SIZE; //The next object, the score and the level
+const int SAVED_XPOS = 5*BLOCK_SIZE; //The held object
+const int OBJECT_YPOS = 2*BLOCK_SIZE;
+const int SCORE_YPOS = 222;
+const int LEVEL_YPOS = 325;
+const int BUTTON_WIDTH = 230; //The menu buttons, in a column in the middle
+const int BUTTON_HEIGHT = 64;
+const int MENU_XPOS = (SCREEN_WIDTH - BUTTON_WIDTH)/2;
+const int MENU_YPOS = 150;
+
+//Where the 640x480 layout lands in the window. Everything is drawn in layout coordinates and placed by
+//the renderer. A block is a whole number of window pixels, so that scaled blocks tile without gaps, and
+//the layout is centered with bars on the sides the window has to spare.
+struct Layout
+{
+    int block; //Window pixels per BLOCK_SIZE
+    int xpos; //Window position of the layouts top left corner
+    int ypos;
+    
+    int scale(int length) const { return (length*block - ((length < 0) ? BLOCK_SIZE - 1 : 0))/BLOCK_SIZE; } //Rounded down
+    int to_layout(int pixels) const { return (pixels*BLOCK_SIZE + block - 1)/block; } //Rounded up, for the size of a text
+    int window_x(int x) const { return xpos + scale(x); }
+    int window_y(int y) const { return ypos + scale(y); }
+};
+Layout layout = { BLOCK_SIZE, 0, 0 };
+
+void set_layout(int width, int height)
+{
+    layout.block = max(min(width*BLOCK_SIZE/SCREEN_WIDTH, height*BLOCK_SIZE/SCREEN_HEIGHT), 1);
+    layout.xpos = (width - layout.scale(SCREEN_WIDTH))/2;
+    layout.ypos = (height - layout.scale(SCREEN_HEIGHT))/2;
+}
+
+struct WindowSettings
+{
+    int width; //Of the window, the desktop size is used in fullscreen
+    int height;
+    bool fullscreen;
+};
+WindowSettings window_settings = { SCREEN_WIDTH, SCREEN_HEIGHT, false };
+
 //The different object-surfaces that will be used
 SDL_Surface* blockI = NULL;
 SDL_Surface* blockJ = NULL;
@@ -55,6 +123,63 @@ SDL_Event event;
 TTF_Font* font = NULL;
 SDL_Color textColor = { 255, 255, 255 };
 
+//The scenes of the game
+enum GameState { MENU, PLAY, HIGHSCORE, GAME_OVER };
+
+//Built with TETRIS_ALLOCATION_GATE every heap allocation is counted, the allocation gate uses it to check
+//the game loop. It replaces the allocator of the whole process, so it's only for test builds of the game.
+#ifdef TETRIS_ALLOCATION_GATE
+#ifdef TETRIS_LIBRARY
+#error "The allocation gate replaces operator new, it can't be built into the library"
+#endif
+
+atomic<unsigned long> allocation_count(0);
+
+void* operator new(size_t size)
+{
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    void* memory = malloc(size == 0 ? 1 : size);
+    if (memory == NULL)
+        throw bad_alloc();
+    return memory;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+//GCC sees the free() of memory from operator new once these are inlined, and takes it for a mismatch
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+#endif
+
 //Functions and classes
 SDL_Surface *load_image( std::string filename )
 {
@@ -81,909 +206,8066 @@ SDL_Surface *load_image( std::string filename )
     return optimizedImage;
 }
 
-class Tetris
+//A 32-bit surface resized once, when it's loaded, so that nothing is resampled while drawing. Every
+//pixel is the average of the source area it covers, weighted by alpha so that transparent pixels don't
+//bleed their color into the edges. Frees the source and returns the new surface.
+SDL_Surface* scale_surface(SDL_Surface* source, int w, int h)
+{
+    if (source == NULL || (source->w == w && source->h == h) || source->format->BytesPerPixel != 4 || w <= 0 || h <= 0)
+        return source;
+    
+    const SDL_PixelFormat* format = source->format;
+    SDL_Surface* scaled = SDL_CreateRGBSurface(SDL_SWSURFACE | (source->flags & SDL_SRCALPHA), w, h, 32,
+                                               format->Rmask, format->Gmask, format->Bmask, format->Amask);
+    if (scaled == NULL)
+        return source;
+    
+    //The source pixels under every output column or row, with how much of each is covered
+    struct Tap { int from; float weight; };
+    auto taps = [](int from, int to)
+    {
+        vector< vector<Tap> > taps(to);
+        const double step = double(from)/to;
+        for (int i = 0; i < to; ++i)
+        {
+            const double left = i*step;
+            const double right = (i + 1)*step;
+            for (int s = static_cast<int>(left); s < from && s < right; ++s)
+            {
+                const Tap tap = { s, static_cast<float>((min(right, s + 1.0) - max(left, double(s)))/step) };
+                taps[i].push_back(tap);
+            }
+        }
+        return taps;
+    };
+    const vector< vector<Tap> > columns = taps(source->w, w);
+    const vector< vector<Tap> > rows = taps(source->h, h);
+    const int alpha = (format->Amask != 0) ? format->Ashift/8 : -1; //Byte of alpha in a pixel
+    
+    //Across first into a float buffer, premultiplied by alpha, then down
+    SDL_LockSurface(source);
+    SDL_LockSurface(scaled);
+    vector<float> across(w*source->h*4, 0.0f);
+    for (int y = 0; y < source->h; ++y)
+    {
+        const Uint8* in = static_cast<const Uint8*>(source->pixels) + y*source->pitch;
+        for (int x = 0; x < w; ++x)
+        {
+            float* out = &across[(y*w + x)*4];
+            for (size_t t = 0; t < columns[x].size(); ++t)
+            {
+                const Uint8* pixel = in + columns[x][t].from*4;
+                const float weight = columns[x][t].weight * ((alpha >= 0) ? pixel[alpha]/255.0f : 1.0f);
+                for (int c = 0; c < 4; ++c)
+                    out[c] += pixel[c]*((c == alpha) ? columns[x][t].weight : weight);
+            }
+        }
+    }
+    for (int y = 0; y < h; ++y)
+    {
+        Uint8* out = static_cast<Uint8*>(scaled->pixels) + y*scaled->pitch;
+        for (int x = 0; x < w; ++x)
+        {
+            float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+            for (size_t t = 0; t < rows[y].size(); ++t)
+            {
+                for (int c = 0; c < 4; ++c)
+                    sum[c] += across[(rows[y][t].from*w + x)*4 + c]*rows[y][t].weight;
+            }
+            const float coverage = (alpha >= 0) ? sum[alpha]/255.0f : 1.0f;
+            for (int c = 0; c < 4; ++c)
+            {
+                const float value = (c == alpha || coverage <= 0.0f) ? sum[c] : sum[c]/coverage;
+                out[x*4 + c] = static_cast<Uint8>(min(max(value + 0.5f, 0.0f), 255.0f));
+            }
+        }
+    }
+    SDL_UnlockSurface(scaled);
+    SDL_UnlockSurface(source);
+    
+    SDL_FreeSurface(source);
+    return scaled;
+}
+
+//An image at the size the layout has in the window
+SDL_Surface* scale_to_layout(SDL_Surface* source)
+{
+    if (source == NULL)
+        return NULL;
+    return scale_surface(source, layout.scale(source->w), layout.scale(source->h));
+}
+
+//Everything on screen is drawn through a Renderer, so the backend can be picked per deployment
+class Renderer
 {
 public:
-    Tetris() {}
+    virtual ~Renderer() {}
     
-    void apply_surface(int, int, SDL_Surface*);
-    void apply_board(int, int, int, int, SDL_Surface*);
+    virtual void draw_image(int x, int y, SDL_Surface* image) = 0; //Whole image, backgrounds and buttons
+    virtual void draw_background(int x, int y, int w, int h, SDL_Surface* image) = 0; //Restores a part of a background
+    virtual void draw_block(int x, int y, int type) = 0; //Block of object type 1-7
+    virtual void draw_ghost(int x, int y) = 0; //Block of the predicted position
+    virtual void draw_text(int x, int y, const char* str, SDL_Surface* text) = 0; //str rendered as text, which may be freed right after
+    virtual void present() = 0; //Shows the frame
+};
+
+thread_local Renderer* renderer = NULL; //Every thread draws with its own, see RenderThread
+
+//Block surface of an object type
+SDL_Surface* block_surface(int type)
+{
+    SDL_Surface* const blockvector[] = {blockI, blockJ, blockL, blockO, blockS, blockT, blockZ};
+    return blockvector[type -1];
+}
+
+//Blits every draw straight into the screen surface
+class SoftwareRenderer : public Renderer
+{
+public:
+    void draw_image(int x, int y, SDL_Surface* image) { blit(x, y, NULL, image); }
+    void draw_background(int x, int y, int w, int h, SDL_Surface* image);
+    void draw_block(int x, int y, int type) { blit(x, y, NULL, block_surface(type)); }
+    void draw_ghost(int x, int y) { blit(x, y, NULL, edge); }
+    void draw_text(int x, int y, const char*, SDL_Surface* text) { blit(x, y, NULL, text); }
+    void present() { SDL_Flip(screen); }
     
+protected:
+    void blit(int x, int y, SDL_Rect* crop, SDL_Surface* source);
 };
 
-void Tetris::apply_surface(int x, int y, SDL_Surface* source)
+void SoftwareRenderer::blit(int x, int y, SDL_Rect* crop, SDL_Surface* source)
 {
-    //Make a temporary rectangle to hold the offsets
+    //Make a temporary rectangle to hold the offsets, in the window
     SDL_Rect offset;
     
     //Give the offsets to the rectangle
-    offset.x = x;
-    offset.y = y;
+    offset.x = layout.window_x(x);
+    offset.y = layout.window_y(y);
+    
+    //The images are already scaled, so only the crop is
+    SDL_Rect scaled;
+    if (crop != NULL)
+    {
+        scaled.x = layout.scale(crop->x);
+        scaled.y = layout.scale(crop->y);
+        scaled.w = layout.scale(crop->x + crop->w) - scaled.x;
+        scaled.h = layout.scale(crop->y + crop->h) - scaled.y;
+    }
     
     //Blit the surface
-    SDL_BlitSurface(source, NULL, screen, &offset);
+    SDL_BlitSurface(source, (crop != NULL) ? &scaled : NULL, screen, &offset);
 }
 
-void Tetris::apply_board(int x, int y, int cW, int cH, SDL_Surface* source)
+void SoftwareRenderer::draw_background(int x, int y, int w, int h, SDL_Surface* image)
 {
-    //Make a temporary rectangle to hold the offsets
-    SDL_Rect offset;
-    
-    //Give the offsets to the rectangle
-    offset.x = x;
-    offset.y = y;
-    
     SDL_Rect crop;
     crop.x = x;
     crop.y = y;
-    crop.w = cW;
-    crop.h = cH;
+    crop.w = w;
+    crop.h = h;
     
-    //Blit the surface
-    SDL_BlitSurface(source, &crop, screen, &offset);
+    blit(x, y, &crop, image);
 }
 
-
-class Object : public Tetris
+//Works like an SDL2 SDL_Renderer: draws are queued as texture copies and run in one batch when
+//the frame is presented. Only the screen tiles that were drawn to are sent to the display.
+//Without SDL2 the batch falls back to software blits into the screen surface.
+class BatchRenderer : public SoftwareRenderer
 {
 public:
-    Object(Uint8 type)
-    : type_(type), xPos_(3), yPos_(0), exchanged(false) { set_matrix_type(); }
-    
-    //Get-functions
-    Uint8 get_type() const { return type_; }
-    int get_xPos() const { return xPos_; } //Returns x-pos for the 5x5-objects [0][0]-block
-    int get_yPos() const { return yPos_; } //Returns y-pos for the 5x5-objects [0][0]-block
-
-    //Sets and actions
-    void set_xPos(int xPos) { xPos_ = xPos; }
-    void set_yPos(int yPos) { yPos_ = yPos; }
-    void set_exchanged() { exchanged = true; }
-    void rotate_left();
-    void rotate_right();
+    BatchRenderer()
+    : count_(0) { memset(dirty_, 0, sizeof(dirty_)); }
     
-    //Draw functions
-    void draw_object();
-    void draw_saved_object();
-    void draw_next();
-    void draw_predicted_position();
+    void draw_image(int x, int y, SDL_Surface* image) { queue(x, y, 0, 0, 0, 0, image); }
+    void draw_background(int x, int y, int w, int h, SDL_Surface* image) { queue(x, y, x, y, w, h, image); }
+    void draw_block(int x, int y, int type) { queue(x, y, 0, 0, 0, 0, block_surface(type)); }
+    void draw_ghost(int x, int y) { queue(x, y, 0, 0, 0, 0, edge); }
+    void draw_text(int x, int y, const char*, SDL_Surface* text);
+    void present();
     
-    bool isExchanged() { return exchanged; }
+private:
+    static const int MAX_COPIES = 2048; //The batch is flushed early if it fills up
+    static const int TILE = 32;
+    static const int TILES_X = (SCREEN_WIDTH + TILE-1)/TILE;
+    static const int TILES_Y = (SCREEN_HEIGHT + TILE-1)/TILE;
     
-    //Variables
-    int matrix_[5][5]; //5x5 matrix to build the object of
+    struct Copy
+    {
+        SDL_Surface* texture;
+        SDL_Rect crop; //w == 0 copies the whole texture
+        Sint16 x;
+        Sint16 y;
+    };
     
-private:
-    Uint8 type_; //1=I, 2=J, 3=L, 4=O, 5=S, 6=T, 7=Z
-    int xPos_;
-    int yPos_;
-    bool exchanged;
+    void queue(int x, int y, int cx, int cy, int cw, int ch, SDL_Surface* texture);
+    void mark_dirty(int x, int y, int w, int h);
+    void flush();
     
-    void set_matrix_type();
+    Copy copies_[MAX_COPIES];
+    int count_;
+    bool dirty_[TILES_Y][TILES_X];
+    SDL_Rect update_[TILES_X*TILES_Y];
 };
 
-void Object::rotate_left()
+void BatchRenderer::queue(int x, int y, int cx, int cy, int cw, int ch, SDL_Surface* texture)
+{
+    if (texture == NULL)
+        return;
+    if (count_ == MAX_COPIES)
+        flush();
+    
+    Copy& copy = copies_[count_++];
+    copy.texture = texture;
+    copy.crop.x = cx;
+    copy.crop.y = cy;
+    copy.crop.w = cw;
+    copy.crop.h = ch;
+    copy.x = x;
+    copy.y = y;
+    mark_dirty(x, y, cw ? cw : layout.to_layout(texture->w), ch ? ch : layout.to_layout(texture->h));
+}
+
+void BatchRenderer::mark_dirty(int x, int y, int w, int h)
 {
-    if (type_ != 4) //type 4 (O, square) does not rotate
+    const int left = max(x, 0)/TILE;
+    const int top = max(y, 0)/TILE;
+    const int right = min(x + w, SCREEN_WIDTH);
+    const int bottom = min(y + h, SCREEN_HEIGHT);
+    
+    for (int ty = top; ty*TILE < bottom; ++ty)
     {
-        queue<int> temp;
-        
-        for (int i=0; i<5; ++i)
-        {
-            for (int j=0; j<5; ++j)
-            {
-                temp.push(matrix_[j][i]);
-            }
-        }
-        
-        for (int i=0; i<5; ++i)
-        {
-            for (int j=4; j>=0; --j)
-            {
-                matrix_[i][j] = temp.front();
-                temp.pop();
-            }
-        }
+        for (int tx = left; tx*TILE < right; ++tx)
+            dirty_[ty][tx] = true;
     }
 }
 
-void Object::rotate_right()
+void BatchRenderer::flush()
 {
-    if (type_ != 4) //type 4 (O, square) does not rotate
+    for (int i = 0; i < count_; ++i)
+        blit(copies_[i].x, copies_[i].y, copies_[i].crop.w ? &copies_[i].crop : NULL, copies_[i].texture);
+    count_ = 0;
+}
+
+void BatchRenderer::draw_text(int x, int y, const char*, SDL_Surface* text)
+{
+    //Texts are freed by the caller right after drawing, so they can't wait for the batch
+    flush();
+    blit(x, y, NULL, text);
+    if (text != NULL)
+        mark_dirty(x, y, layout.to_layout(text->w), layout.to_layout(text->h));
+}
+
+void BatchRenderer::present()
+{
+    flush();
+    
+    //Every run of dirty tiles in a tile row becomes one update rectangle
+    int rects = 0;
+    for (int ty = 0; ty < TILES_Y; ++ty)
     {
-        queue<int> temp;
-        
-        for (int i=0; i<5; ++i)
-        {
-            for (int j=0; j<5; ++j)
-            {
-                temp.push(matrix_[j][i]);
-            }
-        }
-        
-        for (int i=4; i>=0; --i)
+        for (int tx = 0; tx < TILES_X; ++tx)
         {
-            for (int j=0; j<5; ++j)
-            {
-                matrix_[i][j] = temp.front();
-                temp.pop();
-            }
+            if (!dirty_[ty][tx])
+                continue;
+            
+            const int start = tx;
+            while (tx < TILES_X && dirty_[ty][tx])
+                dirty_[ty][tx++] = false;
+            
+            SDL_Rect& rect = update_[rects++];
+            rect.x = layout.window_x(start*TILE);
+            rect.y = layout.window_y(ty*TILE);
+            rect.w = layout.window_x(min(tx*TILE, SCREEN_WIDTH)) - rect.x;
+            rect.h = layout.window_y(min((ty+1)*TILE, SCREEN_HEIGHT)) - rect.y;
         }
     }
+    
+    if (rects > 0)
+        SDL_UpdateRects(screen, rects, update_);
 }
 
-void Object::set_matrix_type()
+//Draws nothing, for measuring the game without the cost of drawing
+class NullRenderer : public Renderer
 {
+public:
+    NullRenderer()
+    : draws_(0), frames_(0) {}
     
-    for (int x=0; x<5; ++x)
-    {
-        for (int y=0; y<5; ++y)
-            matrix_[x][y] = 0;
-    }
+    void draw_image(int, int, SDL_Surface*) { ++draws_; }
+    void draw_background(int, int, int, int, SDL_Surface*) { ++draws_; }
+    void draw_block(int, int, int) { ++draws_; }
+    void draw_ghost(int, int) { ++draws_; }
+    void draw_text(int, int, const char*, SDL_Surface*) { ++draws_; }
+    void present() { ++frames_; }
     
-    if (type_ == 1) // I
-    {
-        matrix_[2][0] = 1;
-        matrix_[2][1] = 1;
-        matrix_[2][2] = 1;
-        matrix_[2][3] = 1;
-    }
+    unsigned long get_draws() const { return draws_; }
+    unsigned long get_frames() const { return frames_; }
     
-    if (type_ == 2) // J
-    {
-        matrix_[1][3] = 2;
-        matrix_[2][1] = 2;
-        matrix_[2][2] = 2;
-        matrix_[2][3] = 2;
-    }
+private:
+    unsigned long draws_;
+    unsigned long frames_;
+};
+
+//Draws into a grid of terminal characters and sends only the characters that changed, for playing
+//or watching over SSH on hosts without a display. One character covers 10x20 px of the screen, so a
+//block is two characters wide. Keys typed in the terminal are passed on as SDL key events.
+class TerminalRenderer : public Renderer
+{
+public:
+    TerminalRenderer();
+    ~TerminalRenderer();
     
-    if (type_ == 3) // L
-    {
-        matrix_[2][1] = 3;
-        matrix_[2][2] = 3;
-        matrix_[2][3] = 3;
-        matrix_[3][3] = 3;
-    }
+    void draw_image(int x, int y, SDL_Surface* image);
+    void draw_background(int x, int y, int w, int h, SDL_Surface*) { fill(x, y, w, h, ' ', 0, 0); }
+    void draw_block(int x, int y, int type) { fill(x, y, BLOCK_SIZE, BLOCK_SIZE, ' ', 0, BLOCK_COLORS[type]); }
+    void draw_ghost(int x, int y);
+    void draw_text(int x, int y, const char* str, SDL_Surface*);
+    void present();
     
-    if (type_ == 4) // O
-    {
-        matrix_[1][1] = 4;
-        matrix_[1][2] = 4;
-        matrix_[2][1] = 4;
-        matrix_[2][2] = 4;
-    }
+private:
+    static const int COLS = SCREEN_WIDTH/10;
+    static const int ROWS = SCREEN_HEIGHT/20;
+    static const int OUTPUT_SIZE = 8192;
+    static const Uint8 BLOCK_COLORS[8]; //256-color palette entry for every object type
+    static const Uint8 GHOST_COLOR = 245;
     
-    if (type_ == 5) // S
+    struct Cell
     {
-        matrix_[1][1] = 5;
-        matrix_[1][2] = 5;
-        matrix_[2][2] = 5;
-        matrix_[2][3] = 5;
-    }
+        char ch;
+        Uint8 fg; //0 is the terminals own color
+        Uint8 bg;
+        
+        bool operator!=(const Cell& other) const { return ch != other.ch || fg != other.fg || bg != other.bg; }
+    };
     
-    if (type_ == 6) // T
+    void fill(int x, int y, int w, int h, char ch, Uint8 fg, Uint8 bg);
+    void put(int col, int row, char ch, Uint8 fg, Uint8 bg);
+    void write_cell(int col, int row, const Cell& cell);
+    void output(const char* str, int length);
+    void flush_output();
+    void read_input(); //Runs on its own thread
+    void push_key(SDLKey sym, Uint16 unicode);
+    
+    Cell shown_[ROWS][COLS]; //What the terminal shows
+    Cell canvas_[ROWS][COLS]; //What has been drawn
+    char output_[OUTPUT_SIZE]; //Escape sequences waiting to be written in one go
+    int output_length_;
+    int cursor_col_; //Where the terminal cursor is
+    int cursor_row_;
+    Uint8 fg_; //Colors the terminal is set to
+    Uint8 bg_;
+    bool raw_input_;
+    termios saved_termios_;
+    atomic<bool> running_;
+    thread input_thread_;
+};
+
+const Uint8 TerminalRenderer::BLOCK_COLORS[8] = { 0, 27, 205, 130, 196, 226, 208, 46 };
+
+TerminalRenderer::TerminalRenderer()
+: output_length_(0), cursor_col_(-1), cursor_row_(-1), fg_(0), bg_(0), raw_input_(false), running_(true)
+{
+    const Cell blank = { ' ', 0, 0 };
+    for (int row = 0; row < ROWS; ++row)
     {
-        matrix_[2][1] = 6;
-        matrix_[1][2] = 6;
-        matrix_[2][2] = 6;
-        matrix_[3][2] = 6;
+        for (int col = 0; col < COLS; ++col)
+            shown_[row][col] = canvas_[row][col] = blank;
     }
     
-    if (type_ == 7) // Z
+    //The only full repaint: clear the terminal once and hide the cursor
+    const char start[] = "\x1b[0m\x1b[2J\x1b[?25l";
+    output(start, sizeof(start) -1);
+    flush_output();
+    
+    if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved_termios_) == 0)
     {
-        matrix_[2][1] = 7;
-        matrix_[1][2] = 7;
-        matrix_[2][2] = 7;
-        matrix_[1][3] = 7;
+        termios raw = saved_termios_;
+        raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+        raw_input_ = tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0;
+        if (raw_input_)
+            input_thread_ = thread(&TerminalRenderer::read_input, this);
     }
 }
 
-void Object::draw_object()
+TerminalRenderer::~TerminalRenderer()
 {
-    vector<SDL_Surface*> blockvector {blockI, blockJ, blockL, blockO, blockS, blockT, blockZ};
+    running_ = false;
+    if (input_thread_.joinable())
+        input_thread_.join();
+    if (raw_input_)
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios_);
     
-    for (int i=0; i<5; ++i)
+    char end[32];
+    const int length = snprintf(end, sizeof(end), "\x1b[0m\x1b[%d;1H\x1b[?25h", ROWS +1);
+    output(end, length);
+    flush_output();
+}
+
+void TerminalRenderer::put(int col, int row, char ch, Uint8 fg, Uint8 bg)
+{
+    if (col < 0 || col >= COLS || row < 0 || row >= ROWS)
+        return;
+    
+    Cell& cell = canvas_[row][col];
+    cell.ch = ch;
+    cell.fg = fg;
+    cell.bg = bg;
+}
+
+void TerminalRenderer::fill(int x, int y, int w, int h, char ch, Uint8 fg, Uint8 bg)
+{
+    for (int row = max(y, 0)/20; row < (y + h)/20 && row < ROWS; ++row)
     {
-        for (int j=0; j<5; ++j)
-        {
-            if (matrix_[i][j] != 0)
-            {
-                apply_surface(BOARD_XPOS+(get_xPos()*BLOCK_SIZE)+(i*BLOCK_SIZE), BOARD_YPOS+(get_yPos()*BLOCK_SIZE)+(j*BLOCK_SIZE), blockvector.at(matrix_[i][j] -1));
-            }
-        }
+        for (int col = max(x, 0)/10; col < (x + w)/10 && col < COLS; ++col)
+            put(col, row, ch, fg, bg);
     }
-    apply_board(220, 0, 200, 40, background);
 }
 
-void Object::draw_next()
+void TerminalRenderer::draw_image(int x, int y, SDL_Surface* image)
 {
-    vector<SDL_Surface*> blockvector {blockI, blockJ, blockL, blockO, blockS, blockT, blockZ};
+    if (image == NULL)
+        return;
     
-    apply_board(420, 0, BOARD_XPOS, 140, background);
-    for (int i=0; i<5; ++i)
+    const int w = layout.to_layout(image->w); //The image is scaled to the window
+    const int h = layout.to_layout(image->h);
+    fill(x, y, w, h, ' ', 0, 0);
+    
+    //Images can't be shown, the ones with something to say get a caption instead
+    const struct { SDL_Surface* image; const char* caption; } captions[] = {
+        { background_menu, "TETRIS" }, { background_hs, "HIGHSCORE" }, { transparent, "Enter your name" },
+        { play_button, "  Play" }, { play_marked, "> Play" },
+        { highscore_button, "  Highscore" }, { highscore_marked, "> Highscore" },
+        { quit_button, "  Quit" }, { quit_marked, "> Quit" } };
+    
+    for (size_t i = 0; i < sizeof(captions)/sizeof(captions[0]); ++i)
     {
-        for (int j=0; j<5; ++j)
+        if (captions[i].image == image)
         {
-            if (matrix_[i][j] != 0)
-            {
-                apply_surface(440+(i*BLOCK_SIZE), 40+(j*BLOCK_SIZE), blockvector.at(matrix_[i][j] -1));
-            }
+            const int col = (w >= SCREEN_WIDTH) ? (COLS - (int)strlen(captions[i].caption))/2 : (x + w/2)/10 - 6;
+            const int row = (w >= SCREEN_WIDTH) ? 2 : (y + h/2)/20;
+            draw_text(col*10, row*20, captions[i].caption, NULL);
         }
     }
 }
 
-void Object::draw_saved_object()
+void TerminalRenderer::draw_ghost(int x, int y)
+{
+    fill(x, y, BLOCK_SIZE/2, BLOCK_SIZE, '[', GHOST_COLOR, 0);
+    fill(x + BLOCK_SIZE/2, y, BLOCK_SIZE/2, BLOCK_SIZE, ']', GHOST_COLOR, 0);
+}
+
+void TerminalRenderer::draw_text(int x, int y, const char* str, SDL_Surface*)
+{
+    for (int i = 0; str[i] != '\0'; ++i)
+        put(x/10 + i, y/20, str[i], 0, 0);
+}
+
+void TerminalRenderer::write_cell(int col, int row, const Cell& cell)
 {
-    vector<SDL_Surface*> blockvector {blockI, blockJ, blockL, blockO, blockS, blockT, blockZ};
+    char buffer[48];
+    int length = 0;
     
-    apply_board(0, 0, BOARD_XPOS, SCREEN_HEIGHT, background);
-    for (int i=0; i<5; ++i)
+    if (col != cursor_col_ || row != cursor_row_)
+        length += snprintf(buffer + length, sizeof(buffer) - length, "\x1b[%d;%dH", row +1, col +1);
+    
+    if (cell.fg != fg_ || cell.bg != bg_)
     {
-        for (int j=0; j<5; ++j)
-        {
-            if (matrix_[i][j] != 0)
-            {
-                apply_surface(100+(i*BLOCK_SIZE), 40+(j*BLOCK_SIZE), blockvector.at(matrix_[i][j] -1));
-            }
-        }
+        length += snprintf(buffer + length, sizeof(buffer) - length, "\x1b[0");
+        if (cell.fg != 0)
+            length += snprintf(buffer + length, sizeof(buffer) - length, ";38;5;%d", cell.fg);
+        if (cell.bg != 0)
+            length += snprintf(buffer + length, sizeof(buffer) - length, ";48;5;%d", cell.bg);
+        buffer[length++] = 'm';
+        fg_ = cell.fg;
+        bg_ = cell.bg;
     }
+    
+    buffer[length++] = cell.ch;
+    output(buffer, length);
+    
+    cursor_col_ = col +1;
+    cursor_row_ = row;
 }
 
-void Object::draw_predicted_position()
+void TerminalRenderer::present()
 {
-    for (int i=0; i<5; ++i)
+    for (int row = 0; row < ROWS; ++row)
     {
-        for (int j=0; j<5; ++j)
+        for (int col = 0; col < COLS; ++col)
         {
-            if (matrix_[i][j] != 0)
+            if (canvas_[row][col] != shown_[row][col])
             {
-                apply_surface(BOARD_XPOS+(get_xPos()*BLOCK_SIZE)+(i*BLOCK_SIZE), BOARD_YPOS+(get_yPos()*BLOCK_SIZE)+(j*BLOCK_SIZE), edge);
+                write_cell(col, row, canvas_[row][col]);
+                shown_[row][col] = canvas_[row][col];
             }
         }
     }
-    apply_board(220, 0, 200, 40, background);
+    flush_output();
 }
 
-
-class Board : public Tetris
+void TerminalRenderer::output(const char* str, int length)
 {
-public:
-    Board()
-    : score_(0), level_(1) { init_boardMatrix(); }
-    
-    void init_boardMatrix();
-    void draw_board();
-    bool isMovementPossible(const Object&); //Returns false if we've done something illegal
-    void store_object(Object&);
-    void clear_row(Object&); //Returns the sum of rows cleared at the same time
-    void drop_blocks(int&); //Moves all the stored blocks from y=0 to y=int&argument down to fill cleared rows
-    bool isGameover(Object&);
-    void increase_score(int&);
-    void increase_level() { ++level_; }
-    int get_score() { return score_; }
-    
-    void print_score_level();
-    
-private:
-    int boardMatrix[BOARD_WIDTH][BOARD_HEIGHT];
-    int score_;
-    int level_;
-};
+    if (output_length_ + length > OUTPUT_SIZE)
+        flush_output();
+    memcpy(output_ + output_length_, str, length);
+    output_length_ += length;
+}
 
-void Board::init_boardMatrix()
+void TerminalRenderer::flush_output()
 {
-    for (int i=0; i<BOARD_WIDTH; ++i)
+    int written = 0;
+    while (written < output_length_)
     {
-        for (int j=0; j<BOARD_HEIGHT; ++j)
-            boardMatrix[i][j] = 0;
+        const ssize_t result = write(STDOUT_FILENO, output_ + written, output_length_ - written);
+        if (result <= 0)
+            break;
+        written += result;
     }
+    output_length_ = 0;
 }
 
-void Board::draw_board()
+void TerminalRenderer::push_key(SDLKey sym, Uint16 unicode)
 {
-    vector<SDL_Surface*> blockvector {blockI, blockJ, blockL, blockO, blockS, blockT, blockZ};
+    SDL_Event key;
+    memset(&key, 0, sizeof(key));
+    key.type = SDL_KEYDOWN;
+    key.key.state = SDL_PRESSED;
+    key.key.keysym.sym = sym;
+    key.key.keysym.unicode = unicode;
+    SDL_PushEvent(&key);
     
-    for (int y=4; y<BOARD_HEIGHT; ++y)
+    //A terminal only tells about presses, so every key is let go right away. Held keys
+    //then repeat at the terminals own rate.
+    key.type = SDL_KEYUP;
+    key.key.state = SDL_RELEASED;
+    SDL_PushEvent(&key);
+}
+
+void TerminalRenderer::read_input()
+{
+    unsigned char keys[64];
+    ssize_t kept = 0; //The start of an arrow key the last read ended in, it's finished by the next one
+    while (running_)
     {
-        for (int x=0; x<BOARD_WIDTH; ++x)
+        pollfd input = { STDIN_FILENO, POLLIN, 0 };
+        if (poll(&input, 1, 50) <= 0)
+        {
+            if (kept > 0) //Nothing followed, it was the Escape key
+                push_key(SDLK_ESCAPE, 0);
+            kept = 0;
+            continue;
+        }
+        
+        const ssize_t count = kept + max<ssize_t>(read(STDIN_FILENO, keys + kept, sizeof(keys) - kept), 0);
+        kept = 0;
+        
+        for (ssize_t i = 0; i < count; ++i)
         {
-            if (boardMatrix[x][y] != 0)
+            const unsigned char key = keys[i];
+            
+            if (key == 27 && (i+1 == count || (i+2 == count && keys[i+1] == '[')))
             {
-                apply_surface(BOARD_XPOS+(x*BLOCK_SIZE), BOARD_YPOS+(y*BLOCK_SIZE), blockvector.at(boardMatrix[x][y] -1));
+                kept = count - i;
+                memmove(keys, keys + i, kept);
+                break;
             }
-            else
-                apply_board(BOARD_XPOS+(x*BLOCK_SIZE), BOARD_YPOS+(y*BLOCK_SIZE), 20, 20, background);
+            else if (key == 27 && i+2 < count && keys[i+1] == '[') //Arrow keys
+            {
+                const char arrow = keys[i+2];
+                i += 2;
+                if (arrow == 'A')
+                    push_key(SDLK_UP, 0);
+                else if (arrow == 'B')
+                    push_key(SDLK_DOWN, 0);
+                else if (arrow == 'C')
+                    push_key(SDLK_RIGHT, 0);
+                else if (arrow == 'D')
+                    push_key(SDLK_LEFT, 0);
+            }
+            else if (key == 27)
+                push_key(SDLK_ESCAPE, 0);
+            else if (key == '\r' || key == '\n')
+                push_key(SDLK_RETURN, '\r');
+            else if (key == 127 || key == 8)
+                push_key(SDLK_BACKSPACE, 8);
+            else if (key == 'c') //Shift can't be seen in a terminal, c holds the object instead. It's still a c in a name
+                push_key(SDLK_LSHIFT, key);
+            else if (key == 3) //Ctrl-C
+            {
+                SDL_Event quit;
+                memset(&quit, 0, sizeof(quit));
+                quit.type = SDL_QUIT;
+                SDL_PushEvent(&quit);
+            }
+            else if (key >= ' ' && key < 127)
+                push_key((SDLKey)tolower(key), key);
         }
     }
 }
 
-bool Board::isMovementPossible(const Object& object)
+//Creates the renderer backend with the given name, the software blitter by default
+Renderer* create_renderer(const string& name)
 {
-    for (int i = object.get_xPos(); i<object.get_xPos()+5; ++i)
-    {
-        for (int j = object.get_yPos(); j<object.get_yPos()+5; ++j)
-        {
-            if (object.matrix_[i-object.get_xPos()][j-object.get_yPos()] != 0
-                && (i < 0 || i >= BOARD_WIDTH || j >= BOARD_HEIGHT)) // If we are out of bounds
-                return false;
-        }
-    }
-     
-    
-    int x; // x-pos to loop from..
-    int x_; // x-pos to loop to..
-    int y; // y-pos to loop from..
-    int y_; // y-pos to loop to..
-    // ..to check if there is a block associated to the object that has collided with a block stored in the gameboard
-    
-    if (object.get_xPos() < 0) // If our 5x5 object is outside the left boarder of the gameboard
-    {
-        x = 0;
-        x_ = object.get_xPos()+5;
-    }
-    else if (object.get_xPos() > 5) // If our 5x5 object is outside the right boarder of the gameboard
+    if (name == "batch")
+        return new BatchRenderer;
+    if (name == "null")
+        return new NullRenderer;
+    if (name == "terminal")
+        return new TerminalRenderer;
+    return new SoftwareRenderer;
+}
+
+class Tetris
+{
+public:
+    Tetris() {}
+    
+    void apply_surface(int, int, SDL_Surface*);
+    void apply_board(int, int, int, int, SDL_Surface*);
+    void apply_block(int x, int y, int type) { renderer->draw_block(x, y, type); }
+    void apply_edge(int x, int y) { renderer->draw_ghost(x, y); }
+    void apply_text(int x, int y, const char* str, SDL_Surface* text) { renderer->draw_text(x, y, str, text); }
+    
+};
+
+void Tetris::apply_surface(int x, int y, SDL_Surface* source)
+{
+    renderer->draw_image(x, y, source);
+}
+
+void Tetris::apply_board(int x, int y, int cW, int cH, SDL_Surface* source)
+{
+    renderer->draw_background(x, y, cW, cH, source);
+}
+
+
+//The part of a board that is shown on screen
+struct BoardView
+{
+    int xpos; //Screen position of the views top left block
+    int ypos;
+    int left; //First column and row of the board inside the view
+    int top;
+    int cols; //Number of columns and rows shown
+    int rows;
+};
+
+const int MAX_PIECES = 18; //Most objects a piece set can have, the one-sided pentominoes
+
+//A piece drawn as a 5x5 picture, the rows from the top down, '#' is a block. It turns around the middle block.
+struct PieceDefinition
+{
+    char name; //Used by puzzles and printouts
+    Uint8 color; //Block image, 1-7
+    const char* picture;
+};
+
+//One rotation of a piece, everything the object needs so it never looks at its blocks to move
+struct PieceShape
+{
+    Uint8 matrix[5][5]; //Color of the block at [x][y], 0 if empty
+    Uint8 rows[5]; //Bit x of rows[y] is set if matrix[x][y] holds a block, used by the boards collision checks
+    Sint8 left, right, top, bottom; //The blocks bounding box
+};
+
+struct PieceInfo
+{
+    char name;
+    Uint8 rotations; //Different rotations, 1 for pieces that only move when turned, like the O, otherwise 2 or 4
+    Sint8 spawn_dx; //Added to the boards spawn column so the piece spawns in the middle
+    Uint8 blocks;
+    Uint8 stripe; //Most blocks more on the even columns than on the odd ones, or the other way, in any rotation
+    PieceShape shapes[4]; //By right turns from the spawn rotation, repeated if the piece has less than 4
+};
+
+struct PieceSet
+{
+    const char* name;
+    int count;
+    int blocks; //Blocks of every object, 0 if they differ
+    PieceInfo pieces[MAX_PIECES + 1]; //By object type, type 0 is the empty object
+};
+
+//The piece tables are built by the compiler, there is no shape math left when the game runs.
+//The builders are constexpr functions of a single return, as C++11 needs them.
+template<int... I> struct Indices {};
+template<int N, int... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+template<int... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+//Color of the block at [i][j] of the picture turned right r times, 0 if empty
+constexpr Uint8 turned_cell(const PieceDefinition& definition, int r, int i, int j)
+{
+    return r == 0 ? (definition.picture[5*j + i] == '#' ? definition.color : 0) : turned_cell(definition, r - 1, j, 4 - i);
+}
+
+constexpr bool column_used(const PieceDefinition& definition, int r, int i, int j = 0)
+{
+    return j < 5 && (turned_cell(definition, r, i, j) != 0 || column_used(definition, r, i, j + 1));
+}
+
+constexpr bool row_used(const PieceDefinition& definition, int r, int j, int i = 0)
+{
+    return i < 5 && (turned_cell(definition, r, i, j) != 0 || row_used(definition, r, j, i + 1));
+}
+
+//The blocks bounding box, 5 and -1 if there are no blocks
+constexpr Sint8 left_column(const PieceDefinition& definition, int r, int i = 0)
+{
+    return (i == 5 || column_used(definition, r, i)) ? i : left_column(definition, r, i + 1);
+}
+
+constexpr Sint8 right_column(const PieceDefinition& definition, int r, int i = 4)
+{
+    return (i < 0 || column_used(definition, r, i)) ? i : right_column(definition, r, i - 1);
+}
+
+constexpr Sint8 top_row(const PieceDefinition& definition, int r, int j = 0)
+{
+    return (j == 5 || row_used(definition, r, j)) ? j : top_row(definition, r, j + 1);
+}
+
+constexpr Sint8 bottom_row(const PieceDefinition& definition, int r, int j = 4)
+{
+    return (j < 0 || row_used(definition, r, j)) ? j : bottom_row(definition, r, j - 1);
+}
+
+//Bit i is set if [i][j] holds a block
+constexpr Uint8 row_bits(const PieceDefinition& definition, int r, int j, int i = 0)
+{
+    return i == 5 ? 0 : ((turned_cell(definition, r, i, j) != 0) << i) | row_bits(definition, r, j, i + 1);
+}
+
+//True if rotation b is rotation a with every block moved dx, dy, or the same shape if both are 0
+constexpr bool same_blocks(const PieceDefinition& definition, int a, int b, int dx, int dy, int k = 0)
+{
+    return k == 25
+        || ((turned_cell(definition, a, k%5, k/5) != 0)
+                == (k%5 + dx >= 0 && k%5 + dx < 5 && k/5 + dy >= 0 && k/5 + dy < 5 && turned_cell(definition, b, k%5 + dx, k/5 + dy) != 0)
+            && same_blocks(definition, a, b, dx, dy, k + 1));
+}
+
+//A piece whose every rotation is the spawn rotation moved somewhere doesn't turn at all
+constexpr bool moved_only(const PieceDefinition& definition, int r = 1)
+{
+    return r == 4
+        || (same_blocks(definition, 0, r, left_column(definition, r) - left_column(definition, 0), top_row(definition, r) - top_row(definition, 0))
+            && moved_only(definition, r + 1));
+}
+
+//The turns of the picture a rotation is, the others keep the turns until they repeat
+constexpr int shape_turns(const PieceDefinition& definition, int r)
+{
+    return moved_only(definition) ? 0 : r;
+}
+
+constexpr Uint8 count_rotations(const PieceDefinition& definition)
+{
+    return moved_only(definition) ? 1 : same_blocks(definition, 0, 2, 0, 0) ? 2 : 4;
+}
+
+//Blocks in the columns i with i % 2 == parity
+constexpr int parity_blocks(const PieceDefinition& definition, int r, int parity, int k = 0)
+{
+    return k == 25 ? 0 : (k/5 % 2 == parity && turned_cell(definition, r, k/5, k%5) != 0) + parity_blocks(definition, r, parity, k + 1);
+}
+
+constexpr int stripe_of(const PieceDefinition& definition, int r)
+{
+    return parity_blocks(definition, r, 0) > parity_blocks(definition, r, 1) ? parity_blocks(definition, r, 0) - parity_blocks(definition, r, 1)
+                                                                              : parity_blocks(definition, r, 1) - parity_blocks(definition, r, 0);
+}
+
+//Turning twice swaps the columns back, so the first two rotations have every stripe
+constexpr Uint8 piece_stripe(const PieceDefinition& definition)
+{
+    return stripe_of(definition, shape_turns(definition, 0)) > stripe_of(definition, shape_turns(definition, 1))
+        ? stripe_of(definition, shape_turns(definition, 0)) : stripe_of(definition, shape_turns(definition, 1));
+}
+
+constexpr Uint8 piece_blocks(const PieceDefinition& definition)
+{
+    return parity_blocks(definition, 0, 0) + parity_blocks(definition, 0, 1);
+}
+
+template<int... I>
+constexpr PieceShape make_shape(const PieceDefinition& definition, int r, Indices<I...>)
+{
+    return { { { turned_cell(definition, r, I, 0), turned_cell(definition, r, I, 1), turned_cell(definition, r, I, 2),
+                 turned_cell(definition, r, I, 3), turned_cell(definition, r, I, 4) }... },
+             { row_bits(definition, r, I)... },
+             left_column(definition, r), right_column(definition, r), top_row(definition, r), bottom_row(definition, r) };
+}
+
+constexpr PieceShape make_shape(const PieceDefinition& definition, int r)
+{
+    return make_shape(definition, shape_turns(definition, r), MakeIndices<5>::type());
+}
+
+constexpr PieceInfo make_piece(const PieceDefinition& definition)
+{
+    return { definition.name, count_rotations(definition),
+             static_cast<Sint8>((4 - left_column(definition, 0) - right_column(definition, 0))/2), //Centers the piece on the 5x5-objects middle column
+             piece_blocks(definition),
+             piece_stripe(definition),
+             { make_shape(definition, 0), make_shape(definition, 1), make_shape(definition, 2), make_shape(definition, 3) } };
+}
+
+//Blocks of every object from k on, 0 if they differ
+constexpr int common_blocks(const PieceDefinition* definitions, int count, int k = 1)
+{
+    return k == count ? piece_blocks(definitions[0])
+        : piece_blocks(definitions[k]) == piece_blocks(definitions[0]) ? common_blocks(definitions, count, k + 1) : 0;
+}
+
+template<int N, int... I>
+constexpr PieceSet make_piece_set(const char* name, const PieceDefinition (&definitions)[N], Indices<I...>)
+{
+    return { name, N, common_blocks(definitions, N), { PieceInfo(), make_piece(definitions[I])... } };
+}
+
+template<int N>
+constexpr PieceSet make_piece_set(const char* name, const PieceDefinition (&definitions)[N])
+{
+    static_assert(N >= 1 && N <= MAX_PIECES, "A piece set has 1 to MAX_PIECES objects");
+    return make_piece_set(name, definitions, typename MakeIndices<N>::type());
+}
+
+constexpr PieceDefinition standard_pieces[] =
+{
+    { 'I', 1, "..#.."
+              "..#.."
+              "..#.."
+              "..#.."
+              "....." },
+    { 'J', 2, "....."
+              "..#.."
+              "..#.."
+              ".##.."
+              "....." },
+    { 'L', 3, "....."
+              "..#.."
+              "..#.."
+              "..##."
+              "....." },
+    { 'O', 4, "....."
+              ".##.."
+              ".##.."
+              "....."
+              "....." },
+    { 'S', 5, "....."
+              ".#..."
+              ".##.."
+              "..#.."
+              "....." },
+    { 'T', 6, "....."
+              "..#.."
+              ".###."
+              "....."
+              "....." },
+    { 'Z', 7, "....."
+              "..#.."
+              ".##.."
+              ".#..."
+              "....." },
+};
+
+//The 18 one-sided pentominoes, the mirrored ones are E, J, M, Q, A and S
+constexpr PieceDefinition pentomino_pieces[] =
+{
+    { 'F', 1, "....."
+              "..##."
+              ".##.."
+              "..#.."
+              "....." },
+    { 'E', 2, "....."
+              ".##.."
+              "..##."
+              "..#.."
+              "....." },
+    { 'I', 3, "..#.."
+              "..#.."
+              "..#.."
+              "..#.."
+              "..#.." },
+    { 'L', 4, "..#.."
+              "..#.."
+              "..#.."
+              "..##."
+              "....." },
+    { 'J', 5, "..#.."
+              "..#.."
+              "..#.."
+              ".##.."
+              "....." },
+    { 'N', 6, "..#.."
+              "..#.."
+              ".##.."
+              ".#..."
+              "....." },
+    { 'M', 7, "..#.."
+              "..#.."
+              "..##."
+              "...#."
+              "....." },
+    { 'P', 1, "....."
+              ".##.."
+              ".##.."
+              ".#..."
+              "....." },
+    { 'Q', 2, "....."
+              ".##.."
+              ".##.."
+              "..#.."
+              "....." },
+    { 'T', 3, "....."
+              ".###."
+              "..#.."
+              "..#.."
+              "....." },
+    { 'U', 4, "....."
+              ".#.#."
+              ".###."
+              "....."
+              "....." },
+    { 'V', 5, "....."
+              ".#..."
+              ".#..."
+              ".###."
+              "....." },
+    { 'W', 6, "....."
+              ".#..."
+              ".##.."
+              "..##."
+              "....." },
+    { 'X', 7, "....."
+              "..#.."
+              ".###."
+              "..#.."
+              "....." },
+    { 'Y', 1, "..#.."
+              ".##.."
+              "..#.."
+              "..#.."
+              "....." },
+    { 'A', 2, "..#.."
+              "..##."
+              "..#.."
+              "..#.."
+              "....." },
+    { 'Z', 3, "....."
+              ".##.."
+              "..#.."
+              "..##."
+              "....." },
+    { 'S', 4, "....."
+              "..##."
+              "..#.."
+              ".##.."
+              "....." },
+};
+
+constexpr PieceDefinition monomino_pieces[] =
+{
+    { 'M', 4, "....."
+              "....."
+              "..#.."
+              "....."
+              "....." },
+};
+
+constexpr PieceSet standard_set = make_piece_set("standard", standard_pieces);
+constexpr PieceSet pentomino_set = make_piece_set("pentomino", pentomino_pieces);
+constexpr PieceSet monomino_set = make_piece_set("monomino", monomino_pieces);
+
+//A new piece set is a list of definitions above and an entry here
+const PieceSet* const piece_sets[] = { &standard_set, &pentomino_set, &monomino_set };
+const int PIECE_SETS = sizeof(piece_sets)/sizeof(piece_sets[0]);
+
+const PieceSet* piece_set = &standard_set; //The objects of the game, set before the game starts
+
+static_assert(standard_set.pieces[4].rotations == 1 && standard_set.pieces[1].rotations == 4, "The O doesn't turn");
+static_assert(standard_set.blocks == 4 && pentomino_set.blocks == 5, "Every object is a tetromino or a pentomino");
+
+//Returns the piece set with the name, or NULL
+const PieceSet* find_piece_set(const string& name)
+{
+    for (int i = 0; i < PIECE_SETS; ++i)
+    {
+        if (name == piece_sets[i]->name)
+            return piece_sets[i];
+    }
+    return NULL;
+}
+
+//Returns the index of the piece set of the game in piece_sets, what streams and files record
+int piece_set_id()
+{
+    for (int i = 0; i < PIECE_SETS; ++i)
+    {
+        if (piece_sets[i] == piece_set)
+            return i;
+    }
+    return 0;
+}
+
+//Returns the object type with the name in the piece set, 0 if there is none
+int piece_type(char name)
+{
+    for (int type = 1; type <= piece_set->count; ++type)
+    {
+        if (piece_set->pieces[type].name == name)
+            return type;
+    }
+    return 0;
+}
+
+//Returns the name of an object type, '-' for no object
+char piece_name(int type, const PieceSet& set = *piece_set)
+{
+    return (type > 0 && type <= set.count) ? set.pieces[type].name : '-';
+}
+
+//Draws the next type from a seeded sequence, never the same type twice in a row if the set has more than one
+int draw_type(Uint32& seed, int previous)
+{
+    int type;
+    do
+    {
+        seed = seed * 1103515245 + 12345;
+        type = (seed >> 16) % piece_set->count + 1;
+    } while (type == previous && piece_set->count > 1);
+    return type;
+}
+
+class Object : public Tetris
+{
+public:
+    Object(Uint8 type, int xPos = 3, const PieceSet& set = *piece_set)
+    : type_(type), xPos_(0), yPos_(0), rotation_(0), exchanged(false), piece_(&set.pieces[type]) { set_shape(); spawn(xPos); }
+    
+    //Get-functions
+    Uint8 get_type() const { return type_; }
+    int get_xPos() const { return xPos_; } //Returns x-pos for the 5x5-objects [0][0]-block
+    int get_yPos() const { return yPos_; } //Returns y-pos for the 5x5-objects [0][0]-block
+    Uint8 get_row_mask(int j) const { return shape_->rows[j]; } //Bit i is set if matrix_[i][j] holds a block
+    int get_rotation() const { return rotation_; } //Number of right rotations from the spawn position, 0-3
+    int get_rotations() const { return piece_->rotations; } //Different rotations of the object
+    int get_top() const { return shape_->top; } //First and last row of the 5x5-object with a block
+    int get_bottom() const { return shape_->bottom; }
+
+    //Sets and actions
+    void set_xPos(int xPos) { xPos_ = xPos; }
+    void set_yPos(int yPos) { yPos_ = yPos; }
+    void spawn(int xPos) { xPos_ = xPos + piece_->spawn_dx; yPos_ = 0; } //Puts the object at a boards spawn column
+    void set_exchanged() { exchanged = true; }
+    void rotate_left();
+    void rotate_right();
+    
+    //Draw functions, blocks outside the boards view are skipped
+    void draw_object(const BoardView&);
+    void draw_saved_object();
+    void draw_next();
+    void draw_predicted_position(const BoardView&);
+    
+    bool isExchanged() { return exchanged; }
+    
+    //Variables
+    const Uint8 (*matrix_)[5]; //5x5 matrix of block colors the object is built of, points into the piece set
+    
+private:
+    Uint8 type_; //Object in the piece set, 1=I, 2=J, 3=L, 4=O, 5=S, 6=T, 7=Z in the standard set
+    int xPos_;
+    int yPos_;
+    int rotation_;
+    bool exchanged;
+    const PieceInfo* piece_; //In the piece set the object was made with
+    const PieceShape* shape_; //The piece in its current rotation
+    
+    void set_shape() { shape_ = &piece_->shapes[rotation_]; matrix_ = shape_->matrix; }
+};
+
+void Object::rotate_left()
+{
+    if (piece_->rotations > 1) //Pieces like the O (square) do not rotate
+    {
+        rotation_ = (rotation_ + 3) % 4;
+        set_shape();
+    }
+}
+
+void Object::rotate_right()
+{
+    if (piece_->rotations > 1) //Pieces like the O (square) do not rotate
+    {
+        rotation_ = (rotation_ + 1) % 4;
+        set_shape();
+    }
+}
+
+void Object::draw_object(const BoardView& view)
+{
+    for (int i=0; i<5; ++i)
+    {
+        for (int j=0; j<5; ++j)
+        {
+            const int x = get_xPos() + i - view.left;
+            const int y = get_yPos() + j - view.top;
+            if (matrix_[i][j] != 0 && x >= 0 && x < view.cols && y >= 0 && y < view.rows)
+            {
+                apply_block(view.xpos+(x*BLOCK_SIZE), view.ypos+(y*BLOCK_SIZE), matrix_[i][j]);
+            }
+        }
+    }
+}
+
+void Object::draw_next()
+{
+    apply_board(NEXT_XPOS - BLOCK_SIZE, 0, SCREEN_WIDTH - (NEXT_XPOS - BLOCK_SIZE), OBJECT_YPOS + 5*BLOCK_SIZE, background);
+    for (int i=0; i<5; ++i)
+    {
+        for (int j=0; j<5; ++j)
+        {
+            if (matrix_[i][j] != 0)
+            {
+                apply_block(NEXT_XPOS+(i*BLOCK_SIZE), OBJECT_YPOS+(j*BLOCK_SIZE), matrix_[i][j]);
+            }
+        }
+    }
+}
+
+void Object::draw_saved_object()
+{
+    apply_board(0, 0, BOARD_XPOS, SCREEN_HEIGHT, background);
+    for (int i=0; i<5; ++i)
+    {
+        for (int j=0; j<5; ++j)
+        {
+            if (matrix_[i][j] != 0)
+            {
+                apply_block(SAVED_XPOS+(i*BLOCK_SIZE), OBJECT_YPOS+(j*BLOCK_SIZE), matrix_[i][j]);
+            }
+        }
+    }
+}
+
+void Object::draw_predicted_position(const BoardView& view)
+{
+    for (int i=0; i<5; ++i)
+    {
+        for (int j=0; j<5; ++j)
+        {
+            const int x = get_xPos() + i - view.left;
+            const int y = get_yPos() + j - view.top;
+            if (matrix_[i][j] != 0 && x >= 0 && x < view.cols && y >= 0 && y < view.rows)
+            {
+                apply_edge(view.xpos+(x*BLOCK_SIZE), view.ypos+(y*BLOCK_SIZE));
+            }
+        }
+    }
+}
+
+
+//Score and level, shared by all board types
+class BoardBase : public Tetris
+{
+public:
+    BoardBase()
+    : score_(0), level_(1), shown_score_(-1), shown_level_(-1) {}
+    
+    void increase_score(int&);
+    void increase_level() { ++level_; }
+    int get_score() const { return score_; }
+    int get_level() const { return level_; }
+    
+    void print_score_level();
+    void reset_score_level() { score_ = 0; level_ = 1; }
+    
+protected:
+    int score_;
+    int level_;
+    int shown_score_; //Score and level in score_message and level_message
+    int shown_level_;
+    char shown_score_text_[12];
+    char shown_level_text_[12];
+};
+
+void BoardBase::increase_score(int& rows)
+{
+    if (rows == 1)
+        score_ += 100;
+    else if(rows == 2)
+        score_ += 250;
+    else if (rows == 3)
+        score_ += 400;
+    else if (rows == 4)
+        score_ += 550;
+}
+
+void BoardBase::print_score_level()
+{
+    //The texts are only rendered again when they have changed
+    if (score_ != shown_score_ || score_message == NULL)
+    {
+        snprintf(shown_score_text_, sizeof(shown_score_text_), "%d", score_);
+        SDL_FreeSurface(score_message);
+        score_message = TTF_RenderText_Solid(font, shown_score_text_, textColor);
+        shown_score_ = score_;
+    }
+    
+    if (level_ != shown_level_ || level_message == NULL)
+    {
+        snprintf(shown_level_text_, sizeof(shown_level_text_), "%d", level_);
+        SDL_FreeSurface(level_message);
+        level_message = TTF_RenderText_Solid(font, shown_level_text_, textColor);
+        shown_level_ = level_;
+    }
+    
+    apply_board(NEXT_XPOS, SCORE_YPOS, SCREEN_WIDTH - NEXT_XPOS, SCREEN_HEIGHT - SCORE_YPOS, background);
+    apply_text(NEXT_XPOS, SCORE_YPOS, shown_score_text_, score_message);
+    apply_text(NEXT_XPOS, LEVEL_YPOS, shown_level_text_, level_message);
+}
+
+//Smallest unsigned word that holds one bit per column of a board row
+template<int Width>
+struct RowWord
+{
+    typedef typename conditional<(Width <= 8), Uint8,
+            typename conditional<(Width <= 16), Uint16, Uint32>::type>::type type;
+};
+
+//Calls f(0)..f(N-1) with the loop unrolled at compile time
+template<int N>
+struct Unroll
+{
+    template<typename F>
+    static void apply(F& f) { Unroll<N-1>::apply(f); f(N-1); }
+};
+
+template<>
+struct Unroll<0>
+{
+    template<typename F>
+    static void apply(F&) {}
+};
+
+template<int Width, int Height>
+class BasicBoard : public BoardBase
+{
+public:
+    static_assert(Width >= 4 && Width <= 32, "Board width must fit an object and a 32-bit row word");
+    
+    typedef typename RowWord<Width>::type row_t;
+    static const int width = Width;
+    static const int rows = Height + HIDDEN_ROWS; //Visible rows plus the invisible spawn rows
+    static const int view_cols = (Width < BOARD_WIDTH) ? Width : BOARD_WIDTH; //Wider boards are seen through the standard view, between the panels
+    static const int xpos = (SCREEN_WIDTH - view_cols*BLOCK_SIZE)/2; //The view is centered horizontally
+    static const int spawn_x = Width/2 - 2; //Puts the 5x5-object in the middle, x=3 on the standard board
+    static const row_t full_row = static_cast<row_t>((Uint64(1) << Width) - 1);
+    
+    BasicBoard() { init_boardMatrix(); }
+    
+    void init_boardMatrix();
+    void draw_board();
+    void follow(const Object&); //Moves the view sideways to keep the object in the middle
+    BoardView get_view() const { BoardView view = { xpos, BOARD_YPOS + HIDDEN_ROWS*BLOCK_SIZE, view_left_, HIDDEN_ROWS, view_cols, Height }; return view; }
+    bool isMovementPossible(const Object&) const; //Returns false if we've done something illegal
+    int get_cell(int x, int y) const { return boardMatrix[y][x]; } //Object type of the stored block, 0 if empty
+    void set_cell(int x, int y, int type); //For puzzles, a full row isn't cleared
+    void store_object(Object&);
+    int clear_row(Object&); //Clears all full rows the object touches, adds the score and returns the number of rows
+    void drop_blocks(int); //Moves the stored blocks above the argument-row down over the full rows
+    bool isGameover(Object&);
+    int get_height() const; //Rows from the bottom up to the highest block
+    int count_holes() const; //Empty blocks with a taken block somewhere above them
+    
+private:
+    Uint8 boardMatrix[rows][Width]; //Object type of every stored block, 0 if empty
+    row_t rowBits_[rows]; //One bit per column, set if the block is taken
+    int view_left_; //First column in view, always 0 when the whole board fits
+};
+
+template<int Width, int Height>
+void BasicBoard<Width, Height>::init_boardMatrix()
+{
+    for (int y=0; y<rows; ++y)
+    {
+        for (int x=0; x<Width; ++x)
+            boardMatrix[y][x] = 0;
+        rowBits_[y] = 0;
+    }
+    view_left_ = (Width - view_cols)/2;
+}
+
+template<int Width, int Height>
+void BasicBoard<Width, Height>::follow(const Object& object)
+{
+    view_left_ = min(max(object.get_xPos() + 2 - view_cols/2, 0), Width - view_cols);
+}
+
+template<int Width, int Height>
+void BasicBoard<Width, Height>::draw_board()
+{
+    for (int y=HIDDEN_ROWS; y<rows; ++y)
+    {
+        for (int x=0; x<view_cols; ++x)
+        {
+            if (boardMatrix[y][view_left_ + x] != 0)
+            {
+                apply_block(xpos+(x*BLOCK_SIZE), BOARD_YPOS+(y*BLOCK_SIZE), boardMatrix[y][view_left_ + x]);
+            }
+            else
+                apply_board(xpos+(x*BLOCK_SIZE), BOARD_YPOS+(y*BLOCK_SIZE), BLOCK_SIZE, BLOCK_SIZE, background);
+        }
+    }
+}
+
+template<int Width, int Height>
+bool BasicBoard<Width, Height>::isMovementPossible(const Object& object) const
+{
+    const int x = object.get_xPos();
+    const int y = object.get_yPos();
+    const Uint64 walls = ~Uint64(full_row); //Every bit right of the board counts as a taken block
+    Uint64 collision = 0;
+    
+    //Each of the five object rows is shifted into board coordinates and tested against the stored row,
+    //without branching out early so the compiler can unroll it completely
+    auto test_row = [&](int j)
+    {
+        const Uint64 mask = object.get_row_mask(j);
+        const int row = y + j;
+        
+        if (x < 0)
+            collision |= (mask & ((Uint64(1) << -x) - 1)) | ((mask >> -x) & walls); //Blocks left of the board
+        else
+            collision |= (mask << x) & walls;
+        
+        if (row >= rows)
+            collision |= mask; //Blocks below the board
+        else if (row >= 0)
+            collision |= (x < 0 ? mask >> -x : mask << x) & rowBits_[row];
+    };
+    Unroll<5>::apply(test_row);
+    
+    return collision == 0;
+}
+
+template<int Width, int Height>
+void BasicBoard<Width, Height>::set_cell(int x, int y, int type)
+{
+    boardMatrix[y][x] = type;
+    if (type != 0)
+        rowBits_[y] |= row_t(1) << x;
+    else
+        rowBits_[y] &= ~(row_t(1) << x);
+}
+
+template<int Width, int Height>
+void BasicBoard<Width, Height>::store_object(Object& current)
+{
+    const int x = current.get_xPos();
+    const int y = current.get_yPos();
+    
+    auto store_row = [&](int j)
+    {
+        if (current.get_row_mask(j) == 0 || y+j < 0) //Blocks above the board are lost, the game is over anyway
+            return;
+        
+        rowBits_[y+j] |= static_cast<row_t>(x < 0 ? current.get_row_mask(j) >> -x : current.get_row_mask(j) << x);
+        for (int i=0; i<5; ++i)
+        {
+            if (current.matrix_[i][j] != 0)
+                boardMatrix[y+j][x+i] = current.matrix_[i][j];
+        }
+    };
+    Unroll<5>::apply(store_row);
+}
+
+template<int Width, int Height>
+int BasicBoard<Width, Height>::clear_row(Object& current)
+{
+    int rows_cleared = 0;
+    int lowest = -1; //The lowest full row
+    
+    for (int y=max(current.get_yPos() + current.get_top(), 0); y<=(current.get_yPos() + current.get_bottom()) && y<rows; ++y) // Loop through the objects rows to clear
+    {
+        if (rowBits_[y] == full_row) // If every block of the row is taken
+        {
+            lowest = y;
+            ++rows_cleared;
+        }
+    }
+    
+    if (rows_cleared > 0)
+        drop_blocks(lowest); // Move down all the overlying blocks
+    
+    increase_score(rows_cleared);
+    return rows_cleared;
+}
+
+template<int Width, int Height>
+void BasicBoard<Width, Height>::drop_blocks(int y_init)
+{
+    //Compacts all rows from y_init and up in one pass, skipping the full ones
+    int to = y_init;
+    for (int from = y_init; from >= 0; --from)
+    {
+        if (rowBits_[from] == full_row)
+            continue;
+        if (to != from)
+        {
+            rowBits_[to] = rowBits_[from];
+            memcpy(boardMatrix[to], boardMatrix[from], Width);
+        }
+        --to;
+    }
+    
+    for (; to >= 0; --to) // The rows at the top are now empty
+    {
+        rowBits_[to] = 0;
+        memset(boardMatrix[to], 0, Width);
+    }
+}
+
+template<int Width, int Height>
+bool BasicBoard<Width, Height>::isGameover(Object& current)
+{
+    if (!isMovementPossible(current))
+        return true;
+    return false;
+}
+
+template<int Width, int Height>
+int BasicBoard<Width, Height>::get_height() const
+{
+    for (int y=0; y<rows; ++y)
+    {
+        if (rowBits_[y] != 0)
+            return rows - y;
+    }
+    return 0;
+}
+
+template<int Width, int Height>
+int BasicBoard<Width, Height>::count_holes() const
+{
+    row_t covered = 0; //Columns with a taken block above the row
+    int holes = 0;
+    for (int y=0; y<rows; ++y)
+    {
+        holes += __builtin_popcount(covered & ~rowBits_[y]);
+        covered |= rowBits_[y];
+    }
+    return holes;
+}
+
+//Board for the endurance variants, hundreds of columns and thousands of rows.
+//Rows are reached through a ring of row numbers, so clearing rows only moves row numbers
+//and never copies blocks. Only the rows under the object and the rows in view are ever touched.
+template<int Width, int Height>
+class HugeBoard : public BoardBase
+{
+public:
+    static_assert(Width >= BOARD_WIDTH && Height >= BOARD_HEIGHT, "A huge board must fill the standard view");
+    
+    static const int width = Width;
+    static const int rows = Height + HIDDEN_ROWS;
+    static const int spawn_x = Width/2 - 2;
+    
+    HugeBoard()
+    : cells_(rows*Width), fill_(rows), ring_(rows) { init_boardMatrix(); }
+    
+    void init_boardMatrix();
+    void draw_board(); //Draws the standard 10x20 view around the object
+    void follow(const Object&); //Moves the view to keep the object in the middle
+    BoardView get_view() const { BoardView view = { BOARD_XPOS, BOARD_YPOS + HIDDEN_ROWS*BLOCK_SIZE, view_left_, view_top_, BOARD_WIDTH, BOARD_HEIGHT }; return view; }
+    bool isMovementPossible(const Object&) const;
+    int get_cell(int x, int y) const { return row(y)[x]; }
+    void store_object(Object&);
+    int clear_row(Object&);
+    void drop_blocks(const int*, int); //Removes the given full rows, sorted from the top, and adds empty rows on top
+    bool isGameover(Object&);
+    int get_height() const { return rows - top_; }
+    int count_holes() const;
+    
+private:
+    int slot(int y) const { return (base_ + y < rows) ? base_ + y : base_ + y - rows; }
+    Uint8* row(int y) { return &cells_[ring_[slot(y)]*Width]; }
+    const Uint8* row(int y) const { return &cells_[ring_[slot(y)]*Width]; }
+    
+    vector<Uint8> cells_; //Object type of every stored block, one row after another
+    vector<int> fill_; //Number of taken blocks in each stored row
+    vector<int> ring_; //Row y is stored as row number ring_[(base_+y) % rows]
+    int base_;
+    int top_; //Highest row with blocks in it, everything above is empty
+    int view_left_;
+    int view_top_;
+};
+
+template<int Width, int Height>
+void HugeBoard<Width, Height>::init_boardMatrix()
+{
+    fill(cells_.begin(), cells_.end(), 0);
+    fill(fill_.begin(), fill_.end(), 0);
+    for (int y=0; y<rows; ++y)
+        ring_[y] = y;
+    
+    base_ = 0;
+    top_ = rows;
+    view_left_ = spawn_x + 2 - BOARD_WIDTH/2;
+    view_top_ = HIDDEN_ROWS;
+}
+
+template<int Width, int Height>
+void HugeBoard<Width, Height>::follow(const Object& object)
+{
+    view_left_ = min(max(object.get_xPos() + 2 - BOARD_WIDTH/2, 0), Width - BOARD_WIDTH);
+    view_top_ = min(max(object.get_yPos() + 2 - BOARD_HEIGHT/2, HIDDEN_ROWS), rows - BOARD_HEIGHT);
+}
+
+template<int Width, int Height>
+void HugeBoard<Width, Height>::draw_board()
+{
+    for (int y=0; y<BOARD_HEIGHT; ++y)
+    {
+        const Uint8* cells = row(view_top_ + y) + view_left_;
+        for (int x=0; x<BOARD_WIDTH; ++x)
+        {
+            if (cells[x] != 0)
+                apply_block(BOARD_XPOS+(x*BLOCK_SIZE), BOARD_YPOS+((y+HIDDEN_ROWS)*BLOCK_SIZE), cells[x]);
+            else
+                apply_board(BOARD_XPOS+(x*BLOCK_SIZE), BOARD_YPOS+((y+HIDDEN_ROWS)*BLOCK_SIZE), BLOCK_SIZE, BLOCK_SIZE, background);
+        }
+    }
+}
+
+template<int Width, int Height>
+bool HugeBoard<Width, Height>::isMovementPossible(const Object& object) const
+{
+    for (int j=0; j<5; ++j)
+    {
+        const int mask = object.get_row_mask(j);
+        const int y = object.get_yPos() + j;
+        if (mask == 0 || y < 0)
+            continue;
+        if (y >= rows) // Below the board
+            return false;
+        
+        const Uint8* cells = row(y);
+        for (int i=0; i<5; ++i)
+        {
+            const int x = object.get_xPos() + i;
+            if ((mask & (1 << i)) && (x < 0 || x >= Width || cells[x] != 0))
+                return false;
+        }
+    }
+    return true;
+}
+
+template<int Width, int Height>
+void HugeBoard<Width, Height>::store_object(Object& current)
+{
+    for (int j=0; j<5; ++j)
+    {
+        const int y = current.get_yPos() + j;
+        if (current.get_row_mask(j) == 0 || y < 0) //Blocks above the board are lost, the game is over anyway
+            continue;
+        
+        Uint8* cells = row(y);
+        for (int i=0; i<5; ++i)
+        {
+            if (current.matrix_[i][j] != 0)
+            {
+                cells[current.get_xPos()+i] = current.matrix_[i][j];
+                ++fill_[ring_[slot(y)]];
+            }
+        }
+        top_ = min(top_, y);
+    }
+}
+
+template<int Width, int Height>
+int HugeBoard<Width, Height>::clear_row(Object& current)
+{
+    int full[5];
+    int rows_cleared = 0;
+    
+    for (int y=current.get_yPos() + current.get_top(); y<=(current.get_yPos() + current.get_bottom()) && y<rows; ++y)
+    {
+        if (y >= 0 && fill_[ring_[slot(y)]] == Width)
+            full[rows_cleared++] = y;
+    }
+    
+    if (rows_cleared > 0)
+        drop_blocks(full, rows_cleared);
+    
+    increase_score(rows_cleared);
+    return rows_cleared;
+}
+
+template<int Width, int Height>
+void HugeBoard<Width, Height>::drop_blocks(const int* full, int count)
+{
+    //Empty the cleared rows, they are reused as the new rows on top
+    int freed[5];
+    for (int k=0; k<count; ++k)
+    {
+        freed[k] = ring_[slot(full[k])];
+        memset(&cells_[freed[k]*Width], 0, Width);
+        fill_[freed[k]] = 0;
+    }
+    
+    //Either the stack above the cleared rows moves down, or the rows below move up and the ring
+    //is turned so the freed rows come out on top. Only row numbers move, whichever side is shorter.
+    if (full[0] - top_ <= (rows-1) - full[count-1])
+    {
+        int to = full[count-1];
+        for (int from = full[count-1], k = count-1; from >= top_; --from)
+        {
+            if (k >= 0 && from == full[k])
+            {
+                --k;
+                continue;
+            }
+            ring_[slot(to--)] = ring_[slot(from)];
+        }
+        for (int k=0; k<count; ++k)
+            ring_[slot(to--)] = freed[k];
+    }
+    else
+    {
+        int to = full[0];
+        for (int from = full[0], k = 0; from < rows; ++from)
+        {
+            if (k < count && from == full[k])
+            {
+                ++k;
+                continue;
+            }
+            ring_[slot(to++)] = ring_[slot(from)];
+        }
+        for (int k=0; k<count; ++k)
+            ring_[slot(to++)] = freed[k];
+        base_ = slot(rows - count); //The freed rows at the bottom are now rows 0..count-1
+    }
+    
+    top_ = (top_ + count < rows) ? top_ + count : rows;
+}
+
+template<int Width, int Height>
+bool HugeBoard<Width, Height>::isGameover(Object& current)
+{
+    if (!isMovementPossible(current))
+        return true;
+    return false;
+}
+
+template<int Width, int Height>
+int HugeBoard<Width, Height>::count_holes() const
+{
+    //Only the rows from the top of the stack down can have holes
+    bool covered[Width] = {};
+    int holes = 0;
+    for (int y=top_; y<rows; ++y)
+    {
+        const Uint8* cells = row(y);
+        for (int x=0; x<Width; ++x)
+        {
+            holes += (covered[x] && cells[x] == 0);
+            covered[x] = covered[x] || cells[x] != 0;
+        }
+    }
+    return holes;
+}
+
+//The board variants we play on
+typedef BasicBoard<BOARD_WIDTH, BOARD_HEIGHT> Board; //Standard 10x20
+typedef BasicBoard<4, BOARD_HEIGHT> DrillBoard;
+typedef BasicBoard<16, BOARD_HEIGHT> WideBoard;
+typedef BasicBoard<32, BOARD_HEIGHT> ExtraWideBoard;
+typedef HugeBoard<200, 2000> EnduranceBoard;
+
+
+bool threaded_events = false; //SDL gathers the events on its own thread, see InputThread
+
+bool init()
+{
+    //Initialize all SDL subsystems, with the events gathered on a thread of their own where the
+    //platform supports it, so that they can be taken while the game thread is busy
+    threaded_events = SDL_Init(SDL_INIT_EVERYTHING | SDL_INIT_EVENTTHREAD) != -1;
+    if( !threaded_events && SDL_Init(SDL_INIT_EVERYTHING) == -1 )
+    {
+        return false;
+    }
+    
+    //Set up the screen, the size of the desktop in fullscreen
+    int width = window_settings.width;
+    int height = window_settings.height;
+    const SDL_VideoInfo* desktop = SDL_GetVideoInfo();
+    if (window_settings.fullscreen && desktop != NULL && desktop->current_w > 0)
+    {
+        width = desktop->current_w;
+        height = desktop->current_h;
+    }
+    screen = SDL_SetVideoMode( width, height, SCREEN_BPP, SDL_SWSURFACE | (window_settings.fullscreen ? SDL_FULLSCREEN : 0) );
+    
+    //If there was an error in setting up the screen
+    if( screen == NULL )
+    {
+        return false;
+    }
+    set_layout(screen->w, screen->h);
+    
+    if (TTF_Init() == -1)
+    {
+        return false;
+    }
+    
+    //Set the window caption
+    SDL_WM_SetCaption( "Tetris", NULL );
+    
+    //If everything initialized fine
+    return true;
+}
+
+//The images, each loaded when a scene that draws with it starts. The globals above point to them while
+//they're loaded and are NULL otherwise.
+enum AssetId
+{
+    ASSET_BLOCK_I, ASSET_BLOCK_J, ASSET_BLOCK_L, ASSET_BLOCK_O, ASSET_BLOCK_S, ASSET_BLOCK_T, ASSET_BLOCK_Z, ASSET_EDGE,
+    ASSET_BACKGROUND, ASSET_MENU, ASSET_HIGHSCORE_BG, ASSET_ENTER_NAME,
+    ASSET_PLAY, ASSET_PLAY_MARKED, ASSET_HIGHSCORE, ASSET_HIGHSCORE_MARKED, ASSET_QUIT, ASSET_QUIT_MARKED,
+    ASSET_COUNT
+};
+
+const struct { const char* path; SDL_Surface** surface; } asset_files[ASSET_COUNT] = {
+    { "Images/Blocks/I_Blue.png", &blockI }, { "Images/Blocks/J_Pink.png", &blockJ },
+    { "Images/Blocks/L_Bronze.png", &blockL }, { "Images/Blocks/O_Red.png", &blockO },
+    { "Images/Blocks/S_Yellow.png", &blockS }, { "Images/Blocks/T_Orange.png", &blockT },
+    { "Images/Blocks/Z_Green.png", &blockZ }, { "Images/Blocks/Edge.png", &edge },
+    { "Images/Background.png", &background }, { "Images/Menu.png", &background_menu },
+    { "Images/Highscore_bg.png", &background_hs }, { "Images/Transparent_Enter.png", &transparent },
+    { "Images/Buttons/Play.png", &play_button }, { "Images/Buttons/Play2.png", &play_marked },
+    { "Images/Buttons/Highscore.png", &highscore_button }, { "Images/Buttons/Highscore2.png", &highscore_marked },
+    { "Images/Buttons/Quit.png", &quit_button }, { "Images/Buttons/Quit2.png", &quit_marked } };
+
+//The assets every scene draws with, one bit per AssetId
+Uint32 scene_assets(GameState scene)
+{
+    switch (scene)
+    {
+        case MENU: return 1u << ASSET_MENU | 1u << ASSET_PLAY | 1u << ASSET_PLAY_MARKED | 1u << ASSET_HIGHSCORE
+            | 1u << ASSET_HIGHSCORE_MARKED | 1u << ASSET_QUIT | 1u << ASSET_QUIT_MARKED;
+        case PLAY: return ((1u << (ASSET_EDGE + 1)) - 1) | 1u << ASSET_BACKGROUND; //The blocks, the edge and the background
+        case HIGHSCORE: return 1u << ASSET_HIGHSCORE_BG;
+        case GAME_OVER: return 1u << ASSET_BACKGROUND | 1u << ASSET_ENTER_NAME;
+    }
+    return 0;
+}
+
+//The assets of the scenes that can follow a scene, they're loaded ahead
+Uint32 next_scene_assets(GameState scene)
+{
+    switch (scene)
+    {
+        case MENU: return scene_assets(PLAY) | scene_assets(HIGHSCORE);
+        case PLAY: return scene_assets(GAME_OVER);
+        case HIGHSCORE: return scene_assets(MENU);
+        case GAME_OVER: return scene_assets(HIGHSCORE) | scene_assets(MENU);
+    }
+    return 0;
+}
+
+struct AssetSettings
+{
+    size_t budget; //Bytes of images to keep loaded at 640x480, the window size scales it. Those a scene uses are kept even past it
+};
+AssetSettings asset_settings = { 4 << 20 }; //Every scene and the ones after it, the four backgrounds are 1.2 MB each
+
+//Loads the assets and counts who uses them. One no scene uses stays loaded as long as everything fits
+//the budget, then the least recently used go first, those the next scenes won't need before those they
+//will. The next scenes assets are loaded ahead on a thread of their own, as far as they fit the budget;
+//it only decodes and scales the files, they're converted to the screen format and bound on the game thread.
+class AssetManager
+{
+public:
+    //Keeps an asset loaded while it lives, copies share it
+    class Handle
+    {
+    public:
+        Handle() : manager_(NULL), id_(ASSET_COUNT) {}
+        Handle(const Handle& other) : manager_(other.manager_), id_(other.id_) { if (manager_ != NULL) ++manager_->slots_[id_].refs; }
+        Handle& operator=(Handle other) { swap(manager_, other.manager_); swap(id_, other.id_); return *this; }
+        ~Handle() { if (manager_ != NULL) --manager_->slots_[id_].refs; }
+        
+        SDL_Surface* get() const { return (manager_ != NULL) ? manager_->slots_[id_].surface : NULL; }
+        
+    private:
+        friend class AssetManager;
+        Handle(AssetManager* manager, AssetId id) : manager_(manager), id_(id) {}
+        
+        AssetManager* manager_;
+        AssetId id_;
+    };
+    
+    explicit AssetManager(size_t budget);
+    ~AssetManager(); //Frees every asset, no handle may be left
+    
+    Handle acquire(AssetId); //Loads the asset now if it isn't loaded or loaded ahead
+    void prefetch(Uint32 wanted); //Starts loading these assets ahead, one bit per AssetId
+    void trim(Uint32 wanted); //Frees unused assets until the budget is kept, those not in wanted first
+    size_t get_resident(); //Bytes of loaded images
+    
+private:
+    struct Slot
+    {
+        SDL_Surface* surface; //In the screen format, NULL if not loaded
+        SDL_Surface* decoded; //Loaded ahead, not converted yet
+        bool scaled; //decoded is at the window size already
+        size_t bytes; //Of surface or decoded
+        int refs; //Handles to it
+        Uint64 last_used;
+    };
+    
+    void prefetch_loop(Uint32 wanted);
+    void stop_prefetch();
+    
+    Slot slots_[ASSET_COUNT];
+    size_t budget_;
+    size_t resident_;
+    Uint64 clock_; //Counts acquires, for the least recently used
+    mutex lock_; //Guards everything but refs against the prefetch thread, only the game thread sets surface
+    thread loader_;
+    atomic<bool> stop_;
+};
+
+AssetManager::AssetManager(size_t budget)
+: budget_(budget), resident_(0), clock_(0), stop_(false)
+{
+    for (int id = 0; id < ASSET_COUNT; ++id)
+    {
+        const Slot empty = { NULL, NULL, false, 0, 0, 0 };
+        slots_[id] = empty;
+    }
+}
+
+AssetManager::~AssetManager()
+{
+    stop_prefetch();
+    for (int id = 0; id < ASSET_COUNT; ++id)
+    {
+        SDL_FreeSurface(slots_[id].surface);
+        SDL_FreeSurface(slots_[id].decoded);
+        *asset_files[id].surface = NULL;
+    }
+}
+
+AssetManager::Handle AssetManager::acquire(AssetId id)
+{
+    Slot& slot = slots_[id];
+    unique_lock<mutex> lock(lock_);
+    slot.last_used = ++clock_;
+    if (slot.surface == NULL)
+    {
+        SDL_Surface* decoded = slot.decoded;
+        const bool scaled = slot.scaled;
+        slot.decoded = NULL;
+        resident_ -= (decoded != NULL) ? slot.bytes : 0;
+        lock.unlock();
+        
+        SDL_Surface* surface = NULL;
+        if (decoded != NULL)
+        {
+            surface = SDL_DisplayFormatAlpha(decoded);
+            SDL_FreeSurface(decoded);
+            if (!scaled)
+                surface = scale_to_layout(surface);
+        }
+        else
+            surface = scale_to_layout(load_image(asset_files[id].path));
+        if (surface == NULL)
+            fprintf(stderr, "Can't load %s\n", asset_files[id].path);
+        
+        lock.lock();
+        if (slot.decoded != NULL) //The prefetch thread loaded it too while the lock was let go
+        {
+            SDL_FreeSurface(slot.decoded);
+            slot.decoded = NULL;
+            resident_ -= slot.bytes;
+        }
+        slot.surface = surface;
+        slot.bytes = (surface != NULL) ? surface->pitch*surface->h : 0;
+        resident_ += slot.bytes;
+        *asset_files[id].surface = surface;
+    }
+    ++slot.refs;
+    return Handle(this, id);
+}
+
+void AssetManager::prefetch(Uint32 wanted)
+{
+    stop_prefetch();
+    for (int id = 0; id < ASSET_COUNT; ++id)
+    {
+        if (slots_[id].surface != NULL || slots_[id].decoded != NULL)
+            wanted &= ~(1u << id);
+    }
+    if (wanted != 0)
+        loader_ = thread(&AssetManager::prefetch_loop, this, wanted);
+}
+
+void AssetManager::prefetch_loop(Uint32 wanted)
+{
+    for (int id = 0; id < ASSET_COUNT && !stop_; ++id)
+    {
+        if ((wanted & (1u << id)) == 0)
+            continue;
+        
+        //Only 32-bit images can be scaled here, the others are once they're converted
+        SDL_Surface* decoded = IMG_Load(asset_files[id].path);
+        const bool scaled = decoded != NULL && decoded->format->BytesPerPixel == 4;
+        if (scaled)
+            decoded = scale_to_layout(decoded);
+        if (decoded == NULL)
+            continue;
+        const size_t bytes = decoded->pitch*decoded->h;
+        
+        lock_guard<mutex> lock(lock_);
+        Slot& slot = slots_[id];
+        if (slot.surface != NULL || slot.decoded != NULL || resident_ + bytes > budget_)
+        {
+            SDL_FreeSurface(decoded); //Loaded meanwhile, or it doesn't fit
+            continue;
+        }
+        slot.decoded = decoded;
+        slot.scaled = scaled;
+        slot.bytes = bytes;
+        slot.last_used = ++clock_;
+        resident_ += bytes;
+    }
+}
+
+void AssetManager::stop_prefetch()
+{
+    if (!loader_.joinable())
+        return;
+    stop_ = true;
+    loader_.join();
+    stop_ = false;
+}
+
+void AssetManager::trim(Uint32 wanted)
+{
+    lock_guard<mutex> lock(lock_);
+    while (resident_ > budget_)
+    {
+        int victim = -1;
+        for (int id = 0; id < ASSET_COUNT; ++id)
+        {
+            const Slot& slot = slots_[id];
+            if (slot.refs > 0 || (slot.surface == NULL && slot.decoded == NULL))
+                continue;
+            
+            const bool needed = (wanted & (1u << id)) != 0;
+            const bool victim_needed = victim >= 0 && (wanted & (1u << victim)) != 0;
+            if (victim < 0 || needed < victim_needed || (needed == victim_needed && slot.last_used < slots_[victim].last_used))
+                victim = id;
+        }
+        if (victim < 0)
+            break; //Everything loaded is in use
+        
+        Slot& slot = slots_[victim];
+        SDL_FreeSurface(slot.surface);
+        SDL_FreeSurface(slot.decoded);
+        slot.surface = NULL;
+        slot.decoded = NULL;
+        *asset_files[victim].surface = NULL;
+        resident_ -= slot.bytes;
+        slot.bytes = 0;
+    }
+}
+
+size_t AssetManager::get_resident()
+{
+    lock_guard<mutex> lock(lock_);
+    return resident_;
+}
+
+AssetManager* assets = NULL; //Created by load_files
+
+//The assets a scene draws with, loaded while it lives. Those of the scenes that can follow are loaded ahead.
+class Scene
+{
+public:
+    explicit Scene(GameState);
+    
+private:
+    AssetManager::Handle handles_[ASSET_COUNT];
+};
+
+Scene::Scene(GameState scene)
+{
+    if (assets == NULL)
+        return;
+    
+    const Uint32 used = scene_assets(scene);
+    const Uint32 next = next_scene_assets(scene);
+    for (int id = 0; id < ASSET_COUNT; ++id)
+    {
+        if (used & (1u << id))
+            handles_[id] = assets->acquire(AssetId(id));
+    }
+    assets->trim(next);
+    assets->prefetch(next);
+}
+
+bool load_files()
+{
+    //The images are loaded by the scenes that draw with them, here they only have to be there
+    bool found = true;
+    for (int id = 0; id < ASSET_COUNT; ++id)
+    {
+        if (access(asset_files[id].path, R_OK) != 0)
+        {
+            fprintf(stderr, "Can't find %s\n", asset_files[id].path);
+            found = false;
+        }
+    }
+    assets = new AssetManager(static_cast<size_t>(asset_settings.budget) * layout.block*layout.block/(BLOCK_SIZE*BLOCK_SIZE));
+    
+    font = TTF_OpenFont("DrawingPad.ttf", layout.scale(28) ); //Texts are rendered at the window size
+    
+    
+    //If there was an error in loading the image
+    if( !found || font == NULL)
+    {
+        return false;
+    }
+    
+    //If everything loaded fine
+    return true;
+}
+
+void clean_up()
+{
+    //Free the images
+    delete assets;
+    assets = NULL;
+    
+    //And the texts
+    SDL_FreeSurface(score_message);
+    SDL_FreeSurface(level_message);
+    SDL_FreeSurface(highscore_candidate);
+    SDL_FreeSurface(name);
+    score_message = level_message = highscore_candidate = name = NULL;
+    TTF_CloseFont(font);
+    font = NULL;
+    
+    delete renderer;
+    renderer = NULL;
+    
+    //Quit SDL
+    SDL_Quit();
+}
+
+int get_new_random(Object& current)
+{
+    int next_type = (SDL_GetTicks() % piece_set->count) +1;
+    
+    while(next_type == current.get_type() && piece_set->count > 1)
+    {
+        next_type = (SDL_GetTicks() % piece_set->count) +1;
+    }
+
+    return next_type;
+}
+
+template<typename BoardType>
+void update_predicted_position(Object& predicted_position, Object& current, BoardType& board)
+{
+    predicted_position = current;
+    while (board.isMovementPossible(predicted_position))
+    {
+        predicted_position.set_yPos(predicted_position.get_yPos() +1);
+    }
+    predicted_position.set_yPos(predicted_position.get_yPos() -1);
+}
+
+void view_menu(bool& quit, GameState& state)
+{
+    Scene scene(MENU);
+    Tetris tetris;
+    tetris.apply_surface(0, 0, background_menu);
+    renderer->present();
+    Uint8 menu_state = 0;
+    
+    bool leave_state = false;
+    
+    while(!leave_state)
+    {
+        while(SDL_PollEvent(&event))
+        {
+            
+            if (menu_state == 0)
+            {
+                tetris.apply_surface(0, 0, background_menu);
+                tetris.apply_surface(MENU_XPOS, MENU_YPOS, play_marked);
+                tetris.apply_surface(MENU_XPOS, MENU_YPOS+BUTTON_HEIGHT, highscore_button);
+                tetris.apply_surface(MENU_XPOS, MENU_YPOS+(BUTTON_HEIGHT*2), quit_button);
+                renderer->present();
+            }
+            else if (menu_state == 1)
+            {
+                tetris.apply_surface(0, 0, background_menu);
+                tetris.apply_surface(MENU_XPOS, MENU_YPOS, play_button);
+                tetris.apply_surface(MENU_XPOS, MENU_YPOS+BUTTON_HEIGHT, highscore_marked);
+                tetris.apply_surface(MENU_XPOS, MENU_YPOS+(BUTTON_HEIGHT*2), quit_button);
+                renderer->present();
+            }
+            else if (menu_state == 2)
+            {
+                tetris.apply_surface(0, 0, background_menu);
+                tetris.apply_surface(MENU_XPOS, MENU_YPOS, play_button);
+                tetris.apply_surface(MENU_XPOS, MENU_YPOS+BUTTON_HEIGHT, highscore_button);
+                tetris.apply_surface(MENU_XPOS, MENU_YPOS+(BUTTON_HEIGHT*2), quit_marked);
+                renderer->present();
+            }
+            
+            //If the user has Xed out the window
+            if( event.type == SDL_QUIT )
+            {
+                leave_state = true;
+                //Quit the program
+                quit = true;
+            }
+            
+            if (event.type == SDL_KEYDOWN)
+            {
+                if (event.key.keysym.sym == SDLK_DOWN && menu_state < 2)
+                    ++menu_state;
+                
+                if (event.key.keysym.sym == SDLK_UP && menu_state > 0)
+                    --menu_state;
+                
+                if (event.key.keysym.sym == SDLK_RETURN)
+                {
+                    if (menu_state == 0)
+                    {
+                        leave_state = true;
+                        state = PLAY;
+                    }
+                    else if (menu_state == 1)
+                    {
+                        leave_state = true;
+                        state = HIGHSCORE;
+                    }
+                    else if (menu_state == 2)
+                    {
+                        leave_state = true;
+                        quit = true;
+                    }
+                }
+            }
+            
+        }
+        
+    }
+
+}
+
+//What a spectator sees of a game: the boards view, the objects and the score
+struct SpectatorState
+{
+    SpectatorState()
+    : pieces(0), cols(0), rows(0), current(0), rotation(0), x(0), y(0), ghost_y(0), next(0), hold(0), score(0), level(0) {}
+    
+    int pieces; //The piece set in piece_sets
+    int cols; //Size of the boards view
+    int rows;
+    vector<Uint8> cells; //Object type of every block in the view, row after row
+    int current; //Type and rotation of the falling object
+    int rotation;
+    int x; //Position of the falling object in the view
+    int y;
+    int ghost_y; //Row of the predicted position
+    int next; //Type of the next and the saved object, 0 if there is none
+    int hold;
+    int score;
+    int level;
+};
+
+//Fills state with what the game shows
+template<typename BoardType>
+void capture_state(const BoardType& board, const Object& current, const Object& predicted_position, const Object& next,
+                   const Object* saved_object, SpectatorState& state)
+{
+    const BoardView view = board.get_view();
+    
+    state.pieces = piece_set_id();
+    state.cols = view.cols;
+    state.rows = view.rows;
+    state.cells.resize(view.cols*view.rows);
+    for (int y = 0; y < view.rows; ++y)
+    {
+        for (int x = 0; x < view.cols; ++x)
+            state.cells[y*view.cols + x] = board.get_cell(view.left + x, view.top + y);
+    }
+    
+    state.current = current.get_type();
+    state.rotation = current.get_rotation();
+    state.x = current.get_xPos() - view.left;
+    state.y = current.get_yPos() - view.top;
+    state.ghost_y = predicted_position.get_yPos() - view.top;
+    state.next = next.get_type();
+    state.hold = (saved_object != NULL) ? saved_object->get_type() : 0;
+    state.score = board.get_score();
+    state.level = board.get_level();
+}
+
+//Score and level of a watched game, drawn like the boards own
+class WatchedScore : public BoardBase
+{
+public:
+    void set(int score, int level) { score_ = score; level_ = level; }
+};
+
+//Builds an object of the given type and rotation
+Object rotated_object(int type, int rotation, int x, int y, const PieceSet& set = *piece_set)
+{
+    Object object(type, 3, set);
+    object.set_xPos(x);
+    object.set_yPos(y);
+    for (int i = 0; i < rotation; ++i)
+        object.rotate_right();
+    return object;
+}
+
+//Draws the blocks and the falling object of a state with the board at xpos
+void draw_board_state(const SpectatorState& state, int xpos)
+{
+    Tetris tetris;
+    const BoardView view = { xpos, BOARD_YPOS + HIDDEN_ROWS*BLOCK_SIZE, 0, 0, state.cols, state.rows };
+    
+    for (int y = 0; y < state.rows; ++y)
+    {
+        for (int x = 0; x < state.cols; ++x)
+        {
+            const int cell = state.cells[y*state.cols + x];
+            if (cell != 0)
+                tetris.apply_block(view.xpos+(x*BLOCK_SIZE), view.ypos+(y*BLOCK_SIZE), cell);
+            else
+                tetris.apply_board(view.xpos+(x*BLOCK_SIZE), view.ypos+(y*BLOCK_SIZE), BLOCK_SIZE, BLOCK_SIZE, background);
+        }
+    }
+    
+    if (state.current != 0)
+    {
+        const PieceSet& set = *piece_sets[state.pieces]; //The watched game can use other objects than this one
+        rotated_object(state.current, state.rotation, state.x, state.ghost_y, set).draw_predicted_position(view);
+        rotated_object(state.current, state.rotation, state.x, state.y, set).draw_object(view);
+    }
+}
+
+void draw_spectator_state(const SpectatorState& state, WatchedScore& score)
+{
+    draw_board_state(state, (SCREEN_WIDTH - state.cols*BLOCK_SIZE)/2);
+    if (state.next != 0)
+        Object(state.next, 3, *piece_sets[state.pieces]).draw_next();
+    if (state.hold != 0)
+        Object(state.hold, 3, *piece_sets[state.pieces]).draw_saved_object();
+    
+    score.set(state.score, state.level);
+    score.print_score_level();
+    renderer->present();
+}
+
+
+//Spectator stream format. Every frame is a header, the payload length as a varint and the payload.
+//  Keyframe: A5 'T' 'K' len | version pieces | cols rows | cells as (run, type) pairs | piece x y ghost_y preview score level
+//  Delta:    'D' len | flags | changed cells, piece, position, ghost, preview, score and level as flagged
+//A piece is two bytes, type and rotation, and a preview is two bytes, next and hold. pieces is the piece
+//set in piece_sets. Positions, the ghost row and the score are sent as signed differences. A changed
+//cell is (cells skipped << 4) | color. Keyframes start with a three byte sync word, so a spectator
+//joining late can find the next one.
+const Uint8 SPECTATOR_VERSION = 2; //Version 1 had the type and rotation in one byte, and no piece set
+enum SpectatorFlags
+{
+    SPECTATE_CELLS = 1,
+    SPECTATE_PIECE = 2,
+    SPECTATE_POSITION = 4,
+    SPECTATE_GHOST = 8,
+    SPECTATE_PREVIEW = 16,
+    SPECTATE_SCORE = 32,
+    SPECTATE_LEVEL = 64
+};
+
+void put_varint(vector<Uint8>& out, Uint32 value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(static_cast<Uint8>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<Uint8>(value));
+}
+
+void put_signed(vector<Uint8>& out, int value)
+{
+    put_varint(out, (static_cast<Uint32>(value) << 1) ^ static_cast<Uint32>(value >> 31));
+}
+
+bool get_varint(const Uint8*& data, const Uint8* end, Uint32& value)
+{
+    value = 0;
+    for (int shift = 0; data < end && shift < 35; shift += 7)
+    {
+        const Uint8 byte = *data++;
+        value |= static_cast<Uint32>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool get_signed(const Uint8*& data, const Uint8* end, int& value)
+{
+    Uint32 zigzag;
+    if (!get_varint(data, end, zigzag))
+        return false;
+    value = static_cast<int>(zigzag >> 1) ^ -static_cast<int>(zigzag & 1);
+    return true;
+}
+
+//Publishes the game to spectators, to a file or to a local socket that spectators connect to.
+//Only the changes since the last frame are sent, with a keyframe every couple of seconds.
+class SpectatorStream
+{
+public:
+    SpectatorStream()
+    : file_(-1), listener_(-1), last_keyframe_(0) { spectators_.reserve(MAX_SPECTATORS); }
+    ~SpectatorStream();
+    
+    bool open(const string& target); //A file name, or unix:path for a socket
+    
+    template<typename BoardType>
+    void publish(const BoardType&, const Object& current, const Object& predicted_position, const Object& next, const Object* saved_object);
+    
+private:
+    static const int MAX_SPECTATORS = 64;
+    static const Uint32 KEYFRAME_INTERVAL = 2000; //ms
+    
+    void encode_keyframe(const SpectatorState&, vector<Uint8>& out);
+    bool encode_delta(vector<Uint8>& out); //Returns false if nothing has changed
+    void add_frame(Uint8 type, vector<Uint8>& out);
+    bool accept_spectators(); //Returns true if someone joined
+    void send_all(const vector<Uint8>&);
+    bool send_to(int fd, const vector<Uint8>&);
+    
+    SpectatorState sent_; //What the spectators have
+    SpectatorState state_; //What is being published
+    vector<Uint8> payload_;
+    vector<Uint8> frame_;
+    int file_;
+    int listener_;
+    vector<int> spectators_;
+    Uint32 last_keyframe_;
+};
+
+SpectatorStream* spectator_stream = NULL; //Set when the game is published
+
+SpectatorStream::~SpectatorStream()
+{
+    for (size_t i = 0; i < spectators_.size(); ++i)
+        close(spectators_[i]);
+    if (listener_ >= 0)
+        close(listener_);
+    if (file_ >= 0)
+        close(file_);
+}
+
+bool SpectatorStream::open(const string& target)
+{
+    signal(SIGPIPE, SIG_IGN); //A spectator leaving must not end the game
+    
+    if (target.compare(0, 5, "unix:") == 0)
+    {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, target.c_str() + 5, sizeof(address.sun_path) -1);
+        unlink(address.sun_path);
+        
+        listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener_ < 0 || bind(listener_, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener_, 16) < 0)
+        {
+            if (listener_ >= 0)
+                close(listener_);
+            listener_ = -1;
+            return false;
+        }
+        fcntl(listener_, F_SETFL, O_NONBLOCK);
+        return true;
+    }
+    
+    file_ = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return file_ >= 0;
+}
+
+template<typename BoardType>
+void SpectatorStream::publish(const BoardType& board, const Object& current, const Object& predicted_position, const Object& next, const Object* saved_object)
+{
+    capture_state(board, current, predicted_position, next, saved_object, state_);
+    
+    //Room for the largest frame, so publishing doesn't allocate during the game
+    payload_.reserve(3*state_.cells.size() + 64);
+    frame_.reserve(3*state_.cells.size() + 72);
+    
+    //A new spectator starts from a keyframe
+    const bool joined = accept_spectators();
+    
+    frame_.clear();
+    const Uint32 now = SDL_GetTicks();
+    if (joined || sent_.pieces != state_.pieces || sent_.cols != state_.cols || sent_.rows != state_.rows
+        || now - last_keyframe_ >= KEYFRAME_INTERVAL)
+    {
+        encode_keyframe(state_, frame_);
+        last_keyframe_ = now;
+    }
+    else if (!encode_delta(frame_))
+        return;
+    
+    send_all(frame_);
+    sent_ = state_;
+}
+
+void SpectatorStream::add_frame(Uint8 type, vector<Uint8>& out)
+{
+    if (type == 'K')
+    {
+        out.push_back(0xA5);
+        out.push_back('T');
+    }
+    out.push_back(type);
+    put_varint(out, static_cast<Uint32>(payload_.size()));
+    out.insert(out.end(), payload_.begin(), payload_.end());
+}
+
+void SpectatorStream::encode_keyframe(const SpectatorState& state, vector<Uint8>& out)
+{
+    payload_.clear();
+    payload_.push_back(SPECTATOR_VERSION);
+    payload_.push_back(static_cast<Uint8>(state.pieces));
+    put_varint(payload_, state.cols);
+    put_varint(payload_, state.rows);
+    
+    for (size_t i = 0; i < state.cells.size(); )
+    {
+        size_t run = 1;
+        while (i + run < state.cells.size() && state.cells[i + run] == state.cells[i])
+            ++run;
+        put_varint(payload_, static_cast<Uint32>(run));
+        payload_.push_back(state.cells[i]);
+        i += run;
+    }
+    
+    payload_.push_back(static_cast<Uint8>(state.current));
+    payload_.push_back(static_cast<Uint8>(state.rotation));
+    put_signed(payload_, state.x);
+    put_signed(payload_, state.y);
+    put_signed(payload_, state.ghost_y);
+    payload_.push_back(static_cast<Uint8>(state.next));
+    payload_.push_back(static_cast<Uint8>(state.hold));
+    put_varint(payload_, state.score);
+    put_varint(payload_, state.level);
+    
+    add_frame('K', out);
+}
+
+bool SpectatorStream::encode_delta(vector<Uint8>& out)
+{
+    Uint8 flags = 0;
+    payload_.clear();
+    payload_.push_back(0); //The flags are filled in at the end
+    
+    int changed = 0;
+    for (size_t i = 0; i < state_.cells.size(); ++i)
+        changed += (state_.cells[i] != sent_.cells[i]);
+    
+    if (changed > 0)
+    {
+        flags |= SPECTATE_CELLS;
+        put_varint(payload_, changed);
+        size_t last = 0;
+        for (size_t i = 0; i < state_.cells.size(); ++i)
+        {
+            if (state_.cells[i] != sent_.cells[i])
+            {
+                put_varint(payload_, static_cast<Uint32>(((i - last) << 4) | state_.cells[i]));
+                last = i + 1;
+            }
+        }
+    }
+    
+    if (state_.current != sent_.current || state_.rotation != sent_.rotation)
+    {
+        flags |= SPECTATE_PIECE;
+        payload_.push_back(static_cast<Uint8>(state_.current));
+        payload_.push_back(static_cast<Uint8>(state_.rotation));
+    }
+    if (state_.x != sent_.x || state_.y != sent_.y)
+    {
+        flags |= SPECTATE_POSITION;
+        put_signed(payload_, state_.x - sent_.x);
+        put_signed(payload_, state_.y - sent_.y);
+    }
+    if (state_.ghost_y != sent_.ghost_y)
+    {
+        flags |= SPECTATE_GHOST;
+        put_signed(payload_, state_.ghost_y - sent_.ghost_y);
+    }
+    if (state_.next != sent_.next || state_.hold != sent_.hold)
+    {
+        flags |= SPECTATE_PREVIEW;
+        payload_.push_back(static_cast<Uint8>(state_.next));
+        payload_.push_back(static_cast<Uint8>(state_.hold));
+    }
+    if (state_.score != sent_.score)
+    {
+        flags |= SPECTATE_SCORE;
+        put_signed(payload_, state_.score - sent_.score);
+    }
+    if (state_.level != sent_.level)
+    {
+        flags |= SPECTATE_LEVEL;
+        put_varint(payload_, state_.level);
+    }
+    
+    if (flags == 0)
+        return false;
+    
+    payload_[0] = flags;
+    add_frame('D', out);
+    return true;
+}
+
+bool SpectatorStream::accept_spectators()
+{
+    if (listener_ < 0)
+        return false;
+    
+    bool joined = false;
+    int fd;
+    while ((fd = accept(listener_, NULL, NULL)) >= 0)
+    {
+        if (spectators_.size() == MAX_SPECTATORS)
+        {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        spectators_.push_back(fd);
+        joined = true;
+    }
+    return joined;
+}
+
+bool SpectatorStream::send_to(int fd, const vector<Uint8>& data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        const ssize_t result = write(fd, &data[written], data.size() - written);
+        if (result <= 0)
+            return false;
+        written += result;
+    }
+    return true;
+}
+
+void SpectatorStream::send_all(const vector<Uint8>& data)
+{
+    if (file_ >= 0)
+        send_to(file_, data);
+    
+    //A spectator that can't keep up is dropped rather than waited for, it can connect again
+    for (size_t i = 0; i < spectators_.size(); )
+    {
+        if (send_to(spectators_[i], data))
+            ++i;
+        else
+        {
+            close(spectators_[i]);
+            spectators_[i] = spectators_.back();
+            spectators_.pop_back();
+        }
+    }
+}
+
+//The live state of a game in a POSIX shared memory segment, for overlays, coaching tools and monitors
+//that would otherwise have to capture the screen. The game writes it under a seqlock and never waits
+//for a reader: sequence is odd while the game writes, and a reader keeps what it copied only if
+//sequence was the same even number before and after the copy. Reading takes no system calls.
+struct SharedPiece
+{
+    Sint32 type; //0 if there is no object
+    Sint32 rotation;
+    Sint32 x; //Position of the 5x5-objects [0][0]-block in the boards view
+    Sint32 y;
+};
+
+struct SharedGameState
+{
+    static const int MAX_CELLS = 64*64;
+    
+    Sint32 cols; //Size of the boards view
+    Sint32 rows;
+    SharedPiece current;
+    SharedPiece ghost; //Where the falling object lands
+    SharedPiece next; //next and hold are at the spawn position
+    SharedPiece hold;
+    Sint32 score;
+    Sint32 level;
+    Sint32 speed; //ms between the falling objects steps
+    Sint32 pieces; //Objects placed this game
+    Uint8 cells[MAX_CELLS]; //Color of every block in the view, row after row, 0 if empty. Only cols*rows are used
+};
+
+struct SharedGameSegment
+{
+    char magic[8]; //"TETRISSM"
+    Uint32 version;
+    Uint32 pieces; //Index of the piece set in piece_sets, the types of the pieces are of that set
+    atomic<Uint32> sequence;
+    atomic<Uint32> closed; //Set when the game quits
+    SharedGameState state;
+};
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && sizeof(atomic<Uint32>) == sizeof(Uint32), "The seqlock is shared between processes");
+
+//Copies the state out of a segment, returns false if the game was writing it, then it's read again
+bool read_shared_state(const SharedGameSegment* segment, SharedGameState& out)
+{
+    const Uint32 before = segment->sequence.load(memory_order_acquire);
+    if (before & 1)
+        return false;
+    
+    memcpy(&out, &segment->state, offsetof(SharedGameState, cells));
+    const int cells = max(0, min(out.cols*out.rows, static_cast<int>(SharedGameState::MAX_CELLS)));
+    memcpy(out.cells, segment->state.cells, cells);
+    
+    atomic_thread_fence(memory_order_acquire);
+    return segment->sequence.load(memory_order_relaxed) == before;
+}
+
+class SharedStateExport
+{
+public:
+    static const Uint32 VERSION = 2;
+    
+    SharedStateExport()
+    : file_(-1), segment_(NULL) {}
+    ~SharedStateExport();
+    
+    bool open(const string& name); //A shared memory name like /tetris
+    
+    template<typename BoardType>
+    void publish(const BoardType&, const Object& current, const Object& predicted_position, const Object& next, const Object* saved_object,
+                 int speed, int pieces);
+    
+private:
+    static void put_piece(const Object&, const BoardView&, SharedPiece&);
+    
+    string name_;
+    int file_;
+    SharedGameSegment* segment_;
+};
+
+SharedStateExport* shared_state = NULL; //Set when the game is exported
+
+SharedStateExport::~SharedStateExport()
+{
+    if (segment_ != NULL)
+    {
+        segment_->closed.store(1, memory_order_release);
+        munmap(segment_, sizeof(SharedGameSegment));
+        shm_unlink(name_.c_str()); //Readers that have it mapped keep it until they let go
+    }
+    if (file_ >= 0)
+        close(file_);
+}
+
+bool SharedStateExport::open(const string& name)
+{
+    name_ = name;
+    file_ = shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (file_ < 0 || ftruncate(file_, sizeof(SharedGameSegment)) != 0)
+        return false;
+    
+    void* mapped = mmap(NULL, sizeof(SharedGameSegment), PROT_READ | PROT_WRITE, MAP_SHARED, file_, 0);
+    if (mapped == MAP_FAILED)
+        return false;
+    segment_ = static_cast<SharedGameSegment*>(mapped);
+    
+    //A segment left by an earlier game is taken over, its sequence goes on so its readers see the change
+    segment_->sequence.store((segment_->sequence.load(memory_order_relaxed) + 1) & ~1u, memory_order_relaxed);
+    memcpy(segment_->magic, "TETRISSM", 8);
+    segment_->version = VERSION;
+    segment_->pieces = piece_set_id();
+    segment_->closed.store(0, memory_order_release);
+    return true;
+}
+
+void SharedStateExport::put_piece(const Object& object, const BoardView& view, SharedPiece& piece)
+{
+    piece.type = object.get_type();
+    piece.rotation = object.get_rotation();
+    piece.x = object.get_xPos() - view.left;
+    piece.y = object.get_yPos() - view.top;
+}
+
+template<typename BoardType>
+void SharedStateExport::publish(const BoardType& board, const Object& current, const Object& predicted_position, const Object& next,
+                                const Object* saved_object, int speed, int pieces)
+{
+    const BoardView view = board.get_view();
+    const int cols = min(view.cols, static_cast<int>(SharedGameState::MAX_CELLS));
+    const int rows = min(view.rows, static_cast<int>(SharedGameState::MAX_CELLS)/cols);
+    
+    const Uint32 sequence = segment_->sequence.load(memory_order_relaxed);
+    segment_->sequence.store(sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); //The odd sequence is seen before any of the writes
+    
+    SharedGameState& state = segment_->state;
+    state.cols = cols;
+    state.rows = rows;
+    for (int y = 0; y < rows; ++y)
+    {
+        for (int x = 0; x < cols; ++x)
+            state.cells[y*cols + x] = board.get_cell(view.left + x, view.top + y);
+    }
+    put_piece(current, view, state.current);
+    put_piece(predicted_position, view, state.ghost);
+    put_piece(next, view, state.next);
+    if (saved_object != NULL)
+        put_piece(*saved_object, view, state.hold);
+    else
+        memset(&state.hold, 0, sizeof(state.hold));
+    state.score = board.get_score();
+    state.level = board.get_level();
+    state.speed = speed;
+    state.pieces = pieces;
+    
+    segment_->sequence.store(sequence + 2, memory_order_release);
+}
+
+//A reader of the shared state, like an overlay would be: prints a line for every placed object until the game quits
+int read_shared_game(const string& name)
+{
+    const int file = shm_open(name.c_str(), O_RDONLY, 0);
+    if (file < 0)
+    {
+        fprintf(stderr, "There is no shared game %s\n", name.c_str());
+        return 1;
+    }
+    void* mapped = mmap(NULL, sizeof(SharedGameSegment), PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    const SharedGameSegment* segment = static_cast<const SharedGameSegment*>(mapped);
+    if (mapped == MAP_FAILED || memcmp(segment->magic, "TETRISSM", 8) != 0 || segment->version != SharedStateExport::VERSION
+        || segment->pieces >= PIECE_SETS)
+    {
+        fprintf(stderr, "%s is not a shared game\n", name.c_str());
+        return 1;
+    }
+    const PieceSet& set = *piece_sets[segment->pieces]; //The names are of the writers objects
+    
+    //Reads in a row before giving up, a game that died while writing never lets go of the sequence. The first
+    //ones only yield, a write takes microseconds, the rest wait a ms each for a game that was put to sleep
+    const int SPIN_RETRIES = 1000;
+    const int MAX_RETRIES = SPIN_RETRIES + 1000;
+    SharedGameState state;
+    int shown = -1;
+    Uint64 retries = 0;
+    int failed = 0; //Reads in a row that met the game writing
+    while (segment->closed.load(memory_order_acquire) == 0)
+    {
+        if (!read_shared_state(segment, state))
+        {
+            ++retries;
+            if (++failed == MAX_RETRIES)
+            {
+                fprintf(stderr, "The shared game %s stays in the middle of a write\n", name.c_str());
+                munmap(mapped, sizeof(SharedGameSegment));
+                return 1;
+            }
+            if (failed < SPIN_RETRIES)
+                this_thread::yield();
+            else
+                this_thread::sleep_for(chrono::milliseconds(1));
+            continue;
+        }
+        failed = 0;
+        if (state.pieces != shown)
+        {
+            int blocks = 0;
+            for (int i = 0; i < state.cols*state.rows; ++i)
+                blocks += (state.cells[i] != 0);
+            printf("pieces %d score %d level %d speed %d blocks %d current %c r%d x%d y%d ghost y%d next %c hold %c\n",
+                   state.pieces, state.score, state.level, state.speed, blocks, piece_name(state.current.type, set),
+                   state.current.rotation, state.current.x, state.current.y, state.ghost.y, piece_name(state.next.type, set),
+                   piece_name(state.hold.type, set));
+            fflush(stdout);
+            shown = state.pieces;
+        }
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    fprintf(stderr, "The game quit, %llu reads retried\n", static_cast<unsigned long long>(retries));
+    munmap(mapped, sizeof(SharedGameSegment));
+    return 0;
+}
+
+//Reads a spectator stream back into a SpectatorState
+class SpectatorDecoder
+{
+public:
+    SpectatorDecoder()
+    : synced_(false) {}
+    
+    size_t decode(const Uint8* data, size_t size, bool& changed); //Returns the number of bytes used
+    const SpectatorState& get_state() const { return state_; }
+    
+private:
+    bool apply_keyframe(const Uint8* data, const Uint8* end);
+    bool apply_delta(const Uint8* data, const Uint8* end);
+    bool get_piece(const Uint8*& data, const Uint8* end, int& type, int& rotation) const;
+    bool get_preview(const Uint8*& data, const Uint8* end, int& next, int& hold) const;
+    
+    SpectatorState state_;
+    bool synced_; //False until the first keyframe
+};
+
+size_t SpectatorDecoder::decode(const Uint8* data, size_t size, bool& changed)
+{
+    size_t position = 0;
+    
+    while (position < size)
+    {
+        const bool keyframe = data[position] == 0xA5;
+        const size_t header = keyframe ? 3 : 1;
+        
+        if (!keyframe && (data[position] != 'D' || !synced_))
+        {
+            ++position; //Look for the next keyframe
+            continue;
+        }
+        if (size - position < header + 1)
+            break;
+        if (keyframe && (data[position+1] != 'T' || data[position+2] != 'K'))
+        {
+            ++position;
+            continue;
+        }
+        
+        const Uint8* payload = data + position + header;
+        Uint32 length;
+        if (!get_varint(payload, data + size, length))
+        {
+            if (data + size - payload < 5)
+                break; //The length isn't all here yet
+            ++position;
+            continue;
+        }
+        if (static_cast<size_t>(data + size - payload) < length)
+            break; //The frame isn't all here yet
+        
+        const bool applied = keyframe ? apply_keyframe(payload, payload + length) : apply_delta(payload, payload + length);
+        synced_ = applied;
+        changed = changed || applied;
+        position = (payload + length) - data;
+    }
+    
+    return position;
+}
+
+//Object types are checked against the piece set of the stream, so that a broken frame can't point outside it
+bool SpectatorDecoder::get_piece(const Uint8*& data, const Uint8* end, int& type, int& rotation) const
+{
+    if (end - data < 2 || data[0] > piece_sets[state_.pieces]->count || data[1] > 3)
+        return false;
+    type = *data++;
+    rotation = *data++;
+    return true;
+}
+
+bool SpectatorDecoder::get_preview(const Uint8*& data, const Uint8* end, int& next, int& hold) const
+{
+    const int count = piece_sets[state_.pieces]->count;
+    if (end - data < 2 || data[0] > count || data[1] > count)
+        return false;
+    next = *data++;
+    hold = *data++;
+    return true;
+}
+
+bool SpectatorDecoder::apply_keyframe(const Uint8* data, const Uint8* end)
+{
+    if (end - data < 2 || data[0] != SPECTATOR_VERSION || data[1] >= PIECE_SETS)
+        return false;
+    state_.pieces = data[1];
+    data += 2;
+    
+    Uint32 cols, rows;
+    if (!get_varint(data, end, cols) || !get_varint(data, end, rows) || cols == 0 || rows == 0 || cols*rows > 1 << 20)
+        return false;
+    
+    state_.cols = cols;
+    state_.rows = rows;
+    state_.cells.resize(cols*rows);
+    for (size_t i = 0; i < state_.cells.size(); )
+    {
+        Uint32 run;
+        if (!get_varint(data, end, run) || data == end || run == 0 || i + run > state_.cells.size())
+            return false;
+        fill(state_.cells.begin() + i, state_.cells.begin() + i + run, *data++);
+        i += run;
+    }
+    
+    if (!get_piece(data, end, state_.current, state_.rotation))
+        return false;
+    
+    Uint32 score, level;
+    if (!get_signed(data, end, state_.x) || !get_signed(data, end, state_.y) || !get_signed(data, end, state_.ghost_y)
+        || !get_preview(data, end, state_.next, state_.hold))
+        return false;
+    if (!get_varint(data, end, score) || !get_varint(data, end, level))
+        return false;
+    state_.score = score;
+    state_.level = level;
+    return true;
+}
+
+bool SpectatorDecoder::apply_delta(const Uint8* data, const Uint8* end)
+{
+    if (data == end)
+        return false;
+    const Uint8 flags = *data++;
+    int value;
+    
+    if (flags & SPECTATE_CELLS)
+    {
+        Uint32 count;
+        if (!get_varint(data, end, count))
+            return false;
+        size_t cell = 0;
+        for (Uint32 i = 0; i < count; ++i)
+        {
+            Uint32 change;
+            if (!get_varint(data, end, change))
+                return false;
+            cell += change >> 4;
+            if (cell >= state_.cells.size())
+                return false;
+            state_.cells[cell++] = change & 0x0F;
+        }
+    }
+    if ((flags & SPECTATE_PIECE) && !get_piece(data, end, state_.current, state_.rotation))
+        return false;
+    if (flags & SPECTATE_POSITION)
+    {
+        if (!get_signed(data, end, value))
+            return false;
+        state_.x += value;
+        if (!get_signed(data, end, value))
+            return false;
+        state_.y += value;
+    }
+    if (flags & SPECTATE_GHOST)
+    {
+        if (!get_signed(data, end, value))
+            return false;
+        state_.ghost_y += value;
+    }
+    if ((flags & SPECTATE_PREVIEW) && !get_preview(data, end, state_.next, state_.hold))
+        return false;
+    if (flags & SPECTATE_SCORE)
+    {
+        if (!get_signed(data, end, value))
+            return false;
+        state_.score += value;
+    }
+    if (flags & SPECTATE_LEVEL)
+    {
+        Uint32 level;
+        if (!get_varint(data, end, level))
+            return false;
+        state_.level = level;
+    }
+    return data == end;
+}
+
+//Single producer, single consumer queue of a fixed size that never blocks or allocates
+template<typename T, unsigned Capacity>
+class SpscQueue
+{
+public:
+    static_assert((Capacity & (Capacity - 1)) == 0, "The capacity must be a power of two");
+    
+    SpscQueue()
+    : head_(0), tail_(0) {}
+    
+    bool push(const T& value) //Only from the producer, returns false if the queue is full
+    {
+        const unsigned tail = tail_.load(memory_order_relaxed);
+        if (tail - head_.load(memory_order_acquire) == Capacity)
+            return false;
+        items_[tail % Capacity] = value;
+        tail_.store(tail + 1, memory_order_release);
+        return true;
+    }
+    
+    bool pop(T& value) //Only from the consumer, returns false if the queue is empty
+    {
+        const unsigned head = head_.load(memory_order_relaxed);
+        if (head == tail_.load(memory_order_acquire))
+            return false;
+        value = items_[head % Capacity];
+        head_.store(head + 1, memory_order_release);
+        return true;
+    }
+    
+private:
+    T items_[Capacity];
+    atomic<unsigned> head_; //Items pushed and popped so far, they wrap around together
+    atomic<unsigned> tail_;
+};
+
+//Three copies of a value for one writer and one reader that never wait for each other. The writer
+//fills its copy and swaps it with the shared one, the reader swaps its copy for the shared one when
+//that is newer, so the reader always has a whole value that nobody else writes to.
+template<typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer()
+    : shared_(1), write_(0), read_(2) {}
+    
+    T& write_buffer() { return buffers_[write_]; } //Only from the writer
+    void publish() { write_ = shared_.exchange(write_ | FRESH, memory_order_acq_rel) & INDEX; } //Only from the writer
+    
+    bool update() //Only from the reader, returns false if nothing was published since the last update
+    {
+        if ((shared_.load(memory_order_relaxed) & FRESH) == 0)
+            return false;
+        read_ = shared_.exchange(read_, memory_order_acq_rel) & INDEX;
+        return true;
+    }
+    const T& read_buffer() const { return buffers_[read_]; } //Only from the reader
+    
+private:
+    static const unsigned INDEX = 3;
+    static const unsigned FRESH = 4;
+    
+    T buffers_[3];
+    atomic<unsigned> shared_; //Index of the shared copy, with FRESH set while the reader hasn't taken it
+    unsigned write_;
+    unsigned read_;
+};
+
+//One locked object
+struct PieceRecord
+{
+    Uint32 game;
+    Uint8 type;
+    Uint8 rotation;
+    Sint16 x; //Where it was locked
+    Sint16 y;
+    Uint8 lines; //Rows it cleared
+    Uint32 time; //ms from spawn to lock
+    Uint16 keys; //Key presses used on it
+    Uint32 height; //Stack height and holes after the lock, the endurance board has more than 16 bits of holes
+    Uint32 holes;
+};
+
+//One finished game
+struct GameRecord
+{
+    Uint32 game;
+    Uint32 pieces;
+    Uint32 duration; //ms
+    Uint32 actions; //Key presses
+    Uint32 score;
+    Uint16 level;
+    float pieces_per_second;
+    float actions_per_minute;
+};
+
+//Records are collected in chunks that are handed to the writer thread as a whole
+struct AnalyticsChunk
+{
+    static const int PIECES = 512;
+    static const int GAMES = 16;
+    
+    PieceRecord pieces[PIECES];
+    GameRecord games[GAMES];
+    int piece_count;
+    int game_count;
+};
+
+//Per-piece and per-game metrics, written by a background thread to a columnar file.
+//The game only fills preallocated chunks and passes them on through a queue, it never waits
+//for the writer. If the writer falls behind and no chunk is free, records are dropped.
+//
+//File format, in native byte order:
+//  'T' 'A' 'N' 'L', Uint32 version, Uint32 time the session was started, Uint8 piece set in piece_sets,
+//  Uint8 length and the name of the board variant. Version 1 sessions have neither.
+//  Version 2 and older sessions have height and holes as u16.
+//  Blocks of 'P' or 'G', Uint32 count, then every column of the block as count values in a row
+//  P: game u32, type u8, rotation u8, x i16, y i16, lines u8, time u32, keys u16, height u32, holes u32
+//  G: game u32, pieces u32, duration u32, actions u32, score u32, level u16, pieces/s f32, actions/min f32
+class Analytics
+{
+public:
+    Analytics();
+    ~Analytics(); //Writes what is left and stops the writer
+    
+    bool open(const string& path, const string& variant); //Every game of the session is played on the variant
+    
+    void start_game();
+    void record_piece(const Object& locked, int lines, Uint32 spawn_time, int keys, int height, int holes);
+    void end_game(int score, int level);
+    
+private:
+    static const int CHUNKS = 4;
+    static const Uint32 VERSION = 3;
+    
+    bool take_chunk(); //Makes sure there is a chunk to fill, returns false if none is free
+    void submit(); //Hands the chunk being filled to the writer
+    void write_loop(); //Runs on its own thread
+    void write_chunk(const AnalyticsChunk&);
+    void write_all(const void* data, size_t size);
+    template<typename T, typename Record>
+    void write_column(const Record* records, int count, T Record::* field);
+    
+    vector<AnalyticsChunk> chunks_;
+    SpscQueue<int, 8> ready_; //Chunks to write
+    SpscQueue<int, 8> free_; //Chunks to fill
+    int filling_; //Chunk being filled, -1 if none
+    
+    Uint32 game_;
+    Uint32 game_start_;
+    Uint32 pieces_;
+    Uint32 actions_;
+    unsigned long dropped_;
+    
+    int file_;
+    vector<Uint8> column_; //The writers buffer for one column
+    atomic<bool> running_;
+    thread writer_;
+};
+
+Analytics* analytics = NULL; //Set when games are recorded
+
+Analytics::Analytics()
+: chunks_(CHUNKS), filling_(-1), game_(0), game_start_(0), pieces_(0), actions_(0), dropped_(0), file_(-1),
+  column_(AnalyticsChunk::PIECES*sizeof(Uint32)), running_(false)
+{
+    for (int i = 0; i < CHUNKS; ++i)
+        free_.push(i);
+}
+
+Analytics::~Analytics()
+{
+    if (filling_ >= 0)
+        submit();
+    
+    if (writer_.joinable())
+    {
+        running_ = false;
+        writer_.join();
+    }
+    if (file_ >= 0)
+        close(file_);
+    if (dropped_ > 0)
+        fprintf(stderr, "Analytics dropped %lu records\n", dropped_);
+}
+
+bool Analytics::open(const string& path, const string& variant)
+{
+    file_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (file_ < 0)
+        return false;
+    
+    const char magic[4] = { 'T', 'A', 'N', 'L' };
+    const Uint32 version = VERSION;
+    const Uint32 started = static_cast<Uint32>(::time(NULL));
+    write_all(magic, sizeof(magic));
+    write_all(&version, sizeof(version));
+    write_all(&started, sizeof(started));
+    const Uint8 pieces = piece_set_id();
+    const Uint8 length = min<size_t>(variant.size(), 255);
+    write_all(&pieces, sizeof(pieces));
+    write_all(&length, sizeof(length));
+    write_all(variant.data(), length);
+    
+    running_ = true;
+    writer_ = thread(&Analytics::write_loop, this);
+    return true;
+}
+
+void Analytics::start_game()
+{
+    ++game_;
+    game_start_ = SDL_GetTicks();
+    pieces_ = 0;
+    actions_ = 0;
+}
+
+bool Analytics::take_chunk()
+{
+    if (filling_ >= 0)
+        return true;
+    if (!free_.pop(filling_))
+    {
+        filling_ = -1;
+        return false;
+    }
+    chunks_[filling_].piece_count = 0;
+    chunks_[filling_].game_count = 0;
+    return true;
+}
+
+void Analytics::submit()
+{
+    ready_.push(filling_); //There are never more chunks than places in the queue
+    filling_ = -1;
+}
+
+void Analytics::record_piece(const Object& locked, int lines, Uint32 spawn_time, int keys, int height, int holes)
+{
+    ++pieces_;
+    actions_ += keys;
+    
+    if (!take_chunk())
+    {
+        ++dropped_;
+        return;
+    }
+    
+    AnalyticsChunk& chunk = chunks_[filling_];
+    PieceRecord& record = chunk.pieces[chunk.piece_count++];
+    record.game = game_;
+    record.type = locked.get_type();
+    record.rotation = locked.get_rotation();
+    record.x = locked.get_xPos();
+    record.y = locked.get_yPos();
+    record.lines = lines;
+    record.time = SDL_GetTicks() - spawn_time;
+    record.keys = min(keys, 0xFFFF);
+    record.height = height;
+    record.holes = holes;
+    
+    if (chunk.piece_count == AnalyticsChunk::PIECES)
+        submit();
+}
+
+void Analytics::end_game(int score, int level)
+{
+    if (!take_chunk())
+    {
+        ++dropped_;
+        return;
+    }
+    
+    AnalyticsChunk& chunk = chunks_[filling_];
+    GameRecord& record = chunk.games[chunk.game_count++];
+    const Uint32 duration = SDL_GetTicks() - game_start_;
+    const float seconds = max(duration, Uint32(1))/1000.0f;
+    record.game = game_;
+    record.pieces = pieces_;
+    record.duration = duration;
+    record.actions = actions_;
+    record.score = score;
+    record.level = level;
+    record.pieces_per_second = pieces_/seconds;
+    record.actions_per_minute = actions_*60/seconds;
+    
+    submit(); //A finished game is written right away
+}
+
+void Analytics::write_loop()
+{
+    for (;;)
+    {
+        //Stop only when the game is done and everything it sent is written
+        const bool stopping = !running_;
+        int chunk;
+        if (ready_.pop(chunk))
+        {
+            write_chunk(chunks_[chunk]);
+            free_.push(chunk);
+        }
+        else if (stopping)
+            break;
+        else
+            this_thread::sleep_for(chrono::milliseconds(20));
+    }
+}
+
+void Analytics::write_all(const void* data, size_t size)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        const ssize_t written = write(file_, bytes, size);
+        if (written <= 0)
+            return;
+        bytes += written;
+        size -= written;
+    }
+}
+
+template<typename T, typename Record>
+void Analytics::write_column(const Record* records, int count, T Record::* field)
+{
+    for (int i = 0; i < count; ++i)
+        memcpy(&column_[i*sizeof(T)], &(records[i].*field), sizeof(T));
+    write_all(&column_[0], count*sizeof(T));
+}
+
+void Analytics::write_chunk(const AnalyticsChunk& chunk)
+{
+    if (chunk.piece_count > 0)
+    {
+        const Uint8 kind = 'P';
+        const Uint32 count = chunk.piece_count;
+        write_all(&kind, 1);
+        write_all(&count, sizeof(count));
+        write_column(chunk.pieces, count, &PieceRecord::game);
+        write_column(chunk.pieces, count, &PieceRecord::type);
+        write_column(chunk.pieces, count, &PieceRecord::rotation);
+        write_column(chunk.pieces, count, &PieceRecord::x);
+        write_column(chunk.pieces, count, &PieceRecord::y);
+        write_column(chunk.pieces, count, &PieceRecord::lines);
+        write_column(chunk.pieces, count, &PieceRecord::time);
+        write_column(chunk.pieces, count, &PieceRecord::keys);
+        write_column(chunk.pieces, count, &PieceRecord::height);
+        write_column(chunk.pieces, count, &PieceRecord::holes);
+    }
+    
+    if (chunk.game_count > 0)
+    {
+        const Uint8 kind = 'G';
+        const Uint32 count = chunk.game_count;
+        write_all(&kind, 1);
+        write_all(&count, sizeof(count));
+        write_column(chunk.games, count, &GameRecord::game);
+        write_column(chunk.games, count, &GameRecord::pieces);
+        write_column(chunk.games, count, &GameRecord::duration);
+        write_column(chunk.games, count, &GameRecord::actions);
+        write_column(chunk.games, count, &GameRecord::score);
+        write_column(chunk.games, count, &GameRecord::level);
+        write_column(chunk.games, count, &GameRecord::pieces_per_second);
+        write_column(chunk.games, count, &GameRecord::actions_per_minute);
+    }
+}
+
+//Microseconds from a steady clock, for timing that is finer than SDL_GetTicks
+Uint64 precise_ticks()
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//Timing of held keys, set on the command line
+struct AutoShiftSettings
+{
+    AutoShiftSettings()
+    : das(167000), arr(33000), soft_drop_factor(20) {}
+    
+    Uint64 das; //Delayed auto shift, µs from a left or right press until it repeats
+    Uint64 arr; //Auto repeat rate, µs between repeats, 0 moves to the wall at once
+    int soft_drop_factor; //Down falls this many times faster than gravity while held
+};
+
+AutoShiftSettings auto_shift_settings;
+
+//Keeps track of the held movement keys and when they are due to move the object again, so that
+//held keys repeat at the configured rate instead of the operating systems key repeat.
+//The steps are counted from the time of the press, so they don't depend on how often they are asked for.
+class AutoShift
+{
+public:
+    AutoShift(const AutoShiftSettings& settings)
+    : settings_(settings), left_(false), right_(false), down_(false), direction_(0), taps_(0),
+      next_shift_(0), next_drop_(0), drop_pending_(false) {}
+    
+    void press(SDLKey, Uint64 now);
+    void release(SDLKey, Uint64 now);
+    
+    //Columns to move now, in the direction of the last pressed key. At most max_steps, which is also
+    //returned when the repeat rate is 0 and the object should slide to the wall.
+    int shift_steps(Uint64 now, int max_steps, int& direction);
+    int drop_steps(Uint64 now, Uint64 gravity, int max_steps); //Rows to soft drop now, gravity is the fall interval in µs
+    
+private:
+    void start_shift(int direction, Uint64 now);
+    
+    const AutoShiftSettings& settings_;
+    bool left_; //Keys held down
+    bool right_;
+    bool down_;
+    int direction_; //-1 left, 1 right, 0 when neither is held
+    int taps_; //Presses that haven't moved the object yet, negative to the left. They move it even if the key is already let go
+    Uint64 next_shift_; //When the next repeat is due
+    Uint64 next_drop_;
+    bool drop_pending_;
+};
+
+void AutoShift::start_shift(int direction, Uint64 now)
+{
+    direction_ = direction;
+    next_shift_ = now + settings_.das;
+}
+
+void AutoShift::press(SDLKey key, Uint64 now)
+{
+    //Repeated presses of a held key, from the operating systems key repeat, change nothing
+    if (key == SDLK_LEFT && !left_)
+    {
+        left_ = true;
+        --taps_;
+        start_shift(-1, now);
+    }
+    else if (key == SDLK_RIGHT && !right_)
+    {
+        right_ = true;
+        ++taps_;
+        start_shift(1, now);
+    }
+    else if (key == SDLK_DOWN && !down_)
+    {
+        down_ = true;
+        drop_pending_ = true;
+        next_drop_ = now;
+    }
+}
+
+void AutoShift::release(SDLKey key, Uint64 now)
+{
+    //Letting go of one direction while the other is held starts over in the other one
+    if (key == SDLK_LEFT && left_)
+    {
+        left_ = false;
+        if (direction_ == -1)
+            start_shift(right_ ? 1 : 0, now);
+    }
+    else if (key == SDLK_RIGHT && right_)
+    {
+        right_ = false;
+        if (direction_ == 1)
+            start_shift(left_ ? -1 : 0, now);
+    }
+    else if (key == SDLK_DOWN)
+        down_ = false;
+}
+
+int AutoShift::shift_steps(Uint64 now, int max_steps, int& direction)
+{
+    if (taps_ != 0)
+    {
+        direction = (taps_ < 0) ? -1 : 1;
+        const int steps = min(abs(taps_), max_steps);
+        taps_ = 0;
+        return steps;
+    }
+    
+    direction = direction_;
+    if (direction_ == 0 || now < next_shift_)
+        return 0;
+    if (settings_.arr == 0)
+        return max_steps;
+    
+    const Uint64 repeats = (now - next_shift_)/settings_.arr + 1;
+    next_shift_ += repeats*settings_.arr;
+    return static_cast<int>(min(repeats, Uint64(max_steps)));
+}
+
+int AutoShift::drop_steps(Uint64 now, Uint64 gravity, int max_steps)
+{
+    //A press that was let go before it was asked for still drops once
+    if (!down_ && !drop_pending_)
+        return 0;
+    drop_pending_ = false;
+    
+    const Uint64 interval = max(gravity/max(settings_.soft_drop_factor, 1), Uint64(1));
+    if (now < next_drop_)
+        return 0;
+    
+    const Uint64 drops = (now - next_drop_)/interval + 1;
+    next_drop_ += drops*interval;
+    return static_cast<int>(min(drops, Uint64(max_steps)));
+}
+
+//An SDL event and when it was taken from SDL
+struct TimedEvent
+{
+    Uint64 time; //precise_ticks
+    SDL_Event event;
+};
+
+//Takes the events from SDL on a thread of its own while a game runs and hands them to the game
+//thread with the time they came in, so that a slow frame delays when they are drawn but not when
+//they happen. Without threaded events from SDL, poll takes them on the game thread instead.
+class InputThread
+{
+public:
+    InputThread();
+    ~InputThread();
+    
+    void poll(); //Call once a frame from the game thread
+    bool pop(TimedEvent& event) { return events_.pop(event); } //Only from the game thread, in the order they came in
+    void put_back(const TimedEvent& event) { put_back_ = event; has_put_back_ = true; } //The last event popped, it wasn't used
+    
+private:
+    void take_events();
+    void read_loop();
+    
+    SpscQueue<TimedEvent, 256> events_;
+    TimedEvent pending_; //Taken from SDL, but the queue was full
+    bool has_pending_;
+    TimedEvent put_back_; //Came before everything in events_
+    bool has_put_back_;
+    atomic<bool> running_;
+    thread reader_;
+};
+
+InputThread::InputThread()
+: has_pending_(false), has_put_back_(false), running_(threaded_events)
+{
+    if (running_)
+        reader_ = thread(&InputThread::read_loop, this);
+}
+
+InputThread::~InputThread()
+{
+    running_ = false;
+    if (reader_.joinable())
+        reader_.join();
+    
+    //Events the game didn't get to go back to SDL, for the screen after the game, in the order they
+    //came in and ahead of those SDL got since
+    SDL_Event newer[128]; //SDLs queue holds fewer
+    const int count = max(SDL_PeepEvents(newer, 128, SDL_GETEVENT, SDL_ALLEVENTS), 0);
+    TimedEvent left;
+    if (has_put_back_)
+        SDL_PeepEvents(&put_back_.event, 1, SDL_ADDEVENT, SDL_ALLEVENTS);
+    while (events_.pop(left))
+        SDL_PeepEvents(&left.event, 1, SDL_ADDEVENT, SDL_ALLEVENTS);
+    if (has_pending_)
+        SDL_PeepEvents(&pending_.event, 1, SDL_ADDEVENT, SDL_ALLEVENTS);
+    SDL_PeepEvents(newer, count, SDL_ADDEVENT, SDL_ALLEVENTS);
+}
+
+void InputThread::poll()
+{
+    if (!threaded_events)
+    {
+        SDL_PumpEvents();
+        take_events();
+    }
+}
+
+void InputThread::take_events()
+{
+    while (true)
+    {
+        if (!has_pending_)
+        {
+            if (SDL_PeepEvents(&pending_.event, 1, SDL_GETEVENT, SDL_ALLEVENTS) <= 0)
+                return;
+            pending_.time = precise_ticks();
+            has_pending_ = true;
+        }
+        //A full queue keeps the rest in SDL, in order, until the game catches up
+        if (!events_.push(pending_))
+            return;
+        has_pending_ = false;
+    }
+}
+
+void InputThread::read_loop()
+{
+    while (running_)
+    {
+        take_events();
+        this_thread::sleep_for(chrono::microseconds(250));
+    }
+}
+
+bool threaded_rendering = false; //Games are drawn by a RenderThread, set on the command line
+
+//Draws a game on a thread of its own from the snapshots the game thread publishes once a frame, so
+//that the game never waits for blitting or presenting. Meanwhile the game thread draws into a
+//NullRenderer, and gets its own renderer back when the game is over.
+class RenderThread
+{
+public:
+    RenderThread(bool enabled);
+    ~RenderThread();
+    
+    bool enabled() const { return enabled_; }
+    template<typename BoardType>
+    void publish(const BoardType&, const Object& current, const Object& predicted_position, const Object& next, const Object* saved_object);
+    
+private:
+    void draw_loop(Renderer* target);
+    
+    TripleBuffer<SpectatorState> snapshots_;
+    Renderer* game_renderer_;
+    NullRenderer null_renderer_;
+    const bool enabled_;
+    atomic<bool> running_;
+    thread drawer_;
+};
+
+RenderThread::RenderThread(bool enabled)
+: game_renderer_(renderer), enabled_(enabled), running_(enabled)
+{
+    if (enabled_)
+    {
+        drawer_ = thread(&RenderThread::draw_loop, this, renderer);
+        renderer = &null_renderer_;
+    }
+}
+
+RenderThread::~RenderThread()
+{
+    running_ = false;
+    if (drawer_.joinable())
+        drawer_.join();
+    renderer = game_renderer_;
+}
+
+template<typename BoardType>
+void RenderThread::publish(const BoardType& board, const Object& current, const Object& predicted_position, const Object& next, const Object* saved_object)
+{
+    if (!enabled_)
+        return;
+    capture_state(board, current, predicted_position, next, saved_object, snapshots_.write_buffer());
+    snapshots_.publish();
+}
+
+void RenderThread::draw_loop(Renderer* target)
+{
+    renderer = target;
+    Tetris tetris;
+    tetris.apply_surface(0, 0, background);
+    
+    WatchedScore score;
+    while (running_)
+    {
+        if (snapshots_.update())
+            draw_spectator_state(snapshots_.read_buffer(), score);
+        else
+            this_thread::sleep_for(chrono::milliseconds(1));
+    }
+}
+
+//How good a board looks to the bot, higher is better. The weights of the well known
+//aggregate height, holes and bumpiness evaluation, the cleared rows are scored separately.
+template<typename BoardType>
+double evaluate_board(const BoardType& board)
+{
+    int heights[BoardType::width];
+    for (int x = 0; x < BoardType::width; ++x)
+    {
+        heights[x] = 0;
+        for (int y = 0; y < BoardType::rows; ++y)
+        {
+            if (board.get_cell(x, y) != 0)
+            {
+                heights[x] = BoardType::rows - y;
+                break;
+            }
+        }
+    }
+    
+    int aggregate = heights[0];
+    int bumpiness = 0;
+    for (int x = 1; x < BoardType::width; ++x)
+    {
+        aggregate += heights[x];
+        bumpiness += abs(heights[x] - heights[x-1]);
+    }
+    return -0.51*aggregate - 0.36*board.count_holes() - 0.18*bumpiness;
+}
+
+//Calls f(locked object, right turns, columns moved) for every place the object reaches by turning
+//at the spawn position, sliding sideways and dropping, the moves the bot makes with its keys
+template<typename BoardType, typename F>
+void for_each_drop(const BoardType& board, Object piece, F& f)
+{
+    const int spawn_x = piece.get_xPos();
+    
+    for (int turns = 0; turns < 4; ++turns)
+    {
+        if (turns > 0)
+        {
+            if (turns >= piece.get_rotations()) //The other rotations are the same blocks again
+                return;
+            piece.rotate_right();
+            if (!board.isMovementPossible(piece))
+                return;
+        }
+        
+        for (int direction = -1; direction <= 1; direction += 2)
+        {
+            Object slid = piece;
+            for (int shift = (direction < 0) ? 0 : 1; ; shift += direction)
+            {
+                slid.set_xPos(spawn_x + shift);
+                if (!board.isMovementPossible(slid))
+                    break;
+                
+                Object dropped = slid;
+                while (board.isMovementPossible(dropped))
+                    dropped.set_yPos(dropped.get_yPos() + 1);
+                dropped.set_yPos(dropped.get_yPos() - 1);
+                f(dropped, turns, shift);
+            }
+        }
+    }
+}
+
+//The keys a path of moves is made of, in the order the searches try them
+enum PathKey { PATH_LEFT, PATH_RIGHT, PATH_DOWN, PATH_Z, PATH_X, PATH_KEYS };
+const char* const path_key_names[PATH_KEYS] = { "Left", "Right", "Down", "Z", "X" };
+const SDLKey path_key_syms[PATH_KEYS] = { SDLK_LEFT, SDLK_RIGHT, SDLK_DOWN, SDLK_z, SDLK_x };
+
+//True if two objects cover the same blocks, whatever rotations they are in
+bool same_cells(const Object& a, const Object& b)
+{
+    const int dx = a.get_xPos() - b.get_xPos();
+    const int top = min(a.get_yPos(), b.get_yPos());
+    const int bottom = max(a.get_yPos(), b.get_yPos()) + 5;
+    for (int y = top; y < bottom; ++y)
+    {
+        const int ja = y - a.get_yPos();
+        const int jb = y - b.get_yPos();
+        const int ma = (ja >= 0 && ja < 5) ? a.get_row_mask(ja) : 0;
+        const int mb = (jb >= 0 && jb < 5) ? b.get_row_mask(jb) : 0;
+        if (abs(dx) >= 5 ? (ma | mb) != 0 : (ma << max(dx, 0)) != (mb << max(-dx, 0)))
+            return false;
+    }
+    return true;
+}
+
+//Where a hard drop from the pose locks the object
+template<typename BoardType>
+Object hard_drop(const BoardType& board, Object pose)
+{
+    while (board.isMovementPossible(pose))
+        pose.set_yPos(pose.get_yPos() + 1);
+    pose.set_yPos(pose.get_yPos() - 1);
+    return pose;
+}
+
+//Breadth first search for the fewest keys that take an object from where it is to a pose done() accepts.
+//Left, right and down move, X and Z turn in place and don't move if they collide, like in run_game.
+//The buffers are kept, so searching again doesn't allocate.
+template<typename BoardType>
+class PathSearch
+{
+public:
+    void reserve(); //Sizes the buffers for the board
+    
+    //Adds the keys to keys, returns false if no pose done() accepts can be reached
+    template<typename F>
+    bool find(const BoardType&, const Object& spawned, F done, vector<Uint8>& keys);
+    
+private:
+    static const int MARGIN = 4;
+    static const int COLUMNS = BoardType::width + 2*MARGIN;
+    static const int ROWS = BoardType::rows + MARGIN;
+    static const int POSES = 4*COLUMNS*ROWS;
+    
+    vector<int> parent_; //The pose every pose was first reached from
+    vector<Uint8> key_; //And the key that did it
+    vector<int> queue_;
+};
+
+template<typename BoardType>
+void PathSearch<BoardType>::reserve()
+{
+    parent_.resize(POSES);
+    key_.resize(POSES);
+    queue_.reserve(POSES);
+}
+
+template<typename BoardType>
+template<typename F>
+bool PathSearch<BoardType>::find(const BoardType& board, const Object& spawned, F done, vector<Uint8>& keys)
+{
+    const int moves[PATH_KEYS][3] = { {-1, 0, 0}, {1, 0, 0}, {0, 1, 0}, {0, 0, 3}, {0, 0, 1} };
+    if (!board.isMovementPossible(spawned))
+        return false;
+    reserve();
+    fill(parent_.begin(), parent_.end(), -1);
+    queue_.clear();
+    
+    Object poses[4] = { spawned, spawned, spawned, spawned };
+    for (int r = 1; r < 4; ++r)
+    {
+        Object turned = spawned;
+        for (int k = 0; k < r; ++k)
+            turned.rotate_right();
+        poses[turned.get_rotation()] = turned;
+    }
+    
+    const int start = (spawned.get_rotation()*ROWS + spawned.get_yPos())*COLUMNS + spawned.get_xPos() + MARGIN;
+    parent_[start] = start;
+    queue_.push_back(start);
+    for (size_t next = 0; next < queue_.size(); ++next)
+    {
+        const int rotation = queue_[next] / (COLUMNS*ROWS);
+        const int y = queue_[next] / COLUMNS % ROWS;
+        const int x = queue_[next] % COLUMNS - MARGIN;
+        Object& pose = poses[rotation];
+        pose.set_xPos(x);
+        pose.set_yPos(y);
+        if (done(static_cast<const Object&>(pose)))
+        {
+            const size_t first = keys.size();
+            for (int at = queue_[next]; at != start; at = parent_[at])
+                keys.push_back(key_[at]);
+            reverse(keys.begin() + first, keys.end());
+            return true;
+        }
+        
+        for (int m = 0; m < PATH_KEYS; ++m)
+        {
+            Object& moved = poses[(rotation + moves[m][2]) % 4];
+            moved.set_xPos(x + moves[m][0]);
+            moved.set_yPos(y + moves[m][1]);
+            const int index = (moved.get_rotation()*ROWS + moved.get_yPos())*COLUMNS + moved.get_xPos() + MARGIN;
+            if (parent_[index] < 0 && board.isMovementPossible(moved))
+            {
+                parent_[index] = queue_[next];
+                key_[index] = m;
+                queue_.push_back(index);
+            }
+        }
+    }
+    return false;
+}
+
+//The keys the bot presses to put an object where it should lock. For every object type, rotation it
+//starts in, rotation and column to drop in, a table has the fewest keys from the spawn pose on an empty
+//board. Turning the other way or ending in another rotation with the same blocks counts, since a hard
+//drop only depends on the blocks. The table path is tried on the real board, and only if the stack is
+//in the way is the path searched for there.
+template<typename BoardType>
+class InputPaths
+{
+public:
+    //Adds the keys that take piece, at its spawn pose, to where a hard drop locks it like target.
+    //Returns false if it can't get there
+    bool find(const BoardType&, const Object& piece, const Object& target, vector<Uint8>& keys);
+    
+private:
+    static const int MARGIN = 4;
+    static const int COLUMNS = BoardType::width + 2*MARGIN;
+    static const int MAX_KEYS = 15;
+    
+    struct Path
+    {
+        Sint8 rotation; //The pose the keys end in, -1 if the target can't be reached
+        Sint8 x;
+        Uint8 length;
+        Uint8 keys[MAX_KEYS];
+    };
+    
+    Path& path(int type, int start, int rotation, int x) { return table_[((type*4 + start)*4 + rotation)*COLUMNS + x + MARGIN]; }
+    void build(); //Fills the table, the first time a path is asked for
+    void build(int type, int start);
+    
+    vector<Path> table_;
+    PathSearch<BoardType> search_;
+};
+
+template<typename BoardType>
+void InputPaths<BoardType>::build()
+{
+    Path none;
+    memset(&none, 0, sizeof(none));
+    none.rotation = -1;
+    table_.assign((MAX_PIECES + 1)*4*4*COLUMNS, none);
+    for (int type = 1; type <= piece_set->count; ++type)
+    {
+        for (int start = 0; start < 4; ++start)
+            build(type, start);
+    }
+    search_.reserve();
+}
+
+template<typename BoardType>
+void InputPaths<BoardType>::build(int type, int start)
+{
+    const BoardType board;
+    Object spawned(type, BoardType::spawn_x);
+    for (int r = 0; r < start && spawned.get_rotation() != start; ++r)
+        spawned.rotate_right();
+    if (spawned.get_rotation() != start)
+        return;
+    
+    //Every rotation and column the object reaches at the spawn row, by turning and sliding
+    const int moves[PATH_KEYS][2] = { {-1, 0}, {1, 0}, {0, 0}, {0, 3}, {0, 1} };
+    int parent[4*COLUMNS];
+    Uint8 key[4*COLUMNS];
+    int distance[4*COLUMNS];
+    int queue[4*COLUMNS];
+    fill(parent, parent + 4*COLUMNS, -1);
+    
+    Object poses[4] = { spawned, spawned, spawned, spawned };
+    for (int r = 1; r < 4; ++r)
+    {
+        Object turned = spawned;
+        for (int k = 0; k < r; ++k)
+            turned.rotate_right();
+        poses[turned.get_rotation()] = turned;
+    }
+    
+    const int first = start*COLUMNS + spawned.get_xPos() + MARGIN;
+    parent[first] = first;
+    distance[first] = 0;
+    int end = 0;
+    queue[end++] = first;
+    for (int next = 0; next < end; ++next)
+    {
+        const int rotation = queue[next] / COLUMNS;
+        const int x = queue[next] % COLUMNS - MARGIN;
+        for (int m = 0; m < PATH_KEYS; ++m)
+        {
+            if (m == PATH_DOWN)
+                continue;
+            Object& moved = poses[(rotation + moves[m][1]) % 4];
+            moved.set_xPos(x + moves[m][0]);
+            moved.set_yPos(spawned.get_yPos());
+            if (moved.get_xPos() < -MARGIN || moved.get_xPos() >= BoardType::width + MARGIN)
+                continue;
+            const int index = moved.get_rotation()*COLUMNS + moved.get_xPos() + MARGIN;
+            if (parent[index] < 0 && board.isMovementPossible(moved))
+            {
+                parent[index] = queue[next];
+                key[index] = m;
+                distance[index] = distance[queue[next]] + 1;
+                queue[end++] = index;
+            }
+        }
+    }
+    
+    //Every target gets the closest pose with the same blocks, up to how high they are
+    for (int rotation = 0; rotation < 4; ++rotation)
+    {
+        for (int x = -MARGIN; x < BoardType::width + MARGIN; ++x)
+        {
+            Object target = poses[rotation];
+            target.set_xPos(x);
+            target.set_yPos(-target.get_top());
+            int best = -1;
+            for (int i = 0; i < end; ++i)
+            {
+                Object pose = poses[queue[i] / COLUMNS];
+                pose.set_xPos(queue[i] % COLUMNS - MARGIN);
+                pose.set_yPos(-pose.get_top());
+                if (distance[queue[i]] < MAX_KEYS && same_cells(pose, target)
+                    && (best < 0 || distance[queue[i]] < distance[best]))
+                    best = queue[i];
+            }
+            if (best < 0)
+                continue;
+            
+            Path& p = path(type, start, rotation, x);
+            p.rotation = best / COLUMNS;
+            p.x = best % COLUMNS - MARGIN;
+            p.length = distance[best];
+            for (int at = best, k = p.length; at != first; at = parent[at])
+                p.keys[--k] = key[at];
+        }
+    }
+}
+
+template<typename BoardType>
+bool InputPaths<BoardType>::find(const BoardType& board, const Object& piece, const Object& target, vector<Uint8>& keys)
+{
+    if (table_.empty())
+        build();
+    
+    const Object locked = hard_drop(board, target);
+    const int x = target.get_xPos();
+    if (x >= -MARGIN && x < BoardType::width + MARGIN)
+    {
+        //The table path, replayed on the board the way run_game applies the keys
+        const Path& p = path(piece.get_type(), piece.get_rotation(), target.get_rotation(), x);
+        if (p.rotation >= 0)
+        {
+            Object pose = piece;
+            for (int k = 0; k < p.length; ++k)
+            {
+                const Object before = pose;
+                switch (p.keys[k])
+                {
+                case PATH_LEFT: pose.set_xPos(pose.get_xPos() - 1); break;
+                case PATH_RIGHT: pose.set_xPos(pose.get_xPos() + 1); break;
+                case PATH_Z: pose.rotate_left(); break;
+                case PATH_X: pose.rotate_right(); break;
+                }
+                if (!board.isMovementPossible(pose))
+                    pose = before;
+            }
+            if (pose.get_rotation() == p.rotation && pose.get_xPos() == p.x && same_cells(hard_drop(board, pose), locked))
+            {
+                keys.insert(keys.end(), p.keys, p.keys + p.length);
+                return true;
+            }
+        }
+    }
+    
+    auto lands = [&](const Object& pose) { return same_cells(hard_drop(board, pose), locked); };
+    return search_.find(board, piece, lands, keys);
+}
+
+//Bot settings, set on the command line
+struct BotSettings
+{
+    BotSettings()
+    : enabled(false), budget(100), threads(1) {}
+    
+    bool enabled;
+    Uint32 budget; //ms to think about every object, never more than 3/4 of the gravity interval
+    int threads;
+};
+
+BotSettings bot_settings;
+
+//A bot that plays by pushing key presses. Every place the object (or the held one) can be dropped
+//is a candidate, and the candidates are compared by Monte Carlo rollouts: the known next object and
+//then sampled ones are dropped greedily, and the rows cleared plus how good the board looks at the
+//end is the value. The threads share the candidates and pick the next one to roll out with UCB,
+//with a virtual loss on candidates that other threads are rolling out, until the time is up.
+template<typename BoardType>
+class Planner
+{
+public:
+    struct Move
+    {
+        bool hold;
+        int turns; //Right turns
+        int shift; //Columns to move, negative to the left
+    };
+    
+    Planner(int threads)
+    : threads_(max(threads, 1)) { keys_.reserve(64); }
+    
+    Move plan(const BoardType&, const Object& current, const Object& next, const Object* saved_object, bool exchanged, Uint32 budget);
+    const vector<Uint8>& get_keys() const { return keys_; } //The PathKeys of the last plan, after the hold if it holds
+    
+private:
+    static const int ROLLOUT_DEPTH = 3; //Objects dropped after the candidate
+    static const int VIRTUAL_LOSS = 10;
+    static const int GAME_OVER = -1000;
+    
+    struct Candidate
+    {
+        BoardType board;
+        Move move;
+        int next_type; //The object that comes next, 0 if it isn't known
+        double reward; //Of the candidates own drop
+        double prior; //Reward and evaluation right after the drop
+        double sum; //Of the rollout values
+        int visits;
+        int pending; //Rollouts running on other threads
+    };
+    
+    void add_candidates(const BoardType&, const Object& piece, bool hold, int next_type);
+    int select(int total) const; //UCB with virtual loss, called with mutex_ held
+    double rollout(const Candidate&, Uint32& random) const;
+    static double drop_greedily(BoardType& board, int type, bool& alive);
+    static int sample_type(Uint32& random, int previous);
+    
+    int threads_;
+    vector<Candidate> candidates_;
+    mutex mutex_;
+    InputPaths<BoardType> paths_;
+    vector<Uint8> keys_;
+};
+
+template<typename BoardType>
+int Planner<BoardType>::sample_type(Uint32& random, int previous)
+{
+    return draw_type(random, previous);
+}
+
+template<typename BoardType>
+void Planner<BoardType>::add_candidates(const BoardType& board, const Object& piece, bool hold, int next_type)
+{
+    auto add = [&](const Object& dropped, int turns, int shift)
+    {
+        Candidate candidate;
+        Object locked = dropped;
+        candidate.board = board;
+        candidate.board.store_object(locked);
+        const int score = candidate.board.get_score();
+        candidate.board.clear_row(locked);
+        candidate.move.hold = hold;
+        candidate.move.turns = turns;
+        candidate.move.shift = shift;
+        candidate.next_type = next_type;
+        candidate.reward = (candidate.board.get_score() - score)/100.0;
+        candidate.prior = candidate.reward + evaluate_board(candidate.board);
+        candidate.sum = 0;
+        candidate.visits = 0;
+        candidate.pending = 0;
+        candidates_.push_back(candidate);
+    };
+    for_each_drop(board, piece, add);
+}
+
+template<typename BoardType>
+double Planner<BoardType>::drop_greedily(BoardType& board, int type, bool& alive)
+{
+    const Object piece(type, BoardType::spawn_x);
+    alive = board.isMovementPossible(piece);
+    if (!alive)
+        return GAME_OVER;
+    
+    double best_value = GAME_OVER;
+    BoardType best = board;
+    auto consider = [&](const Object& dropped, int, int)
+    {
+        BoardType after = board;
+        Object locked = dropped;
+        after.store_object(locked);
+        after.clear_row(locked);
+        const double value = (after.get_score() - board.get_score())/100.0 + evaluate_board(after);
+        if (value > best_value)
+        {
+            best_value = value;
+            best = after;
+        }
+    };
+    for_each_drop(board, piece, consider);
+    
+    const double reward = (best.get_score() - board.get_score())/100.0;
+    board = best;
+    return reward;
+}
+
+template<typename BoardType>
+double Planner<BoardType>::rollout(const Candidate& candidate, Uint32& random) const
+{
+    BoardType board = candidate.board;
+    double value = candidate.reward;
+    int type = candidate.next_type != 0 ? candidate.next_type : sample_type(random, 0);
+    
+    for (int depth = 0; depth < ROLLOUT_DEPTH; ++depth)
+    {
+        bool alive;
+        value += drop_greedily(board, type, alive);
+        if (!alive)
+            return GAME_OVER;
+        type = sample_type(random, type);
+    }
+    return value + evaluate_board(board);
+}
+
+template<typename BoardType>
+int Planner<BoardType>::select(int total) const
+{
+    int best = 0;
+    double best_score = -1e300;
+    for (size_t i = 0; i < candidates_.size(); ++i)
+    {
+        const Candidate& c = candidates_[i];
+        const int n = c.visits + c.pending;
+        //Untried candidates come first, the best looking ones before the others
+        const double score = (n == 0) ? 1e9 + c.prior
+                           : (c.sum - c.pending*VIRTUAL_LOSS)/n + 2.0*sqrt(log(total + 1.0)/n);
+        if (score > best_score)
+        {
+            best_score = score;
+            best = i;
+        }
+    }
+    return best;
+}
+
+template<typename BoardType>
+typename Planner<BoardType>::Move Planner<BoardType>::plan(const BoardType& board, const Object& current, const Object& next,
+                                                           const Object* saved_object, bool exchanged, Uint32 budget)
+{
+    candidates_.clear();
+    keys_.clear();
+    add_candidates(board, current, false, next.get_type());
+    
+    //Holding brings in the held object, or the next one the first time
+    Object held(next.get_type(), BoardType::spawn_x);
+    if (saved_object != NULL)
+    {
+        held = *saved_object;
+        held.spawn(BoardType::spawn_x);
+    }
+    if (!exchanged)
+        add_candidates(board, held, true, saved_object != NULL ? next.get_type() : 0);
+    
+    Move none = { false, 0, 0 };
+    if (candidates_.empty())
+        return none;
+    
+    const Uint64 deadline = precise_ticks() + budget*Uint64(1000);
+    int total = 0;
+    auto work = [&](Uint32 seed)
+    {
+        Uint32 random = seed;
+        while (precise_ticks() < deadline)
+        {
+            int chosen;
+            {
+                lock_guard<mutex> lock(mutex_);
+                chosen = select(total);
+                ++candidates_[chosen].pending;
+            }
+            const double value = rollout(candidates_[chosen], random);
+            {
+                lock_guard<mutex> lock(mutex_);
+                Candidate& c = candidates_[chosen];
+                --c.pending;
+                ++c.visits;
+                c.sum += value;
+                ++total;
+            }
+        }
+    };
+    
+    vector<thread> helpers;
+    for (int t = 1; t < threads_; ++t)
+        helpers.push_back(thread(work, 7919u*t + 1));
+    work(precise_ticks() & 0xFFFFFFFF);
+    for (size_t t = 0; t < helpers.size(); ++t)
+        helpers[t].join();
+    
+    //The best average, or the best looking drop if there was no time for rollouts
+    int best = 0;
+    for (size_t i = 1; i < candidates_.size(); ++i)
+    {
+        const Candidate& c = candidates_[i];
+        const Candidate& b = candidates_[best];
+        const double value = c.visits > 0 ? c.sum/c.visits : c.prior;
+        const double best_value = b.visits > 0 ? b.sum/b.visits : b.prior;
+        if (value > best_value)
+            best = i;
+    }
+    
+    //The turns and shift are where the object goes, the keys are the fewest that get it there
+    const Move& move = candidates_[best].move;
+    const Object& piece = move.hold ? held : current;
+    Object target = piece;
+    for (int i = 0; i < move.turns; ++i)
+        target.rotate_right();
+    target.set_xPos(piece.get_xPos() + move.shift);
+    if (!paths_.find(board, piece, target, keys_))
+    {
+        keys_.assign(move.turns, PATH_X);
+        keys_.insert(keys_.end(), abs(move.shift), move.shift < 0 ? PATH_LEFT : PATH_RIGHT);
+    }
+    return move;
+}
+
+//Presses a key for the bot, and lets go of it right away
+void push_bot_key(SDLKey sym)
+{
+    SDL_Event key;
+    memset(&key, 0, sizeof(key));
+    key.type = SDL_KEYDOWN;
+    key.key.state = SDL_PRESSED;
+    key.key.keysym.sym = sym;
+    SDL_PushEvent(&key);
+    key.type = SDL_KEYUP;
+    key.key.state = SDL_RELEASED;
+    SDL_PushEvent(&key);
+}
+
+#ifdef TETRIS_ALLOCATION_GATE
+//Test mode for run_game: plays with synthetic key presses and fails if any frame after
+//the warm-up frames of a game allocates memory
+class AllocationGate
+{
+public:
+    AllocationGate(int frames)
+    : frames_(frames), checked_(0), failed_(0), first_failed_(-1), warmup_(0), last_count_(0), seed_(1) {}
+    
+    void start_game(); //Call before every game, the first frames of a game are warm-up
+    bool end_frame(); //Call once per frame, returns false when all frames are checked
+    bool done() const { return checked_ >= frames_; }
+    int report() const; //Prints the result and returns the exit code
+    
+private:
+    static const int WARMUP_FRAMES = 60;
+    
+    void push_input();
+    
+    int frames_;
+    int checked_;
+    int failed_; //Frames that allocated
+    int first_failed_;
+    int warmup_;
+    unsigned long last_count_;
+    Uint32 seed_;
+};
+
+AllocationGate* allocation_gate = NULL; //Set while the gate runs
+
+void AllocationGate::start_game()
+{
+    warmup_ = WARMUP_FRAMES;
+    last_count_ = allocation_count.load(memory_order_relaxed);
+}
+
+bool AllocationGate::end_frame()
+{
+    const unsigned long count = allocation_count.load(memory_order_relaxed);
+    
+    if (warmup_ > 0)
+        --warmup_;
+    else
+    {
+        if (count != last_count_)
+        {
+            if (failed_ == 0)
+                first_failed_ = checked_;
+            ++failed_;
+        }
+        ++checked_;
+    }
+    
+    last_count_ = count;
+    push_input();
+    return !done();
+}
+
+void AllocationGate::push_input()
+{
+    //Mostly moves and rotations, now and then a hard drop or a hold
+    const SDLKey keys[16] = { SDLK_LEFT, SDLK_RIGHT, SDLK_DOWN, SDLK_UP, SDLK_z, SDLK_x, SDLK_LEFT, SDLK_RIGHT,
+                              SDLK_DOWN, SDLK_DOWN, SDLK_x, SDLK_z, SDLK_LEFT, SDLK_RIGHT, SDLK_LSHIFT, SDLK_SPACE };
+    seed_ = seed_ * 1103515245 + 12345;
+    push_bot_key(keys[(seed_ >> 16) % 16]); //Pressed and let go, a held key would auto-repeat
+}
+
+int AllocationGate::report() const
+{
+    if (failed_ > 0)
+    {
+        fprintf(stderr, "Allocation gate failed: %d of %d frames allocated, the first one was frame %d\n", failed_, checked_, first_failed_);
+        return 1;
+    }
+    fprintf(stderr, "Allocation gate passed: %d frames without allocations\n", checked_);
+    return 0;
+}
+#endif
+
+//Load test for run_game: presses synthetic keys at a steady rate from a seeded pattern, through the
+//whole path of a real game from SDLs event queue to the flip, and reports how many the game handled and
+//how long its frames took. Every key is let go right away, like the bot does it.
+class InputLoad
+{
+public:
+    //pattern weighs the kinds of keys, e.g. "m4r2d1h1": m moves, r rotates, d hard drops and h holds
+    InputLoad(int rate, double seconds, Uint32 seed, const string& pattern);
+    
+    bool end_frame(); //Call once per frame, returns false when the time is up
+    void handled() { ++handled_; ++frame_inputs_; } //Call for every key the game takes
+    bool done() const { return done_; }
+    int report() const; //Prints the result and returns the exit code
+    
+private:
+    static const Uint64 BUCKET = 10; //us per bucket of the frame times
+    static const int BUCKETS = 10000; //Up to 100 ms, longer frames go in the last bucket
+    
+    void push_key(SDLKey);
+    bool release(); //Pushes the key-up that didn't fit in the queue, returns false if it still doesn't
+    Uint64 percentile(double) const;
+    
+    int rate_; //Keys pressed per second
+    Uint64 duration_; //us
+    Uint32 seed_;
+    vector<SDLKey> keys_; //Drawn from evenly, each kind as often as it is weighed
+    SDLKey released_; //Pressed key whose key-up is still to be pushed, SDLK_UNKNOWN if none
+    Uint64 start_;
+    Uint64 last_frame_;
+    Uint64 pushed_;
+    Uint64 dropped_; //SDLs queue was full
+    Uint64 handled_;
+    Uint64 frames_;
+    Uint64 input_frames_; //Frames that handled at least one key
+    Uint64 most_inputs_; //In one frame
+    Uint64 frame_inputs_;
+    Uint64 total_time_;
+    Uint64 longest_;
+    vector<Uint32> frame_times_; //Frames by their time, in buckets of BUCKET us
+    bool done_;
+};
+
+InputLoad* input_load = NULL; //Set while the load test runs
+
+InputLoad::InputLoad(int rate, double seconds, Uint32 seed, const string& pattern)
+: rate_(max(rate, 1)), duration_(static_cast<Uint64>(seconds*1000000)), seed_(seed), released_(SDLK_UNKNOWN), start_(0), last_frame_(0), pushed_(0),
+  dropped_(0), handled_(0), frames_(0), input_frames_(0), most_inputs_(0), frame_inputs_(0), total_time_(0), longest_(0),
+  frame_times_(BUCKETS, 0), done_(false)
+{
+    const SDLKey moves[3] = { SDLK_LEFT, SDLK_RIGHT, SDLK_DOWN };
+    const SDLKey rotations[2] = { SDLK_z, SDLK_x };
+    for (size_t i = 0; i < pattern.size(); ++i)
+    {
+        const int weight = max(atoi(pattern.c_str() + i + 1), 1);
+        for (int w = 0; w < weight; ++w)
+        {
+            if (pattern[i] == 'm')
+                keys_.insert(keys_.end(), moves, moves + 3);
+            else if (pattern[i] == 'r')
+                keys_.insert(keys_.end(), rotations, rotations + 2);
+            else if (pattern[i] == 'd')
+                keys_.push_back(SDLK_SPACE);
+            else if (pattern[i] == 'h')
+                keys_.push_back(SDLK_LSHIFT);
+        }
+    }
+    if (keys_.empty())
+        keys_.push_back(SDLK_LEFT);
+}
+
+void InputLoad::push_key(SDLKey sym)
+{
+    //A key is only pressed once the one before it is released, else it would be held and repeat
+    if (!release())
+    {
+        ++dropped_;
+        return;
+    }
+    SDL_Event key;
+    memset(&key, 0, sizeof(key));
+    key.type = SDL_KEYDOWN;
+    key.key.state = SDL_PRESSED;
+    key.key.keysym.sym = sym;
+    if (SDL_PushEvent(&key) != 0)
+    {
+        ++dropped_;
+        return;
+    }
+    released_ = sym;
+    release();
+}
+
+bool InputLoad::release()
+{
+    if (released_ == SDLK_UNKNOWN)
+        return true;
+    SDL_Event key;
+    memset(&key, 0, sizeof(key));
+    key.type = SDL_KEYUP;
+    key.key.state = SDL_RELEASED;
+    key.key.keysym.sym = released_;
+    if (SDL_PushEvent(&key) != 0)
+        return false;
+    released_ = SDLK_UNKNOWN;
+    return true;
+}
+
+bool InputLoad::end_frame()
+{
+    const Uint64 now = precise_ticks();
+    if (start_ == 0)
+        start_ = now;
+    else
+    {
+        const Uint64 frame = now - last_frame_;
+        ++frames_;
+        total_time_ += frame;
+        longest_ = max(longest_, frame);
+        ++frame_times_[min(frame/BUCKET, static_cast<Uint64>(BUCKETS - 1))];
+        if (frame_inputs_ > 0)
+            ++input_frames_;
+        most_inputs_ = max(most_inputs_, frame_inputs_);
+    }
+    last_frame_ = now;
+    frame_inputs_ = 0;
+    
+    if (now - start_ >= duration_)
+    {
+        done_ = true;
+        return false;
+    }
+    
+    release();
+    //The keys that are due by now, a slow frame gets a burst of them like a real queue would
+    const Uint64 due = (now - start_)*rate_/1000000;
+    for (; pushed_ < due; ++pushed_)
+    {
+        seed_ = seed_ * 1103515245 + 12345;
+        push_key(keys_[(seed_ >> 16) % keys_.size()]);
+    }
+    return true;
+}
+
+Uint64 InputLoad::percentile(double fraction) const
+{
+    const Uint64 wanted = static_cast<Uint64>(ceil(fraction*frames_));
+    Uint64 seen = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+    {
+        seen += frame_times_[i];
+        if (seen >= wanted && seen > 0)
+            return (i + 1)*BUCKET;
+    }
+    return longest_;
+}
+
+int InputLoad::report() const
+{
+    const double seconds = (last_frame_ - start_)/1000000.0;
+    if (frames_ == 0 || seconds <= 0)
+    {
+        fprintf(stderr, "Input load: no frames ran\n");
+        return 1;
+    }
+    
+    //Keys still queued when the time ran out were neither dropped nor handled
+    const Uint64 accepted = pushed_ - dropped_;
+    printf("input load: %d keys/s for %.1f s, %llu frames\n", rate_, seconds, static_cast<unsigned long long>(frames_));
+    printf("keys: %llu pressed, %llu handled (%.0f/s), %llu dropped by a full queue, %llu still queued\n",
+           static_cast<unsigned long long>(pushed_), static_cast<unsigned long long>(handled_), handled_/seconds,
+           static_cast<unsigned long long>(dropped_),
+           static_cast<unsigned long long>(accepted > handled_ ? accepted - handled_ : 0));
+    printf("coalesced: %llu keys shared a frame with an earlier one, up to %llu in one frame\n",
+           static_cast<unsigned long long>(handled_ - min(handled_, input_frames_)), static_cast<unsigned long long>(most_inputs_));
+    printf("frame time us: mean %.0f, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n", double(total_time_)/frames_,
+           static_cast<unsigned long long>(percentile(0.5)), static_cast<unsigned long long>(percentile(0.9)),
+           static_cast<unsigned long long>(percentile(0.99)), static_cast<unsigned long long>(percentile(0.999)),
+           static_cast<unsigned long long>(longest_));
+    return 0;
+}
+
+template<typename BoardType>
+int run_game(bool& quit, GameState& state)
+{
+    Scene scene(PLAY);
+    bool leave_state = false;
+    //Bool to check if there is a saved object
+    bool saved_object_exist = false;
+    
+    Tetris tetris; //Create main-class
+    Object current(get_new_random(current), BoardType::spawn_x); //Create our current Tetris-object
+    Object next(get_new_random(current), BoardType::spawn_x); //Create next Tetris-object
+    
+    Object saved_object(get_new_random(current), BoardType::spawn_x);
+    Object predicted_position(current.get_type(), BoardType::spawn_x);
+    BoardType board; //Create the gameboard
+    
+    //For level increasement
+    int speed = 800;
+    int objects = 1; //Counts
+    int placed = 0; //Objects placed this game
+    
+    AutoShift auto_shift(auto_shift_settings);
+    
+    //Moves the object for the held keys that are due, after every key event and once a frame
+    auto move_held_keys = [&](Uint64 now)
+    {
+        int direction;
+        int shift = auto_shift.shift_steps(now, BoardType::width, direction);
+        int drop = auto_shift.drop_steps(now, speed*Uint64(1000), BoardType::rows);
+        if (shift > 0 || drop > 0)
+        {
+            const int xPos = current.get_xPos();
+            const int yPos = current.get_yPos();
+            for (; shift > 0; --shift)
+            {
+                current.set_xPos(current.get_xPos() + direction);
+                if (!board.isMovementPossible(current))
+                {
+                    current.set_xPos(current.get_xPos() - direction);
+                    break;
+                }
+            }
+            for (; drop > 0; --drop)
+            {
+                current.set_yPos(current.get_yPos() + 1);
+                if (!board.isMovementPossible(current))
+                {
+                    current.set_yPos(current.get_yPos() -1);
+                    break;
+                }
+            }
+            
+            if (current.get_xPos() != xPos || current.get_yPos() != yPos)
+            {
+                update_predicted_position(predicted_position, current, board);
+                board.follow(current);
+                board.draw_board();
+                current.draw_object(board.get_view());
+                predicted_position.draw_predicted_position(board.get_view());
+                renderer->present();
+            }
+        }
+    };
+    
+    Planner<BoardType> planner(bot_settings.threads);
+    bool planned = false; //The bot has pressed its keys for the current object
+    
+    RenderThread drawer(threaded_rendering);
+    
+    //For the analytics of the current object
+    Uint32 spawn_time = SDL_GetTicks();
+    int keys = 0;
+    if (analytics != NULL)
+        analytics->start_game();
+
+    //Apply the background to the screen
+    tetris.apply_surface( 0, 0, background );
+    
+    //Update the screen
+    renderer->present();
+    
+    
+    //Gravity ticks are counted from the start, so that they don't drift with the frames
+    Uint64 next_fall = precise_ticks() + speed*Uint64(1000);
+    
+    //Lets the object fall for every gravity tick up to the given time
+    auto fall_until = [&](Uint64 until)
+    {
+        while (!leave_state && next_fall <= until)
+        {
+            current.set_yPos(current.get_yPos() +1);
+            if (!board.isMovementPossible(current))
+            {
+                current.set_yPos(current.get_yPos() -1);
+                board.store_object(current);
+                const int lines = board.clear_row(current);
+                if (analytics != NULL)
+                    analytics->record_piece(current, lines, spawn_time, keys, board.get_height(), board.count_holes());
+                spawn_time = SDL_GetTicks();
+                keys = 0;
+                planned = false;
+                current = next;
+                ++objects;
+                ++placed;
+                next = Object(get_new_random(next), BoardType::spawn_x);
+                if (board.isGameover(current))
+                {
+                    leave_state = true;
+                    state = GAME_OVER;
+                }
+            }
+            
+            update_predicted_position(predicted_position, current, board);
+            board.follow(current);
+            board.draw_board();
+            current.draw_object(board.get_view());
+            predicted_position.draw_predicted_position(board.get_view());
+            next_fall += speed*Uint64(1000);
+            
+            //The rendered score texts are shared, a render thread draws them from its snapshots
+            if (!drawer.enabled())
+                board.print_score_level();
+            
+            renderer->present();
+        }
+    };
+    
+    InputThread input;
+    TimedEvent timed = TimedEvent();
+    bool has_timed = false; //timed came in after the current frame started
+    
+    //While the user hasn't quit
+    while(!leave_state)
+    {
+#ifdef TETRIS_ALLOCATION_GATE
+        if (allocation_gate != NULL && !allocation_gate->end_frame())
+        {
+            state = MENU;
+            leave_state = true;
+        }
+#endif
+        if (input_load != NULL && !input_load->end_frame())
+        {
+            state = MENU;
+            leave_state = true;
+        }
+        
+        if (objects == 20)
+        {
+            if (speed != 125)
+                speed -= 75;
+            objects = 0;
+            board.increase_level();
+        }
+        
+        
+        next.draw_next();
+        
+        if(saved_object_exist)
+            saved_object.draw_saved_object();
+        
+        input.poll();
+        const Uint64 now = precise_ticks();
+        
+        //The events and the gravity ticks up to now, in the order they happened. Events that came
+        //in after now wait for the next frame, so that no tick is applied ahead of an earlier event
+        while (has_timed || input.pop(timed))
+        {
+            has_timed = timed.time > now;
+            if (has_timed)
+                break;
+            fall_until(timed.time);
+            event = timed.event;
+            
+            //If the user has Xed out the window
+            if( event.type == SDL_QUIT )
+            {
+                leave_state = true;
+                //Quit the program
+                quit = true;
+            }
+            
+            //If a key was pressed
+            if (event.type == SDL_KEYDOWN)
+            {
+                if (event.key.keysym.sym == SDLK_ESCAPE)
+                {
+                    state = MENU;
+                    leave_state = true;
+                }
+                else
+                    ++keys;
+                if (input_load != NULL)
+                    input_load->handled();
+                
+                //Left, right and down move the object while they are held, see below
+                auto_shift.press(event.key.keysym.sym, timed.time);
+                move_held_keys(timed.time);
+                
+                if (event.key.keysym.sym == SDLK_UP)
+                {
+                    current.rotate_left();
+                    if (!board.isMovementPossible(current))
+                    {
+                        current.rotate_right();
+                    }
+                    update_predicted_position(predicted_position, current, board);
+                    board.follow(current);
+                    board.draw_board();
+                    current.draw_object(board.get_view());
+                    predicted_position.draw_predicted_position(board.get_view());
+                }
+                
+                if (event.key.keysym.sym == SDLK_z)
+                {
+                    current.rotate_left();
+                    if (!board.isMovementPossible(current))
+                    {
+                        current.rotate_right();
+                    }
+                    update_predicted_position(predicted_position, current, board);
+                    board.follow(current);
+                    board.draw_board();
+                    current.draw_object(board.get_view());
+                    predicted_position.draw_predicted_position(board.get_view());
+                }
+                
+                if (event.key.keysym.sym == SDLK_x)
+                {
+                    current.rotate_right();
+                    if (!board.isMovementPossible(current))
+                    {
+                        current.rotate_left();
+                    }
+                    update_predicted_position(predicted_position, current, board);
+                    board.follow(current);
+                    board.draw_board();
+                    current.draw_object(board.get_view());
+                    predicted_position.draw_predicted_position(board.get_view());
+                }
+                
+                if (event.key.keysym.sym == SDLK_SPACE)
+                {
+                    while (board.isMovementPossible(current))
+                    {
+                        current.set_yPos((current.get_yPos()+1));
+                    }
+                    current.set_yPos(current.get_yPos() -1);
+                    
+                    board.store_object(current);
+                    const int lines = board.clear_row(current);
+                    if (analytics != NULL)
+                        analytics->record_piece(current, lines, spawn_time, keys, board.get_height(), board.count_holes());
+                    spawn_time = SDL_GetTicks();
+                    keys = 0;
+                    planned = false;
+                    current = next;
+                    ++objects;
+                    ++placed;
+                    next = Object(get_new_random(next), BoardType::spawn_x);
+                    
+                    board.draw_board();
+                }
+                
+                if (event.key.keysym.sym == SDLK_LSHIFT && !current.isExchanged())
+                {
+                    Object temp = saved_object;
+                    if(saved_object_exist == false)
+                    {
+                        saved_object = current;
+                        current = next;
+                        next = Object(get_new_random(next), BoardType::spawn_x);
+                        saved_object_exist = true;
+                    }
+                    else
+                    {
+                        saved_object = current;
+                        temp.spawn(BoardType::spawn_x);
+                        current = temp;
+                    }
+                    current.set_exchanged();
+                    saved_object.draw_saved_object();
+                    board.draw_board();
+                }
+            }
+            
+            if (event.type == SDL_KEYUP)
+            {
+                auto_shift.release(event.key.keysym.sym, timed.time);
+                move_held_keys(timed.time);
+            }
+            
+            renderer->present();
+            
+        }
+        
+        fall_until(now);
+        move_held_keys(now);
+        
+        //The bot thinks when a new object comes in, and presses all its keys at once
+        if (bot_settings.enabled && !planned && !leave_state)
+        {
+            const Uint32 budget = min(bot_settings.budget, static_cast<Uint32>(speed*3/4));
+            const typename Planner<BoardType>::Move move = planner.plan(board, current, next, saved_object_exist ? &saved_object : NULL,
+                                                                         current.isExchanged(), budget);
+            if (move.hold)
+                push_bot_key(SDLK_LSHIFT);
+            const vector<Uint8>& bot_keys = planner.get_keys();
+            for (size_t i = 0; i < bot_keys.size(); ++i)
+                push_bot_key(path_key_syms[bot_keys[i]]);
+            push_bot_key(SDLK_SPACE);
+            planned = true;
+        }
+        
+        drawer.publish(board, current, predicted_position, next, saved_object_exist ? &saved_object : NULL);
+        if (spectator_stream != NULL)
+            spectator_stream->publish(board, current, predicted_position, next, saved_object_exist ? &saved_object : NULL);
+        if (shared_state != NULL)
+            shared_state->publish(board, current, predicted_position, next, saved_object_exist ? &saved_object : NULL, speed, placed);
+    }
+    
+    if (has_timed)
+        input.put_back(timed); //It goes back to SDL with the others
+    if (analytics != NULL)
+        analytics->end_game(board.get_score(), board.get_level());
+    return board.get_score();
+}
+
+//Plays a game on the board variant given on the command line, the standard board by default
+int play_variant(const string& variant, bool& quit, GameState& state)
+{
+    if (variant == "drill")
+        return run_game<DrillBoard>(quit, state);
+    if (variant == "wide")
+        return run_game<WideBoard>(quit, state);
+    if (variant == "extrawide")
+        return run_game<ExtraWideBoard>(quit, state);
+    if (variant == "endurance")
+        return run_game<EnduranceBoard>(quit, state);
+    return run_game<Board>(quit, state);
+}
+
+//Perft, as in chess engines: counts the distinct board states reachable after 1..N placed objects
+//of a seeded sequence, using the games own moves, rotations, hold and row clearing. Every object can
+//be moved, rotated and dropped anywhere it can reach from the spawn position, or held first the way
+//LSHIFT does it. States are told apart by a 64-bit hash of the taken blocks, the held object and the
+//position in the sequence. Each level is expanded on several threads and deduplicated in shards.
+template<typename BoardType>
+class Perft
+{
+public:
+    struct Node
+    {
+        BoardType board;
+        int piece; //Index in the sequence of the object to place
+        Uint8 hold_type; //0 if nothing is held
+        Uint8 hold_rotation; //A held object keeps its rotation
+    };
+    
+    Perft(const vector<int>& sequence, int threads)
+    : sequence_(sequence), threads_(threads), nodes_(0) {}
+    
+    //Returns the number of distinct states at every depth from 1 to depth
+    vector<Uint64> count(const Node& root, int depth);
+    //Calls f(child, locked object) for every placement of the nodes object, held or not, returns the number of placements
+    template<typename F>
+    Uint64 expand(const Node&, F& f) const;
+    
+    Uint64 get_nodes() const { return nodes_; } //Placements generated so far
+    static Uint64 hash(const Node&);
+    
+private:
+    template<typename F>
+    Uint64 place_all(const Node&, const Object& spawned, int piece, Uint8 hold_type, Uint8 hold_rotation, bool* rotations, F& f) const;
+    
+    const vector<int>& sequence_;
+    int threads_;
+    Uint64 nodes_;
+};
+
+template<typename BoardType>
+Uint64 Perft<BoardType>::hash(const Node& node)
+{
+    //FNV-1a over one bit per block, row by row, then the held object and the sequence position
+    Uint64 h = 14695981039346656037ULL;
+    for (int y = 0; y < BoardType::rows; ++y)
+    {
+        Uint32 bits = 0;
+        for (int x = 0; x < BoardType::width; ++x)
+            bits |= Uint32(node.board.get_cell(x, y) != 0) << x;
+        for (int k = 0; k < 4; ++k)
+            h = (h ^ ((bits >> (8*k)) & 0xFF)) * 1099511628211ULL;
+    }
+    h = (h ^ node.hold_type) * 1099511628211ULL;
+    h = (h ^ node.hold_rotation) * 1099511628211ULL;
+    h = (h ^ Uint64(node.piece)) * 1099511628211ULL;
+    return h;
+}
+
+template<typename BoardType>
+template<typename F>
+Uint64 Perft<BoardType>::place_all(const Node& node, const Object& spawned, int piece, Uint8 hold_type, Uint8 hold_rotation, bool* rotations, F& f) const
+{
+    //Every pose the object can reach, from the spawn position with left, right, down and both rotations
+    const int margin = 4;
+    const int cols = BoardType::width + 2*margin;
+    const int rows = BoardType::rows + margin;
+    static thread_local vector<Uint8> seen; //Reused, every thread searches on its own
+    static thread_local vector<int> queue;
+    seen.assign(4*cols*rows, 0);
+    queue.clear();
+    
+    Object poses[4] = { spawned, spawned, spawned, spawned }; //The object in every rotation, by rotation_
+    for (int r = 1; r < 4; ++r)
+    {
+        Object turned = spawned;
+        for (int k = 0; k < r; ++k)
+            turned.rotate_right();
+        poses[turned.get_rotation()] = turned;
+    }
+    
+    Uint64 placements = 0;
+    if (!node.board.isMovementPossible(spawned))
+        return 0; //Game over
+    
+    const int start = (spawned.get_rotation()*rows + spawned.get_yPos())*cols + spawned.get_xPos() + margin;
+    seen[start] = 1;
+    queue.push_back(start);
+    
+    for (size_t next = 0; next < queue.size(); ++next)
+    {
+        const int rotation = queue[next] / (cols*rows);
+        const int y = queue[next] / cols % rows;
+        const int x = queue[next] % cols - margin;
+        if (rotations != NULL)
+            rotations[rotation] = true;
+        
+        //Left, right and down move, the rotations turn in place and are undone if they collide
+        const int moves[5][3] = { {-1, 0, 0}, {1, 0, 0}, {0, 1, 0}, {0, 0, 3}, {0, 0, 1} };
+        for (int m = 0; m < 5; ++m)
+        {
+            Object& moved = poses[(rotation + moves[m][2]) % 4];
+            moved.set_xPos(x + moves[m][0]);
+            moved.set_yPos(y + moves[m][1]);
+            const bool possible = node.board.isMovementPossible(moved);
+            
+            if (m == 2 && !possible)
+            {
+                //It can't fall any further, so it locks here
+                Node child = node;
+                Object locked = poses[rotation];
+                locked.set_xPos(x);
+                locked.set_yPos(y);
+                child.board.store_object(locked);
+                child.board.clear_row(locked);
+                child.piece = piece;
+                child.hold_type = hold_type;
+                child.hold_rotation = hold_rotation;
+                f(child, locked);
+                ++placements;
+            }
+            
+            const int index = (moved.get_rotation()*rows + moved.get_yPos())*cols + moved.get_xPos() + margin;
+            if (possible && !seen[index])
+            {
+                seen[index] = 1;
+                queue.push_back(index);
+            }
+        }
+    }
+    return placements;
+}
+
+template<typename BoardType>
+template<typename F>
+Uint64 Perft<BoardType>::expand(const Node& node, F& f) const
+{
+    if (node.piece >= static_cast<int>(sequence_.size()))
+        return 0;
+    
+    const Object current(sequence_[node.piece], BoardType::spawn_x);
+    bool rotations[4] = { false, false, false, false }; //Rotations the object can be held in
+    Uint64 placements = place_all(node, current, node.piece + 1, node.hold_type, node.hold_rotation, rotations, f);
+    
+    //Or hold it: the first time the next object comes in, after that the held one comes back at the
+    //spawn position in the rotation it was held in. An object that came in from a hold can't be held.
+    for (int r = 0; r < 4; ++r)
+    {
+        if (!rotations[r])
+            continue;
+        
+        if (node.hold_type == 0)
+        {
+            if (node.piece + 1 >= static_cast<int>(sequence_.size()))
+                break; //There is no next object to bring in
+            const Object next(sequence_[node.piece + 1], BoardType::spawn_x);
+            placements += place_all(node, next, node.piece + 2, current.get_type(), r, NULL, f);
+        }
+        else
+        {
+            Object held(node.hold_type, BoardType::spawn_x);
+            while (held.get_rotation() != node.hold_rotation)
+                held.rotate_right();
+            placements += place_all(node, held, node.piece + 1, current.get_type(), r, NULL, f);
+        }
+    }
+    return placements;
+}
+
+template<typename BoardType>
+vector<Uint64> Perft<BoardType>::count(const Node& root, int depth)
+{
+    typedef pair<Uint64, Node> Child;
+    vector<Uint64> counts;
+    vector<Node> frontier(1, root);
+    
+    for (int level = 1; level <= depth; ++level)
+    {
+        const bool last = level == depth; //The last level is only counted, not kept
+        
+        //Expand: thread t takes every threads_:th node and sorts the children into shards by hash
+        vector< vector< vector<Child> > > children(threads_, vector< vector<Child> >(threads_));
+        vector< vector< vector<Uint64> > > leaves(threads_, vector< vector<Uint64> >(threads_));
+        vector<Uint64> generated(threads_, 0);
+        vector<thread> workers;
+        for (int t = 0; t < threads_; ++t)
+        {
+            workers.push_back(thread([&, t]
+            {
+                auto add = [&](const Node& child, const Object&)
+                {
+                    const Uint64 h = hash(child);
+                    if (last)
+                        leaves[t][h % threads_].push_back(h);
+                    else
+                        children[t][h % threads_].push_back(Child(h, child));
+                };
+                for (size_t i = t; i < frontier.size(); i += threads_)
+                    generated[t] += expand(frontier[i], add);
+            }));
+        }
+        for (int t = 0; t < threads_; ++t)
+            workers[t].join();
+        workers.clear();
+        
+        //Deduplicate: thread s keeps the first of every state in shard s
+        vector< vector<Node> > unique(threads_);
+        vector<Uint64> distinct(threads_, 0);
+        for (int s = 0; s < threads_; ++s)
+        {
+            workers.push_back(thread([&, s]
+            {
+                unordered_set<Uint64> known;
+                for (int t = 0; t < threads_; ++t)
+                {
+                    for (size_t i = 0; i < leaves[t][s].size(); ++i)
+                        known.insert(leaves[t][s][i]);
+                    for (size_t i = 0; i < children[t][s].size(); ++i)
+                    {
+                        if (known.insert(children[t][s][i].first).second)
+                            unique[s].push_back(children[t][s][i].second);
+                    }
+                }
+                distinct[s] = known.size();
+            }));
+        }
+        for (int s = 0; s < threads_; ++s)
+            workers[s].join();
+        
+        Uint64 total = 0;
+        frontier.clear();
+        for (int t = 0; t < threads_; ++t)
+        {
+            nodes_ += generated[t];
+            total += distinct[t];
+            frontier.insert(frontier.end(), unique[t].begin(), unique[t].end());
+        }
+        counts.push_back(total);
+    }
+    return counts;
+}
+
+//The seeded object sequence for perft, drawn like get_new_random: never the same type twice in a row
+vector<int> perft_sequence(Uint32 seed, int length)
+{
+    vector<int> sequence;
+    int previous = 0;
+    for (int i = 0; i < length; ++i)
+    {
+        previous = draw_type(seed, previous);
+        sequence.push_back(previous);
+    }
+    return sequence;
+}
+
+template<typename BoardType>
+int run_perft(int depth, Uint32 seed, int threads, bool divide)
+{
+    const vector<int> sequence = perft_sequence(seed, depth + 2); //A hold can look two objects ahead
+    
+    printf("perft depth %d, seed %u, %d threads, sequence", depth, seed, threads);
+    for (size_t i = 0; i < sequence.size(); ++i)
+        printf(" %c", piece_name(sequence[i]));
+    printf("\n");
+    
+    typename Perft<BoardType>::Node root;
+    root.piece = 0;
+    root.hold_type = 0;
+    root.hold_rotation = 0;
+    
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    Perft<BoardType> perft(sequence, threads);
+    
+    if (divide)
+    {
+        //The states after every distinct first placement, each counted on its own
+        vector<typename Perft<BoardType>::Node> first;
+        vector<Object> placed;
+        unordered_set<Uint64> known;
+        auto add = [&](const typename Perft<BoardType>::Node& child, const Object& locked)
+        {
+            if (known.insert(Perft<BoardType>::hash(child)).second)
+            {
+                first.push_back(child);
+                placed.push_back(locked);
+            }
+        };
+        perft.expand(root, add);
+        
+        Uint64 total = 0;
+        for (size_t i = 0; i < first.size(); ++i)
+        {
+            const Uint64 count = (depth > 1) ? perft.count(first[i], depth - 1).back() : 1;
+            const char* held = (first[i].hold_type != root.hold_type) ? "hold " : "";
+            printf("%s%c r%d x%d y%d: %llu\n", held, piece_name(placed[i].get_type()), placed[i].get_rotation(),
+                   placed[i].get_xPos(), placed[i].get_yPos(), static_cast<unsigned long long>(count));
+            total += count;
+        }
+        printf("%d first placements, %llu states in total (states reached by several first placements count once for each)\n",
+               static_cast<int>(first.size()), static_cast<unsigned long long>(total));
+    }
+    else
+    {
+        const vector<Uint64> counts = perft.count(root, depth);
+        for (int d = 0; d < depth; ++d)
+            printf("depth %d: %llu\n", d + 1, static_cast<unsigned long long>(counts[d]));
+    }
+    
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("%llu nodes in %.3f s, %.0f nodes/s\n", static_cast<unsigned long long>(perft.get_nodes()), seconds,
+           perft.get_nodes()/max(seconds, 1e-9));
+    return 0;
+}
+
+//Runs perft on the board variant given on the command line
+int perft_variant(const string& variant, int depth, Uint32 seed, int threads, bool divide)
+{
+    if (variant == "drill")
+        return run_perft<DrillBoard>(depth, seed, threads, divide);
+    if (variant == "wide")
+        return run_perft<WideBoard>(depth, seed, threads, divide);
+    if (variant == "extrawide")
+        return run_perft<ExtraWideBoard>(depth, seed, threads, divide);
+    if (variant == "endurance")
+    {
+        fprintf(stderr, "perft copies the board for every state, it can't run on the endurance board\n");
+        return 1;
+    }
+    return run_perft<Board>(depth, seed, threads, divide);
+}
+
+//Puzzles for the solver: a board, the objects to place on it and what counts as solved
+enum SolveGoal { SOLVE_PERFECT_CLEAR, SOLVE_LINES, SOLVE_PATTERN };
+
+struct Puzzle
+{
+    vector<int> sequence; //Object types in the order they come in
+    int hold; //Held at the start, 0 if nothing is
+    SolveGoal goal;
+    int lines; //Rows to clear for SOLVE_LINES
+    vector<string> board; //Rows of the start board from the top down, the last one is the bottom row
+    vector<string> target; //The blocks to end up with for SOLVE_PATTERN, the same way
+};
+
+//Reads a puzzle file, one setting per line, lines starting with # are skipped:
+//  pieces TSZOILJ   the objects in the order they come in, by their names in the piece set
+//  hold I           held at the start, nothing is if it's left out
+//  goal pc          a perfect clear, "goal lines 4" clears 4 rows, "goal pattern" ends with the target
+//  board            the rows that follow, up to the next setting, are the start board or the target,
+//  target           bottom aligned. '.' is empty, I J L O S T Z are blocks of that standard objects color, anything else is grey
+bool load_puzzle(const string& file_name, Puzzle& puzzle)
+{
+    puzzle.hold = 0;
+    puzzle.goal = SOLVE_PERFECT_CLEAR;
+    puzzle.lines = 0;
+    
+    ifstream file(file_name.c_str());
+    if (!file)
+    {
+        fprintf(stderr, "Can't open the puzzle %s\n", file_name.c_str());
+        return false;
+    }
+    
+    vector<string>* rows = NULL; //Where the rows that follow go
+    string line;
+    while (getline(file, line))
+    {
+        istringstream words(line);
+        string key, value;
+        if (!(words >> key) || key[0] == '#')
+            continue;
+        
+        if (key == "pieces" || key == "hold")
+        {
+            words >> value;
+            for (size_t i = 0; i < value.size(); ++i)
+            {
+                const int type = piece_type(toupper(value[i]));
+                if (type == 0 || (key == "hold" && i > 0))
+                {
+                    fprintf(stderr, "%s: bad %s %s\n", file_name.c_str(), key.c_str(), value.c_str());
+                    return false;
+                }
+                if (key == "hold")
+                    puzzle.hold = type;
+                else
+                    puzzle.sequence.push_back(type);
+            }
+            rows = NULL;
+        }
+        else if (key == "goal")
+        {
+            words >> value;
+            if (value == "pc")
+                puzzle.goal = SOLVE_PERFECT_CLEAR;
+            else if (value == "lines" && words >> puzzle.lines && puzzle.lines > 0)
+                puzzle.goal = SOLVE_LINES;
+            else if (value == "pattern")
+                puzzle.goal = SOLVE_PATTERN;
+            else
+            {
+                fprintf(stderr, "%s: bad goal %s\n", file_name.c_str(), value.c_str());
+                return false;
+            }
+            rows = NULL;
+        }
+        else if (key == "board")
+            rows = &puzzle.board;
+        else if (key == "target")
+            rows = &puzzle.target;
+        else if (rows != NULL)
+            rows->push_back(key);
+        else
+        {
+            fprintf(stderr, "%s: unknown setting %s\n", file_name.c_str(), key.c_str());
+            return false;
+        }
+    }
+    
+    if (puzzle.sequence.empty())
+    {
+        fprintf(stderr, "%s: no pieces to place\n", file_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+//Searches the placements of a puzzles objects for a way to solve it, depth first on several threads that
+//share the first few placements. A state is the board, the held object, the position in the sequence and
+//the rows cleared so far, and every state is searched once. States that can't lead anywhere are cut off
+//by counting blocks: the blocks of the placed objects have to add up to whole cleared rows, and on a board
+//of even width the difference between blocks in even and odd columns only changes with T, L, J and
+//standing I objects, so it can't be made up if too few of them are left.
+template<typename BoardType>
+class Solver
+{
+public:
+    typedef typename Perft<BoardType>::Node Node;
+    
+    struct Step
+    {
+        Node before; //The state the object is placed in
+        Node after; //The state it leaves, rows cleared
+        Object locked; //Where it locks
+    };
+    
+    Solver(const Puzzle&, const BoardType& target, int threads);
+    
+    //Fills in the placements, returns false if the puzzle can't be solved
+    bool solve(const Node& root, vector<Step>& steps);
+    //The keys to press for a step, Left, Right, Down, Z, X, LShift and Space as run_game takes them
+    bool get_keys(const Step&, vector<string>& keys) const;
+    Uint64 get_nodes() const { return nodes_; } //Placements generated
+    
+private:
+    struct Branch
+    {
+        Node node;
+        int lines;
+        vector<Step> path;
+    };
+    
+    bool search(const Node&, int lines, vector<Step>& path);
+    bool is_solved(const Node&, int lines) const;
+    bool can_solve(const Node&, int lines) const; //False if the state surely leads nowhere
+    bool first_visit(const Node&, int lines);
+    void found(const vector<Step>& path);
+    static int count_blocks(const BoardType&);
+    //Rows a step cleared, blocks is count_blocks of the board before it
+    static int cleared_rows(int blocks, const Step& step)
+    {
+        return (blocks + piece_set->pieces[step.locked.get_type()].blocks - count_blocks(step.after.board))/BoardType::width;
+    }
+    static int stripe_difference(const BoardType&); //Blocks in even columns minus blocks in odd ones
+    static int stripe_change(int type) { return piece_set->pieces[type].stripe; } //How much an object can change stripe_difference by
+    
+    static const int SHARDS = 64;
+    
+    const Puzzle& puzzle_;
+    const BoardType& target_;
+    Perft<BoardType> perft_;
+    int threads_;
+    int target_blocks_;
+    int target_difference_;
+    vector<int> stripe_left_; //Sum of stripe_change over the objects from every position in the sequence on
+    unordered_set<Uint64> visited_[SHARDS];
+    mutex visited_lock_[SHARDS];
+    atomic<bool> solved_;
+    atomic<Uint64> nodes_;
+    mutex result_lock_;
+    vector<Step> result_;
+};
+
+template<typename BoardType>
+Solver<BoardType>::Solver(const Puzzle& puzzle, const BoardType& target, int threads)
+: puzzle_(puzzle), target_(target), perft_(puzzle.sequence, 1), threads_(threads),
+  target_blocks_(count_blocks(target)), target_difference_(stripe_difference(target)),
+  stripe_left_(puzzle.sequence.size() + 1, 0), solved_(false), nodes_(0)
+{
+    for (int i = static_cast<int>(puzzle.sequence.size()) - 1; i >= 0; --i)
+        stripe_left_[i] = stripe_left_[i + 1] + stripe_change(puzzle.sequence[i]);
+}
+
+template<typename BoardType>
+int Solver<BoardType>::count_blocks(const BoardType& board)
+{
+    int blocks = 0;
+    for (int y = 0; y < BoardType::rows; ++y)
+    {
+        for (int x = 0; x < BoardType::width; ++x)
+            blocks += board.get_cell(x, y) != 0;
+    }
+    return blocks;
+}
+
+template<typename BoardType>
+int Solver<BoardType>::stripe_difference(const BoardType& board)
+{
+    int difference = 0;
+    for (int y = 0; y < BoardType::rows; ++y)
+    {
+        for (int x = 0; x < BoardType::width; ++x)
+        {
+            if (board.get_cell(x, y) != 0)
+                difference += (x % 2 == 0) ? 1 : -1;
+        }
+    }
+    return difference;
+}
+
+template<typename BoardType>
+bool Solver<BoardType>::is_solved(const Node& node, int lines) const
+{
+    if (puzzle_.goal == SOLVE_LINES)
+        return lines >= puzzle_.lines;
+    
+    for (int y = 0; y < BoardType::rows; ++y)
+    {
+        for (int x = 0; x < BoardType::width; ++x)
+        {
+            if ((node.board.get_cell(x, y) != 0) != (target_.get_cell(x, y) != 0))
+                return false;
+        }
+    }
+    return true;
+}
+
+template<typename BoardType>
+bool Solver<BoardType>::can_solve(const Node& node, int lines) const
+{
+    const int blocks = count_blocks(node.board);
+    const int left = static_cast<int>(puzzle_.sequence.size()) - node.piece; //Objects that can still be placed
+    const int size = piece_set->blocks; //The area isn't checked if the objects differ in size
+    if (puzzle_.goal == SOLVE_LINES)
+        return size == 0 || lines + (blocks + size*left)/BoardType::width >= puzzle_.lines;
+    
+    //Some number of the objects left has to fill whole rows, all rows up to the top for a perfect clear
+    bool fits = size == 0;
+    for (int placed = 0; placed <= left && !fits; ++placed)
+    {
+        const int extra = blocks + size*placed - target_blocks_;
+        fits = extra >= 0 && extra % BoardType::width == 0
+            && (puzzle_.goal != SOLVE_PERFECT_CLEAR || extra/BoardType::width >= node.board.get_height());
+    }
+    if (!fits)
+        return false;
+    
+    //Cleared rows take as many blocks from the even columns as from the odd ones
+    if (BoardType::width % 2 == 0)
+    {
+        const int change = stripe_left_[node.piece] + stripe_change(node.hold_type);
+        return abs(stripe_difference(node.board) - target_difference_) <= change;
+    }
+    return true;
+}
+
+template<typename BoardType>
+bool Solver<BoardType>::first_visit(const Node& node, int lines)
+{
+    const Uint64 h = (Perft<BoardType>::hash(node) ^ Uint64(lines)) * 1099511628211ULL;
+    const int shard = static_cast<int>(h >> 58) % SHARDS;
+    lock_guard<mutex> lock(visited_lock_[shard]);
+    return visited_[shard].insert(h).second;
+}
+
+template<typename BoardType>
+void Solver<BoardType>::found(const vector<Step>& path)
+{
+    lock_guard<mutex> lock(result_lock_);
+    if (!solved_.exchange(true))
+        result_ = path;
+}
+
+template<typename BoardType>
+bool Solver<BoardType>::search(const Node& node, int lines, vector<Step>& path)
+{
+    if (solved_)
+        return false; //Another thread got there first
+    if (!path.empty() && is_solved(node, lines))
+    {
+        found(path);
+        return true;
+    }
+    if (!can_solve(node, lines) || !first_visit(node, lines))
+        return false;
+    
+    //The children are collected first, expand can't be entered again while it runs
+    vector<Step> children;
+    auto add = [&](const Node& child, const Object& locked)
+    {
+        const Step step = { node, child, locked };
+        children.push_back(step);
+    };
+    nodes_ += perft_.expand(node, add);
+    
+    //Boards with fewer holes first, they solve more often
+    vector< pair<int, int> > order;
+    for (size_t i = 0; i < children.size(); ++i)
+        order.push_back(make_pair(children[i].after.board.count_holes(), static_cast<int>(i)));
+    sort(order.begin(), order.end());
+    
+    const int blocks = count_blocks(node.board);
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        const Step& step = children[order[i].second];
+        const int cleared = cleared_rows(blocks, step);
+        path.push_back(step);
+        if (search(step.after, lines + cleared, path))
+            return true;
+        path.pop_back();
+    }
+    return false;
+}
+
+template<typename BoardType>
+bool Solver<BoardType>::solve(const Node& root, vector<Step>& steps)
+{
+    //The first placements are made here until there is enough work for every thread
+    vector<Branch> frontier(1);
+    frontier[0].node = root;
+    frontier[0].lines = 0;
+    for (int level = 0; level < 2 && threads_ > 1 && frontier.size() < 8*static_cast<size_t>(threads_); ++level)
+    {
+        vector<Branch> next;
+        for (size_t i = 0; i < frontier.size(); ++i)
+        {
+            const Branch& branch = frontier[i];
+            if (!branch.path.empty() && is_solved(branch.node, branch.lines))
+            {
+                steps = branch.path;
+                return true;
+            }
+            if (!can_solve(branch.node, branch.lines) || !first_visit(branch.node, branch.lines))
+                continue;
+            
+            const int blocks = count_blocks(branch.node.board);
+            auto add = [&](const Node& child, const Object& locked)
+            {
+                const Step step = { branch.node, child, locked };
+                Branch grown = { child, branch.lines + cleared_rows(blocks, step), branch.path };
+                grown.path.push_back(step);
+                next.push_back(grown);
+            };
+            nodes_ += perft_.expand(branch.node, add);
+        }
+        frontier.swap(next);
+    }
+    
+    //Every thread takes the next branch left and searches it to the end
+    atomic<size_t> taken(0);
+    vector<thread> workers;
+    for (int t = 0; t < threads_; ++t)
+    {
+        workers.push_back(thread([&]
+        {
+            for (size_t i = taken++; i < frontier.size() && !solved_; i = taken++)
+            {
+                vector<Step> path = frontier[i].path;
+                search(frontier[i].node, frontier[i].lines, path);
+            }
+        }));
+    }
+    for (int t = 0; t < threads_; ++t)
+        workers[t].join();
+    
+    if (!solved_)
+        return false;
+    steps = result_;
+    return true;
+}
+
+//The fewest keys that take an object from where it spawned to a pose done() accepts, added to keys by name
+template<typename BoardType, typename F>
+bool shortest_keys(const BoardType& board, const Object& spawned, F done, vector<string>& keys)
+{
+    PathSearch<BoardType> search;
+    vector<Uint8> path;
+    if (!search.find(board, spawned, done, path))
+        return false;
+    for (size_t i = 0; i < path.size(); ++i)
+        keys.push_back(path_key_names[path[i]]);
+    return true;
+}
+
+template<typename BoardType>
+bool Solver<BoardType>::get_keys(const Step& step, vector<string>& keys) const
+{
+    const BoardType& board = step.before.board;
+    const Object current(puzzle_.sequence[step.before.piece], BoardType::spawn_x);
+    
+    //Where a hard drop from the pose ends up has to be where the object locked
+    auto lands = [&](const Object& pose)
+    {
+        if (pose.get_rotation() != step.locked.get_rotation() || pose.get_xPos() != step.locked.get_xPos())
+            return false;
+        Object dropped = pose;
+        do
+            dropped.set_yPos(dropped.get_yPos() + 1);
+        while (board.isMovementPossible(dropped));
+        return dropped.get_yPos() - 1 == step.locked.get_yPos();
+    };
+    
+    const bool kept = step.after.hold_type == step.before.hold_type && step.after.hold_rotation == step.before.hold_rotation
+        && step.after.piece == step.before.piece + 1 && step.locked.get_type() == current.get_type();
+    if (kept && shortest_keys(board, current, lands, keys))
+    {
+        keys.push_back("Space");
+        return true;
+    }
+    
+    //Held first, in the rotation it's kept in, then the next or the held object is placed
+    auto held_turned = [&](const Object& pose) { return pose.get_rotation() == step.after.hold_rotation; };
+    Object placed(step.before.hold_type, BoardType::spawn_x);
+    if (step.before.hold_type == 0)
+        placed = Object(puzzle_.sequence[step.before.piece + 1], BoardType::spawn_x);
+    while (placed.get_rotation() != step.before.hold_rotation && step.before.hold_type != 0)
+        placed.rotate_right();
+    
+    vector<string> held;
+    if (!shortest_keys(board, current, held_turned, held))
+        return false;
+    held.push_back("LShift");
+    if (!shortest_keys(board, placed, lands, held))
+        return false;
+    held.push_back("Space");
+    keys.insert(keys.end(), held.begin(), held.end());
+    return true;
+}
+
+//Fills a board with puzzle rows, bottom aligned, returns false if they don't fit
+template<typename BoardType>
+bool puzzle_board(const vector<string>& rows, BoardType& board)
+{
+    const string names = "IJLOSTZ";
+    if (static_cast<int>(rows.size()) > BoardType::rows)
+        return false;
+    
+    const int top = BoardType::rows - static_cast<int>(rows.size());
+    for (size_t j = 0; j < rows.size(); ++j)
+    {
+        if (static_cast<int>(rows[j].size()) != BoardType::width)
+            return false;
+        for (int x = 0; x < BoardType::width; ++x)
+        {
+            const char block = rows[j][x];
+            const size_t type = names.find(block);
+            if (block != '.')
+                board.set_cell(x, top + j, (type != string::npos) ? type + 1 : 8); //8 is a grey block
+        }
+    }
+    return true;
+}
+
+template<typename BoardType>
+int run_solver(const Puzzle& puzzle, int threads)
+{
+    const char* goals[3] = { "perfect clear", "lines", "pattern" };
+    
+    typename Perft<BoardType>::Node root;
+    root.piece = 0;
+    root.hold_type = puzzle.hold;
+    root.hold_rotation = 0;
+    BoardType target;
+    if (!puzzle_board(puzzle.board, root.board) || !puzzle_board(puzzle.target, target))
+    {
+        fprintf(stderr, "The puzzle rows have to be %d blocks wide and at most %d rows\n", BoardType::width, BoardType::rows);
+        return 1;
+    }
+    
+    printf("solve %s, %d threads, sequence", goals[puzzle.goal], threads);
+    for (size_t i = 0; i < puzzle.sequence.size(); ++i)
+        printf(" %c", piece_name(puzzle.sequence[i]));
+    printf(", hold %c\n", piece_name(puzzle.hold));
+    
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    Solver<BoardType> solver(puzzle, target, threads);
+    vector<typename Solver<BoardType>::Step> steps;
+    const bool solved = solver.solve(root, steps);
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    for (size_t i = 0; i < steps.size(); ++i)
+    {
+        const Object& locked = steps[i].locked;
+        vector<string> keys;
+        printf("%c r%d x%d y%d:", piece_name(locked.get_type()), locked.get_rotation(), locked.get_xPos(), locked.get_yPos());
+        if (!solver.get_keys(steps[i], keys))
+            printf(" (no keys found)");
+        for (size_t k = 0; k < keys.size(); ++k)
+            printf(" %s", keys[k].c_str());
+        printf("\n");
+    }
+    printf("%s, %llu nodes in %.3f s, %.0f nodes/s\n", solved ? "solved" : "no solution",
+           static_cast<unsigned long long>(solver.get_nodes()), seconds, solver.get_nodes()/max(seconds, 1e-9));
+    return solved ? 0 : 2;
+}
+
+//Solves the puzzle file given on the command line on the board variant
+int solve_variant(const string& variant, const string& file, int threads)
+{
+    Puzzle puzzle;
+    if (!load_puzzle(file, puzzle))
+        return 1;
+    if (puzzle.goal == SOLVE_PATTERN && puzzle.target.empty())
+    {
+        fprintf(stderr, "%s: the pattern goal needs a target\n", file.c_str());
+        return 1;
+    }
+    
+    if (variant == "drill")
+        return run_solver<DrillBoard>(puzzle, threads);
+    if (variant == "wide")
+        return run_solver<WideBoard>(puzzle, threads);
+    if (variant == "extrawide")
+        return run_solver<ExtraWideBoard>(puzzle, threads);
+    if (variant == "endurance")
+    {
+        fprintf(stderr, "The solver copies the board for every state, it can't run on the endurance board\n");
+        return 1;
+    }
+    return run_solver<Board>(puzzle, threads);
+}
+
+//Opens a spectator stream, a file or unix:path, returns -1 if it can't be opened
+int open_spectator_source(const string& source)
+{
+    if (source.compare(0, 5, "unix:") != 0)
+        return ::open(source.c_str(), O_RDONLY);
+    
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, source.c_str() + 5, sizeof(address.sun_path) -1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (sockaddr*)&address, sizeof(address)) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+//Shows a spectator stream from a file or from unix:path until Escape is pressed.
+//A file is followed as it grows, a socket is watched until the game closes it.
+void watch_stream(const string& source, bool& quit)
+{
+    const bool is_socket = source.compare(0, 5, "unix:") == 0;
+    const int fd = open_spectator_source(source);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Can't watch %s\n", source.c_str());
+        return;
+    }
+    
+    Scene scene(PLAY);
+    Tetris tetris;
+    tetris.apply_surface(0, 0, background);
+    renderer->present();
+    
+    SpectatorDecoder decoder;
+    WatchedScore score;
+    vector<Uint8> buffer(1 << 16);
+    size_t buffered = 0;
+    bool leave_state = false;
+    
+    while (!leave_state)
+    {
+        while (SDL_PollEvent(&event))
+        {
+            if (event.type == SDL_QUIT)
+            {
+                leave_state = true;
+                quit = true;
+            }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)
+                leave_state = true;
+        }
+        
+        pollfd input = { fd, POLLIN, 0 };
+        if (poll(&input, 1, 20) <= 0)
+            continue;
+        
+        if (buffered == buffer.size())
+            buffer.resize(buffer.size()*2);
+        const ssize_t count = read(fd, &buffer[buffered], buffer.size() - buffered);
+        if (count <= 0)
+        {
+            if (is_socket)
+                leave_state = true; //The game has ended
+            else
+                SDL_Delay(20); //Wait for the file to grow
+            continue;
+        }
+        buffered += count;
+        
+        bool changed = false;
+        const size_t used = decoder.decode(&buffer[0], buffered, changed);
+        memmove(&buffer[0], &buffer[used], buffered - used);
+        buffered -= used;
+        
+        if (changed)
+            draw_spectator_state(decoder.get_state(), score);
+    }
+    
+    close(fd);
+}
+
+//Threads that share the tiles of a frame, each taking the next tile until none are left.
+//The calling thread works along and run() returns when every tile is done.
+class TilePool
+{
+public:
+    TilePool(int threads);
+    ~TilePool();
+    
+    template<typename F>
+    void run(int tiles, F& f); //Calls f(tile) for every tile from 0 to tiles-1
+    
+private:
+    template<typename F>
+    static void call(void* f, int tile) { (*static_cast<F*>(f))(tile); }
+    void work(); //Runs on every thread of the pool
+    void take_tiles();
+    
+    mutex mutex_;
+    condition_variable start_;
+    condition_variable done_;
+    vector<thread> threads_;
+    void (*call_)(void*, int); //The job of the current frame
+    void* job_;
+    int tiles_;
+    atomic<int> next_tile_;
+    int generation_; //Counts the frames, a thread wakes up for every new one
+    int busy_; //Threads still working on the frame
+    bool running_;
+};
+
+TilePool::TilePool(int threads)
+: call_(NULL), job_(NULL), tiles_(0), next_tile_(0), generation_(0), busy_(0), running_(true)
+{
+    for (int i = 1; i < threads; ++i)
+        threads_.push_back(thread(&TilePool::work, this));
+}
+
+TilePool::~TilePool()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        running_ = false;
+    }
+    start_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i)
+        threads_[i].join();
+}
+
+template<typename F>
+void TilePool::run(int tiles, F& f)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        call_ = &TilePool::call<F>;
+        job_ = &f;
+        tiles_ = tiles;
+        next_tile_ = 0;
+        busy_ = threads_.size();
+        ++generation_;
+    }
+    start_.notify_all();
+    
+    take_tiles();
+    
+    unique_lock<mutex> lock(mutex_);
+    done_.wait(lock, [this] { return busy_ == 0; });
+}
+
+void TilePool::take_tiles()
+{
+    for (int tile = next_tile_++; tile < tiles_; tile = next_tile_++)
+        call_(job_, tile);
+}
+
+void TilePool::work()
+{
+    int generation = 0;
+    unique_lock<mutex> lock(mutex_);
+    for (;;)
+    {
+        start_.wait(lock, [&] { return generation_ != generation || !running_; });
+        if (!running_)
+            return;
+        generation = generation_;
+        
+        lock.unlock();
+        take_tiles();
+        lock.lock();
+        
+        if (--busy_ == 0)
+            done_.notify_one();
+    }
+}
+
+//Draws many watched games at once, each a scaled down board in its own cell of a grid on the screen.
+//Only boards that have changed are drawn again. The screen is split into tiles that the threads of
+//a TilePool draw straight into the screens pixels, from block sprites scaled down once per size.
+class GridCompositor
+{
+public:
+    GridCompositor(int boards, int threads);
+    
+    void update(int board, const SpectatorState&); //Call when a games state has changed
+    int compose(); //Draws the changed boards and updates them on the screen, returns how many were drawn
+    
+private:
+    static const int TILE = 64; //Tiles are TILE x TILE px
+    
+    struct Cell
+    {
+        SDL_Rect area; //The cell on the screen
+        int cols; //Size of the board, 0 before the game is known
+        int rows;
+        int scale; //px per block
+        int left; //The board is centered in the cell
+        int top;
+        vector<Uint8> blocks; //The board with the falling object in it
+        bool dirty;
+    };
+    
+    const Uint32* sprites(int scale); //The pixels of all block types at the given size, type 0 is empty
+    void draw(const Cell&, const Uint32* sprite, int x0, int y0, int x1, int y1);
+    
+    vector<Cell> cells_;
+    vector< vector<Uint32> > sprites_; //By scale, made when first needed
+    vector<int> dirty_; //Cells to draw this frame
+    vector<int> tiles_; //Tiles that touch them
+    vector<SDL_Rect> updated_;
+    Uint32 black_; //Around the boards
+    TilePool pool_;
+};
+
+GridCompositor::GridCompositor(int boards, int threads)
+: cells_(boards), black_(SDL_MapRGB(screen->format, 0, 0, 0)), pool_(threads)
+{
+    //As many columns as it takes for the cells to get closest to the shape of a board
+    int columns = 1;
+    double best = 1e9;
+    for (int c = 1; c <= boards; ++c)
+    {
+        const int r = (boards + c - 1)/c;
+        const double shape = (screen->w/double(c)) / (screen->h/double(r));
+        const double mismatch = fabs(log(shape / (BOARD_WIDTH/double(BOARD_HEIGHT))));
+        if (mismatch < best)
+        {
+            best = mismatch;
+            columns = c;
+        }
+    }
+    const int rows = (boards + columns - 1)/columns;
+    
+    for (int i = 0; i < boards; ++i)
+    {
+        Cell& cell = cells_[i];
+        cell.area.x = (i % columns)*screen->w/columns;
+        cell.area.y = (i / columns)*screen->h/rows;
+        cell.area.w = ((i % columns) + 1)*screen->w/columns - cell.area.x;
+        cell.area.h = ((i / columns) + 1)*screen->h/rows - cell.area.y;
+        cell.cols = 0;
+        cell.rows = 0;
+        cell.scale = 0;
+        cell.left = cell.area.x;
+        cell.top = cell.area.y;
+        cell.dirty = true; //Every cell is cleared in the first frame
+    }
+}
+
+const Uint32* GridCompositor::sprites(int scale)
+{
+    if (sprites_.size() <= static_cast<size_t>(scale))
+        sprites_.resize(scale + 1);
+    vector<Uint32>& pixels = sprites_[scale];
+    if (!pixels.empty())
+        return &pixels[0];
+    
+    //Every block is boxed down from its BLOCK_SIZE sprite, empty blocks are dark grey
+    pixels.assign(8*scale*scale, SDL_MapRGB(screen->format, 24, 24, 24));
+    for (int type = 1; type <= 7; ++type)
+    {
+        SDL_Surface* block = block_surface(type);
+        SDL_LockSurface(block);
+        for (int y = 0; y < scale; ++y)
+        {
+            for (int x = 0; x < scale; ++x)
+            {
+                int sum[3] = { 0, 0, 0 };
+                int count = 0;
+                for (int by = y*block->h/scale; by < (y+1)*block->h/scale; ++by)
+                {
+                    for (int bx = x*block->w/scale; bx < (x+1)*block->w/scale; ++bx)
+                    {
+                        const Uint32 pixel = *reinterpret_cast<Uint32*>(static_cast<Uint8*>(block->pixels) + by*block->pitch + bx*4);
+                        Uint8 r, g, b, a;
+                        SDL_GetRGBA(pixel, block->format, &r, &g, &b, &a);
+                        sum[0] += r;
+                        sum[1] += g;
+                        sum[2] += b;
+                        ++count;
+                    }
+                }
+                count = max(count, 1);
+                pixels[(type*scale + y)*scale + x] = SDL_MapRGB(screen->format, sum[0]/count, sum[1]/count, sum[2]/count);
+            }
+        }
+        SDL_UnlockSurface(block);
+    }
+    return &pixels[0];
+}
+
+void GridCompositor::update(int board, const SpectatorState& state)
+{
+    Cell& cell = cells_[board];
+    
+    if (state.cols != cell.cols || state.rows != cell.rows)
+    {
+        cell.cols = state.cols;
+        cell.rows = state.rows;
+        cell.scale = max(min(cell.area.w/state.cols, cell.area.h/state.rows), 1);
+        cell.left = cell.area.x + (cell.area.w - state.cols*cell.scale)/2;
+        cell.top = cell.area.y + (cell.area.h - state.rows*cell.scale)/2;
+        cell.blocks.clear();
+        cell.dirty = true;
+    }
+    
+    //The board as it is shown, with the falling object in it
+    vector<Uint8> blocks = state.cells;
+    if (state.current != 0)
+    {
+        //The games of the grid can use different piece sets
+        const Object current = rotated_object(state.current, state.rotation, state.x, state.y, *piece_sets[state.pieces]);
+        for (int i = 0; i < 5; ++i)
+        {
+            for (int j = 0; j < 5; ++j)
+            {
+                const int x = state.x + i;
+                const int y = state.y + j;
+                if (current.matrix_[i][j] != 0 && x >= 0 && x < state.cols && y >= 0 && y < state.rows)
+                    blocks[y*state.cols + x] = current.matrix_[i][j];
+            }
+        }
+    }
+    
+    if (blocks != cell.blocks)
+    {
+        cell.blocks.swap(blocks);
+        cell.dirty = true;
+    }
+}
+
+void GridCompositor::draw(const Cell& cell, const Uint32* sprite, int x0, int y0, int x1, int y1)
+{
+    const Uint32 black = black_;
+    const int width = cell.cols*cell.scale;
+    const int height = cell.rows*cell.scale;
+    
+    for (int y = y0; y < y1; ++y)
+    {
+        Uint32* out = reinterpret_cast<Uint32*>(static_cast<Uint8*>(screen->pixels) + y*screen->pitch);
+        const int by = y - cell.top;
+        if (by < 0 || by >= height || cell.blocks.empty())
+        {
+            fill(out + x0, out + x1, black);
+            continue;
+        }
+        
+        //One run of sprite pixels per block on the row
+        const Uint8* blocks = &cell.blocks[(by/cell.scale)*cell.cols];
+        const int sprite_row = (by % cell.scale)*cell.scale;
+        int x = x0;
+        for (; x < x1 && x < cell.left; ++x)
+            out[x] = black;
+        while (x < x1 && x < cell.left + width)
+        {
+            const int bx = x - cell.left;
+            const int run = min(cell.scale - bx % cell.scale, min(x1, cell.left + width) - x);
+            const Uint32* pixels = sprite + (blocks[bx/cell.scale]*cell.scale)*cell.scale + sprite_row + bx % cell.scale;
+            memcpy(out + x, pixels, run*sizeof(Uint32));
+            x += run;
+        }
+        for (; x < x1; ++x)
+            out[x] = black;
+    }
+}
+
+int GridCompositor::compose()
+{
+    dirty_.clear();
+    tiles_.clear();
+    updated_.clear();
+    
+    for (size_t i = 0; i < cells_.size(); ++i)
+    {
+        if (cells_[i].dirty)
+        {
+            dirty_.push_back(i);
+            updated_.push_back(cells_[i].area);
+            sprites(max(cells_[i].scale, 1)); //Made here, the threads only read them
+        }
+    }
+    if (dirty_.empty())
+        return 0;
+    
+    //The tiles that any changed cell touches
+    const int columns = (screen->w + TILE - 1)/TILE;
+    const int rows = (screen->h + TILE - 1)/TILE;
+    for (int tile = 0; tile < columns*rows; ++tile)
+    {
+        const int x = (tile % columns)*TILE;
+        const int y = (tile / columns)*TILE;
+        for (size_t i = 0; i < dirty_.size(); ++i)
+        {
+            const SDL_Rect& area = cells_[dirty_[i]].area;
+            if (area.x < x + TILE && x < area.x + area.w && area.y < y + TILE && y < area.y + area.h)
+            {
+                tiles_.push_back(tile);
+                break;
+            }
+        }
+    }
+    
+    if (SDL_MUSTLOCK(screen))
+        SDL_LockSurface(screen);
+    
+    auto draw_tile = [&](int index)
+    {
+        const int x = (tiles_[index] % columns)*TILE;
+        const int y = (tiles_[index] / columns)*TILE;
+        for (size_t i = 0; i < dirty_.size(); ++i)
+        {
+            const Cell& cell = cells_[dirty_[i]];
+            const int x0 = max<int>(x, cell.area.x);
+            const int y0 = max<int>(y, cell.area.y);
+            const int x1 = min(min(x + TILE, static_cast<int>(screen->w)), cell.area.x + cell.area.w);
+            const int y1 = min(min(y + TILE, static_cast<int>(screen->h)), cell.area.y + cell.area.h);
+            if (x0 < x1 && y0 < y1)
+                draw(cell, &sprites_[max(cell.scale, 1)][0], x0, y0, x1, y1);
+        }
+    };
+    pool_.run(tiles_.size(), draw_tile);
+    
+    if (SDL_MUSTLOCK(screen))
+        SDL_UnlockSurface(screen);
+    
+    SDL_UpdateRects(screen, updated_.size(), &updated_[0]);
+    for (size_t i = 0; i < dirty_.size(); ++i)
+        cells_[dirty_[i]].dirty = false;
+    return dirty_.size();
+}
+
+//Shows many spectator streams at once in a grid, at a fixed frame rate, until Escape is pressed
+void watch_grid(const vector<string>& sources, int fps, int threads, bool& quit)
+{
+    if (screen == NULL || screen->format->BytesPerPixel != 4)
+    {
+        fprintf(stderr, "The spectator grid draws straight into a 32-bit screen\n");
+        return;
+    }
+    
+    vector<pollfd> inputs;
+    vector<bool> sockets;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        const int fd = open_spectator_source(sources[i]);
+        if (fd < 0)
+            fprintf(stderr, "Can't watch %s\n", sources[i].c_str());
+        pollfd input = { fd, POLLIN, 0 }; //A negative fd is skipped by poll
+        inputs.push_back(input);
+        sockets.push_back(sources[i].compare(0, 5, "unix:") == 0);
+    }
+    
+    Scene scene(PLAY);
+    GridCompositor grid(sources.size(), threads);
+    vector<SpectatorDecoder> decoders(sources.size());
+    vector< vector<Uint8> > buffers(sources.size(), vector<Uint8>(1 << 16));
+    vector<size_t> buffered(sources.size(), 0);
+    
+    const Uint64 frame = 1000000/max(fps, 1);
+    Uint64 next_frame = precise_ticks();
+    bool leave_state = false;
+    
+    while (!leave_state)
+    {
+        while (SDL_PollEvent(&event))
+        {
+            if (event.type == SDL_QUIT)
+            {
+                leave_state = true;
+                quit = true;
+            }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)
+                leave_state = true;
+        }
+        
+        //Read whatever arrives until the next frame is due
+        const Uint64 now = precise_ticks();
+        if (now < next_frame)
+        {
+            if (poll(&inputs[0], inputs.size(), static_cast<int>((next_frame - now)/1000)) <= 0)
+                continue;
+            
+            bool received = false;
+            for (size_t i = 0; i < inputs.size(); ++i)
+            {
+                if (inputs[i].fd < 0 || inputs[i].revents == 0)
+                    continue;
+                
+                vector<Uint8>& buffer = buffers[i];
+                if (buffered[i] == buffer.size())
+                    buffer.resize(buffer.size()*2);
+                const ssize_t count = read(inputs[i].fd, &buffer[buffered[i]], buffer.size() - buffered[i]);
+                if (count <= 0)
+                {
+                    if (sockets[i])
+                    {
+                        close(inputs[i].fd); //The game has ended, its last state stays on the screen
+                        inputs[i].fd = -1;
+                    }
+                    continue;
+                }
+                buffered[i] += count;
+                received = true;
+                
+                bool changed = false;
+                const size_t used = decoders[i].decode(&buffer[0], buffered[i], changed);
+                memmove(&buffer[0], &buffer[used], buffered[i] - used);
+                buffered[i] -= used;
+                if (changed)
+                    grid.update(i, decoders[i].get_state());
+            }
+            
+            //A file at its end is always readable, so wait for the frame instead of asking again
+            if (!received)
+                SDL_Delay(static_cast<Uint32>((next_frame - now)/1000));
+            continue;
+        }
+        
+        grid.compose();
+        next_frame += frame;
+        if (next_frame < now)
+            next_frame = now + frame; //Don't try to catch up on frames that were missed
+    }
+    
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        if (inputs[i].fd >= 0)
+            close(inputs[i].fd);
+    }
+}
+
+//Batched environment for training agents: steps many independent games in one call and writes what
+//the agents see into the callers buffers, without allocating. Every game follows the rules of run_game
+//and draws its objects from its own seed. A game that is over starts again right away.
+//
+//Actions are either placements, (hold*4 + rotation)*COLUMNS + column, which turn the object at the
+//spawn position, move it towards xPos column-3 and drop it, or single keys, one per step, with the
+//object falling one row every gravity_steps steps.
+//
+//The observation of a game is PLANE floats of taken blocks, PLANE floats of the falling object,
+//then one-hots of the current (7), next (7) and held (8, the first one for nothing held) object.
+//The reward is what increase_score added during the step.
+enum EnvKey
+{
+    ENV_NONE, ENV_LEFT, ENV_RIGHT, ENV_DOWN, ENV_ROTATE_LEFT, ENV_ROTATE_RIGHT, ENV_DROP, ENV_HOLD, ENV_KEYS
+};
+
+template<typename BoardType>
+class GameEnv
+{
+public:
+    static const int PLANE = BoardType::rows*BoardType::width;
+    static const int OBSERVATION = 2*PLANE + 7 + 7 + 8;
+    static const int COLUMNS = BoardType::width + 4;
+    static const int PLACEMENTS = 2*4*COLUMNS;
+    
+    GameEnv(int games, const Uint32* seeds, bool key_actions, int gravity_steps, int threads);
+    
+    int get_games() const { return slots_.size(); }
+    int get_actions() const { return key_actions_ ? ENV_KEYS : PLACEMENTS; }
+    
+    void reset(float* observations); //Starts every game over from its seed
+    //Steps every game with its action. Any of the buffers may be NULL.
+    void step(const int* actions, float* observations, float* rewards, Uint8* dones);
+    
+    struct Slot
+    {
+        Slot()
+        : current(1), next(2), saved_object(1), saved_object_exist(false), objects(1), seed(0), start_seed(0), steps(0) {}
+        
+        BoardType board;
+        Object current;
+        Object next;
+        Object saved_object;
+        bool saved_object_exist;
+        int objects; //Counts towards the next level, like in run_game
+        Uint32 seed; //Where the object sequence is
+        Uint32 start_seed;
+        int steps; //Steps of the current object, for the gravity
+    };
+    
+    //The whole state of every game, saved and restored by plain copies for rollback
+    const Slot& get_slot(int game) const { return slots_[game]; }
+    void save(Slot* slots) const { copy(slots_.begin(), slots_.end(), slots); }
+    void restore(const Slot* slots) { copy(slots, slots + slots_.size(), slots_.begin()); }
+    
+private:
+    void start(Slot&);
+    int new_type(Slot&, int previous);
+    bool lock(Slot&); //Stores the object and brings in the next, returns false if the game is over
+    void hold(Slot&);
+    bool move(Slot&, int dx, int dy); //Returns false if the object couldn't move
+    void turn(Slot&, bool right);
+    bool place(Slot&, int action);
+    bool press(Slot&, int key);
+    void observe(const Slot&, float* observation) const;
+    
+    vector<Slot> slots_;
+    bool key_actions_;
+    int gravity_steps_;
+    TilePool pool_;
+};
+
+template<typename BoardType>
+GameEnv<BoardType>::GameEnv(int games, const Uint32* seeds, bool key_actions, int gravity_steps, int threads)
+: slots_(games), key_actions_(key_actions), gravity_steps_(max(gravity_steps, 1)), pool_(threads)
+{
+    for (int i = 0; i < games; ++i)
+    {
+        slots_[i].start_seed = seeds != NULL ? seeds[i] : i + 1;
+        slots_[i].seed = slots_[i].start_seed;
+        start(slots_[i]);
+    }
+}
+
+template<typename BoardType>
+int GameEnv<BoardType>::new_type(Slot& slot, int previous)
+{
+    //Like get_new_random, never the same type twice in a row
+    return draw_type(slot.seed, previous);
+}
+
+template<typename BoardType>
+void GameEnv<BoardType>::start(Slot& slot)
+{
+    //The seed goes on from the last game, so every game of a slot is new but the slot can be replayed
+    slot.board.init_boardMatrix();
+    slot.board.reset_score_level();
+    slot.current = Object(new_type(slot, 0), BoardType::spawn_x);
+    slot.next = Object(new_type(slot, slot.current.get_type()), BoardType::spawn_x);
+    slot.saved_object_exist = false;
+    slot.objects = 1;
+    slot.steps = 0;
+}
+
+template<typename BoardType>
+void GameEnv<BoardType>::reset(float* observations)
+{
+    for (size_t i = 0; i < slots_.size(); ++i)
+    {
+        slots_[i].seed = slots_[i].start_seed;
+        start(slots_[i]);
+        if (observations != NULL)
+            observe(slots_[i], observations + i*OBSERVATION);
+    }
+}
+
+template<typename BoardType>
+bool GameEnv<BoardType>::lock(Slot& slot)
+{
+    slot.board.store_object(slot.current);
+    slot.board.clear_row(slot.current);
+    
+    if (++slot.objects == 20)
+    {
+        slot.objects = 0;
+        slot.board.increase_level();
+    }
+    
+    slot.current = slot.next;
+    slot.next = Object(new_type(slot, slot.next.get_type()), BoardType::spawn_x);
+    slot.steps = 0;
+    return !slot.board.isGameover(slot.current);
+}
+
+template<typename BoardType>
+void GameEnv<BoardType>::hold(Slot& slot)
+{
+    //The same exchange as LSHIFT in run_game
+    if (slot.current.isExchanged())
+        return;
+    
+    Object temp = slot.saved_object;
+    if (!slot.saved_object_exist)
+    {
+        slot.saved_object = slot.current;
+        slot.current = slot.next;
+        slot.next = Object(new_type(slot, slot.next.get_type()), BoardType::spawn_x);
+        slot.saved_object_exist = true;
+    }
+    else
+    {
+        slot.saved_object = slot.current;
+        temp.spawn(BoardType::spawn_x);
+        slot.current = temp;
+    }
+    slot.current.set_exchanged();
+    slot.steps = 0;
+}
+
+template<typename BoardType>
+bool GameEnv<BoardType>::move(Slot& slot, int dx, int dy)
+{
+    slot.current.set_xPos(slot.current.get_xPos() + dx);
+    slot.current.set_yPos(slot.current.get_yPos() + dy);
+    if (slot.board.isMovementPossible(slot.current))
+        return true;
+    slot.current.set_xPos(slot.current.get_xPos() - dx);
+    slot.current.set_yPos(slot.current.get_yPos() - dy);
+    return false;
+}
+
+template<typename BoardType>
+void GameEnv<BoardType>::turn(Slot& slot, bool right)
+{
+    if (right)
+        slot.current.rotate_right();
+    else
+        slot.current.rotate_left();
+    
+    if (!slot.board.isMovementPossible(slot.current))
+    {
+        if (right)
+            slot.current.rotate_left();
+        else
+            slot.current.rotate_right();
+    }
+}
+
+template<typename BoardType>
+bool GameEnv<BoardType>::place(Slot& slot, int action)
+{
+    action = min(max(action, 0), PLACEMENTS - 1);
+    const int column = action % COLUMNS;
+    const int rotation = (action / COLUMNS) % 4;
+    
+    if (action / (4*COLUMNS) != 0)
+        hold(slot);
+    
+    for (int r = 0; r < rotation; ++r)
+        turn(slot, true);
+    
+    const int target = column - 3;
+    while (slot.current.get_xPos() != target && move(slot, target < slot.current.get_xPos() ? -1 : 1, 0))
+    {
+    }
+    while (move(slot, 0, 1))
+    {
+    }
+    return lock(slot);
+}
+
+template<typename BoardType>
+bool GameEnv<BoardType>::press(Slot& slot, int key)
+{
+    switch (key)
+    {
+        case ENV_LEFT: move(slot, -1, 0); break;
+        case ENV_RIGHT: move(slot, 1, 0); break;
+        case ENV_DOWN: move(slot, 0, 1); break;
+        case ENV_ROTATE_LEFT: turn(slot, false); break;
+        case ENV_ROTATE_RIGHT: turn(slot, true); break;
+        case ENV_HOLD: hold(slot); break;
+        case ENV_DROP:
+            while (move(slot, 0, 1))
+            {
+            }
+            return lock(slot);
+        default: break;
+    }
+    
+    //Gravity
+    if (++slot.steps % gravity_steps_ == 0 && !move(slot, 0, 1))
+        return lock(slot);
+    return true;
+}
+
+template<typename BoardType>
+void GameEnv<BoardType>::observe(const Slot& slot, float* observation) const
+{
+    fill(observation, observation + OBSERVATION, 0.0f);
+    
+    for (int y = 0; y < BoardType::rows; ++y)
+    {
+        for (int x = 0; x < BoardType::width; ++x)
+            observation[y*BoardType::width + x] = slot.board.get_cell(x, y) != 0 ? 1.0f : 0.0f;
+    }
+    
+    float* falling = observation + PLANE;
+    for (int i = 0; i < 5; ++i)
+    {
+        for (int j = 0; j < 5; ++j)
+        {
+            const int x = slot.current.get_xPos() + i;
+            const int y = slot.current.get_yPos() + j;
+            if (slot.current.matrix_[i][j] != 0 && x >= 0 && x < BoardType::width && y >= 0 && y < BoardType::rows)
+                falling[y*BoardType::width + x] = 1.0f;
+        }
+    }
+    
+    float* pieces = observation + 2*PLANE;
+    pieces[slot.current.get_type() - 1] = 1.0f;
+    pieces[7 + slot.next.get_type() - 1] = 1.0f;
+    pieces[14 + (slot.saved_object_exist ? slot.saved_object.get_type() : 0)] = 1.0f;
+}
+
+template<typename BoardType>
+void GameEnv<BoardType>::step(const int* actions, float* observations, float* rewards, Uint8* dones)
+{
+    auto step_game = [&](int i)
+    {
+        Slot& slot = slots_[i];
+        const int score = slot.board.get_score();
+        const bool alive = key_actions_ ? press(slot, actions[i]) : place(slot, actions[i]);
+        
+        if (rewards != NULL)
+            rewards[i] = static_cast<float>(slot.board.get_score() - score);
+        if (dones != NULL)
+            dones[i] = !alive;
+        if (!alive)
+            start(slot);
+        if (observations != NULL)
+            observe(slot, observations + i*OBSERVATION);
+    };
+    pool_.run(slots_.size(), step_game);
+}
+
+//C bindings for the standard board, for use from other languages when built with TETRIS_LIBRARY
+typedef GameEnv<Board> TetrisEnv;
+
+extern "C"
+{
+
+//seeds may be NULL, key_actions chooses keys over placements, threads 1 steps on the calling thread only
+void* tetris_env_create(int games, const unsigned* seeds, int key_actions, int gravity_steps, int threads)
+{
+    static_assert(sizeof(unsigned) == sizeof(Uint32), "Seeds are passed as 32-bit integers");
+    return new TetrisEnv(games, reinterpret_cast<const Uint32*>(seeds), key_actions != 0, gravity_steps, threads);
+}
+
+void tetris_env_destroy(void* env)
+{
+    delete static_cast<TetrisEnv*>(env);
+}
+
+int tetris_env_observation_size()
+{
+    return TetrisEnv::OBSERVATION;
+}
+
+int tetris_env_action_count(void* env)
+{
+    return static_cast<TetrisEnv*>(env)->get_actions();
+}
+
+void tetris_env_reset(void* env, float* observations)
+{
+    static_cast<TetrisEnv*>(env)->reset(observations);
+}
+
+void tetris_env_step(void* env, const int* actions, float* observations, float* rewards, unsigned char* dones)
+{
+    static_cast<TetrisEnv*>(env)->step(actions, observations, rewards, dones);
+}
+
+}
+
+//Steps a batch of games with random placements for a few seconds and prints the steps per second
+int run_env_benchmark(int games, int threads)
+{
+    vector<Uint32> seeds(games);
+    for (int i = 0; i < games; ++i)
+        seeds[i] = i + 1;
+    
+    TetrisEnv env(games, &seeds[0], false, 1, threads);
+    vector<float> observations(games*TetrisEnv::OBSERVATION);
+    vector<float> rewards(games);
+    vector<Uint8> dones(games);
+    vector<int> actions(games);
+    env.reset(&observations[0]);
+    
+    Uint32 random = 1;
+    Uint64 steps = 0;
+    Uint64 finished = 0;
+    double score = 0;
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    double seconds = 0;
+    while (seconds < 3)
+    {
+        for (int i = 0; i < games; ++i)
+        {
+            random = random * 1103515245 + 12345;
+            actions[i] = (random >> 16) % TetrisEnv::PLACEMENTS;
+        }
+        env.step(&actions[0], &observations[0], &rewards[0], &dones[0]);
+        steps += games;
+        for (int i = 0; i < games; ++i)
+        {
+            finished += dones[i];
+            score += rewards[i];
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    
+    printf("%d games, %d threads: %llu steps in %.2f s, %.0f steps/s, %llu games finished, %.1f points per step\n",
+           games, threads, static_cast<unsigned long long>(steps), seconds, steps/seconds,
+           static_cast<unsigned long long>(finished), score/steps);
+    return 0;
+}
+
+//Where a versus game connects to, and the delay and loss to add to the sent packets for
+//trying rollback over loopback, set on the command line
+struct NetplaySettings
+{
+    NetplaySettings()
+    : local_port(0), remote_port(0), remote_host("127.0.0.1"), delay(0), loss(0), seed(1) {}
+    
+    int local_port; //0 when there is no versus game
+    int remote_port;
+    string remote_host;
+    Uint32 delay; //ms
+    int loss; //Percent of the packets
+    Uint32 seed; //Both sides must use the same, it picks the objects of both games
+};
+
+NetplaySettings netplay_settings;
+
+//The keys of a run of frames from one side of a versus game, and how many frames of the
+//receivers keys the sender has
+struct NetplayPacket
+{
+    static const int MAX_KEYS = 32;
+    static const int SIZE = 9 + MAX_KEYS; //Bytes on the wire, at most
+    
+    Uint32 first_frame; //Frame of keys[0]
+    Uint32 frames_received; //The sender has the receivers keys of all frames before this one
+    Uint8 count;
+    Uint8 keys[MAX_KEYS];
+};
+
+//UDP connection of a versus game. The packets can be held back and dropped on purpose, to play
+//over loopback as if over a real network.
+class NetplayLink
+{
+public:
+    NetplayLink(const NetplaySettings& settings)
+    : settings_(settings), socket_(-1), head_(0), tail_(0), random_(settings.local_port) {}
+    ~NetplayLink();
+    
+    bool open();
+    void send(const NetplayPacket&);
+    bool receive(NetplayPacket&); //Returns false when no packet is waiting
+    void flush(); //Sends the held back packets that are due
+    
+private:
+    static const unsigned HELD = 256; //Packets that can be held back, more are dropped
+    
+    void send_now(const Uint8* data, int size);
+    
+    struct HeldPacket
+    {
+        Uint64 due; //precise_ticks
+        Uint8 size;
+        Uint8 data[NetplayPacket::SIZE];
+    };
+    
+    const NetplaySettings& settings_;
+    int socket_;
+    sockaddr_in remote_;
+    HeldPacket held_[HELD];
+    unsigned head_; //Packets held and sent so far, they wrap around together
+    unsigned tail_;
+    Uint32 random_;
+};
+
+NetplayLink::~NetplayLink()
+{
+    if (socket_ >= 0)
+        close(socket_);
+}
+
+bool NetplayLink::open()
+{
+    memset(&remote_, 0, sizeof(remote_));
+    remote_.sin_family = AF_INET;
+    remote_.sin_port = htons(settings_.remote_port);
+    if (inet_pton(AF_INET, settings_.remote_host.c_str(), &remote_.sin_addr) != 1)
+        return false;
+    
+    sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(settings_.local_port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    
+    socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+    return socket_ >= 0 && bind(socket_, (sockaddr*)&local, sizeof(local)) == 0 &&
+           fcntl(socket_, F_SETFL, fcntl(socket_, F_GETFL) | O_NONBLOCK) == 0;
+}
+
+void NetplayLink::send(const NetplayPacket& packet)
+{
+    random_ = random_ * 1103515245 + 12345;
+    if (static_cast<int>((random_ >> 16) % 100) < settings_.loss)
+        return;
+    
+    //Little endian on the wire, whatever the machines are
+    Uint8 data[NetplayPacket::SIZE];
+    const int count = min(static_cast<int>(packet.count), static_cast<int>(NetplayPacket::MAX_KEYS));
+    for (int i = 0; i < 4; ++i)
+    {
+        data[i] = (packet.first_frame >> (8*i)) & 0xFF;
+        data[4 + i] = (packet.frames_received >> (8*i)) & 0xFF;
+    }
+    data[8] = count;
+    memcpy(data + 9, packet.keys, count);
+    
+    if (settings_.delay == 0)
+    {
+        send_now(data, 9 + count);
+        return;
+    }
+    if (tail_ - head_ == HELD)
+        return;
+    HeldPacket& held = held_[tail_ % HELD];
+    held.due = precise_ticks() + settings_.delay*Uint64(1000);
+    held.size = 9 + count;
+    memcpy(held.data, data, held.size);
+    ++tail_;
+}
+
+void NetplayLink::flush()
+{
+    const Uint64 now = precise_ticks();
+    for (; head_ != tail_ && held_[head_ % HELD].due <= now; ++head_)
+        send_now(held_[head_ % HELD].data, held_[head_ % HELD].size);
+}
+
+void NetplayLink::send_now(const Uint8* data, int size)
+{
+    //A full socket buffer loses the packet, like the network would
+    sendto(socket_, data, size, 0, (sockaddr*)&remote_, sizeof(remote_));
+}
+
+bool NetplayLink::receive(NetplayPacket& packet)
+{
+    Uint8 data[NetplayPacket::SIZE];
+    for (;;)
+    {
+        const ssize_t size = recv(socket_, data, sizeof(data), 0);
+        if (size < 0)
+            return false;
+        if (size < 9 || data[8] > NetplayPacket::MAX_KEYS || size != 9 + data[8])
+            continue;
+        
+        packet.first_frame = packet.frames_received = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            packet.first_frame |= Uint32(data[i]) << (8*i);
+            packet.frames_received |= Uint32(data[4 + i]) << (8*i);
+        }
+        packet.count = data[8];
+        memcpy(packet.keys, data + 9, packet.count);
+        return true;
+    }
+}
+
+//A versus game with GGPO style rollback. The local keys of a frame are applied at once, the keys of
+//the other side are predicted to be no key until they arrive. When an arrived key turns out to be a
+//real one, the games go back to the state before its frame and the frames up to now are simulated
+//again, all within the frame it arrived in. The games are GameEnv slots, which are plain data, so a
+//state is saved and restored by copying some hundred bytes per player.
+class VersusMatch
+{
+public:
+    static const Uint32 HISTORY = 32; //Frames of states and keys kept
+    static const Uint32 MAX_PREDICTION = 12; //Frames the game may run ahead of the other side
+    static const int GRAVITY_FRAMES = 48; //Frames per fall, 800 ms like the first level
+    
+    VersusMatch(Uint32 seed);
+    
+    bool can_advance() const { return frame_ < remote_frames_ + MAX_PREDICTION && result() == 0; }
+    void advance(int local_key); //Simulates the next frame
+    void receive(const NetplayPacket&); //Keys of the other side, rolls back if they need it
+    void fill_packet(NetplayPacket&) const; //The local keys the other side doesn't have yet
+    
+    int result() const; //0 while playing, 1 won, -1 lost, 2 both topped out in the same frame
+    const TetrisEnv::Slot& get_game(int player) const { return (player == 0 ? local_ : remote_).get_slot(0); } //The local player is 0
+    
+    Uint32 get_frame() const { return frame_; }
+    Uint64 get_rollbacks() const { return rollbacks_; }
+    Uint64 get_resimulated() const { return resimulated_; }
+    Uint64 get_rollback_time() const { return rollback_time_; } //µs spent restoring and simulating again
+    
+private:
+    struct Snapshot
+    {
+        TetrisEnv::Slot games[2];
+        Sint32 lost[2];
+    };
+    
+    void simulate(Uint32 frame);
+    TetrisEnv& game(int player) { return (player == 0) ? local_ : remote_; }
+    
+    TetrisEnv local_; //One game per environment, so a finished one can stand still
+    TetrisEnv remote_;
+    Snapshot history_[HISTORY]; //The state before each frame
+    Uint8 keys_[2][HISTORY];
+    Sint32 lost_[2]; //Frame the player topped out in, -1 while playing
+    Uint32 frame_; //Frames simulated
+    Uint32 remote_frames_; //Frames the keys of the other side are known for, from the first on
+    Uint32 frames_received_; //Frames of the local keys the other side has
+    Uint64 rollbacks_;
+    Uint64 resimulated_;
+    Uint64 rollback_time_;
+};
+
+VersusMatch::VersusMatch(Uint32 seed)
+: local_(1, &seed, true, GRAVITY_FRAMES, 1), remote_(1, &seed, true, GRAVITY_FRAMES, 1),
+  frame_(0), remote_frames_(0), frames_received_(0), rollbacks_(0), resimulated_(0), rollback_time_(0)
+{
+    static_assert(is_trivially_copyable<TetrisEnv::Slot>::value, "Rollback copies the games as plain data");
+    lost_[0] = lost_[1] = -1;
+}
+
+void VersusMatch::simulate(Uint32 frame)
+{
+    Snapshot& saved = history_[frame % HISTORY];
+    for (int player = 0; player < 2; ++player)
     {
-        x = object.get_xPos();
-        x_ = BOARD_WIDTH;
+        game(player).save(&saved.games[player]);
+        saved.lost[player] = lost_[player];
+    }
+    
+    for (int player = 0; player < 2; ++player)
+    {
+        if (lost_[player] >= 0)
+            continue;
+        const int key = (player == 0 || frame < remote_frames_) ? keys_[player][frame % HISTORY] : static_cast<int>(ENV_NONE);
+        Uint8 done = 0;
+        game(player).step(&key, NULL, NULL, &done);
+        if (done)
+        {
+            //The game stands still as it was before the object that didn't fit
+            game(player).restore(&saved.games[player]);
+            lost_[player] = frame;
+        }
+    }
+}
+
+void VersusMatch::advance(int local_key)
+{
+    keys_[0][frame_ % HISTORY] = local_key;
+    simulate(frame_);
+    ++frame_;
+}
+
+void VersusMatch::receive(const NetplayPacket& packet)
+{
+    frames_received_ = max(frames_received_, min(packet.frames_received, frame_));
+    
+    //Only keys that follow the known ones are taken, the next packet resends the missing ones
+    if (packet.first_frame > remote_frames_)
+        return;
+    
+    Uint32 rollback = frame_;
+    const Uint32 end = min(packet.first_frame + packet.count, frame_ + MAX_PREDICTION);
+    for (Uint32 frame = remote_frames_; frame < end; ++frame)
+    {
+        const Uint8 key = packet.keys[frame - packet.first_frame];
+        keys_[1][frame % HISTORY] = key;
+        if (frame < frame_ && key != ENV_NONE && rollback == frame_)
+            rollback = frame;
+    }
+    remote_frames_ = max(remote_frames_, end);
+    
+    if (rollback < frame_)
+    {
+        const Uint64 start = precise_ticks();
+        const Snapshot& saved = history_[rollback % HISTORY];
+        for (int player = 0; player < 2; ++player)
+        {
+            game(player).restore(&saved.games[player]);
+            lost_[player] = saved.lost[player];
+        }
+        for (Uint32 frame = rollback; frame < frame_; ++frame)
+            simulate(frame);
+        
+        ++rollbacks_;
+        resimulated_ += frame_ - rollback;
+        rollback_time_ += precise_ticks() - start;
+    }
+}
+
+void VersusMatch::fill_packet(NetplayPacket& packet) const
+{
+    packet.first_frame = frames_received_;
+    packet.frames_received = remote_frames_;
+    packet.count = min(frame_ - frames_received_, Uint32(NetplayPacket::MAX_KEYS));
+    for (int i = 0; i < packet.count; ++i)
+        packet.keys[i] = keys_[0][(frames_received_ + i) % HISTORY];
+}
+
+int VersusMatch::result() const
+{
+    //A top out is only final once the keys of both sides are known up to its frame
+    const Sint32 known = min(frame_, remote_frames_);
+    const bool lost = lost_[0] >= 0 && lost_[0] < known;
+    const bool won = lost_[1] >= 0 && lost_[1] < known;
+    if (lost && won)
+        return (lost_[0] == lost_[1]) ? 2 : (lost_[0] < lost_[1] ? -1 : 1);
+    if (lost)
+        return -1;
+    if (won)
+        return 1;
+    return 0;
+}
+
+//Keys of the versus game, like in run_game
+int versus_key(SDLKey sym)
+{
+    switch (sym)
+    {
+        case SDLK_LEFT: return ENV_LEFT;
+        case SDLK_RIGHT: return ENV_RIGHT;
+        case SDLK_DOWN: return ENV_DOWN;
+        case SDLK_UP: case SDLK_z: return ENV_ROTATE_LEFT;
+        case SDLK_x: return ENV_ROTATE_RIGHT;
+        case SDLK_SPACE: return ENV_DROP;
+        case SDLK_LSHIFT: return ENV_HOLD;
+        default: return ENV_NONE;
+    }
+}
+
+//Plays a versus game against the other side of the netplay settings at 60 frames per second, the
+//local game to the left. Escape leaves, also after the game is decided.
+void play_versus(bool& quit)
+{
+    const Uint64 FRAME = 1000000/60; //µs
+    
+    NetplayLink link(netplay_settings);
+    if (!link.open())
+    {
+        fprintf(stderr, "Can't play versus on port %d\n", netplay_settings.local_port);
+        return;
+    }
+    
+    Scene scene(PLAY);
+    VersusMatch match(netplay_settings.seed);
+    SpscQueue<Uint8, 64> pressed; //Local keys, one is applied per frame. Room for a burst while the other side is waited for
+    Uint64 dropped_keys = 0; //Pressed while it was full
+    NetplayPacket packet;
+    SpectatorState shown[2];
+    Object predicted_position(1);
+    Tetris tetris;
+    tetris.apply_surface(0, 0, background);
+    renderer->present();
+    
+    bool leave_state = false;
+    int shown_result = 0;
+    Uint64 next_frame = precise_ticks();
+    while (!leave_state)
+    {
+        while (SDL_PollEvent(&event))
+        {
+            if (event.type == SDL_QUIT)
+            {
+                leave_state = true;
+                quit = true;
+            }
+            if (event.type == SDL_KEYDOWN)
+            {
+                if (event.key.keysym.sym == SDLK_ESCAPE)
+                    leave_state = true;
+                else if (versus_key(event.key.keysym.sym) != ENV_NONE && !pressed.push(versus_key(event.key.keysym.sym)))
+                    ++dropped_keys;
+            }
+        }
+        
+        while (link.receive(packet))
+            match.receive(packet);
+        link.flush();
+        
+        const Uint64 now = precise_ticks();
+        if (now < next_frame)
+        {
+            SDL_Delay(1);
+            continue;
+        }
+        //After a long stall the frames start over from now instead of catching up
+        next_frame = (now - next_frame > 10*FRAME) ? now + FRAME : next_frame + FRAME;
+        
+        //Waiting for the other side keeps the keys for later
+        if (match.can_advance())
+        {
+            Uint8 key = ENV_NONE;
+            pressed.pop(key);
+            match.advance(key);
+        }
+        match.fill_packet(packet);
+        link.send(packet);
+        
+        for (int player = 0; player < 2; ++player)
+        {
+            const TetrisEnv::Slot& game = match.get_game(player);
+            Object current = game.current;
+            Board& board = const_cast<Board&>(game.board);
+            update_predicted_position(predicted_position, current, board);
+            capture_state(game.board, game.current, predicted_position, game.next,
+                          game.saved_object_exist ? &game.saved_object : NULL, shown[player]);
+            draw_board_state(shown[player], (player == 0) ? 60 : 380);
+        }
+        
+        if (match.result() != shown_result)
+        {
+            shown_result = match.result();
+            const char* text = (shown_result == 1) ? "You win" : (shown_result == -1) ? "You lose" : "Draw";
+            SDL_Surface* message = TTF_RenderText_Solid(font, text, textColor);
+            if (message != NULL)
+                tetris.apply_text((SCREEN_WIDTH - layout.to_layout(message->w))/2, 445, text, message);
+            SDL_FreeSurface(message);
+        }
+        renderer->present();
+    }
+    
+    fprintf(stderr, "Versus: %u frames, %llu rollbacks, %llu frames simulated again in %llu us, %llu keys dropped by a full queue\n",
+            match.get_frame(), static_cast<unsigned long long>(match.get_rollbacks()), static_cast<unsigned long long>(match.get_resimulated()),
+            static_cast<unsigned long long>(match.get_rollback_time()), static_cast<unsigned long long>(dropped_keys));
+}
+
+//One saved score in the leaderboard file, linked into its tree by entry numbers
+struct LeaderboardEntry
+{
+    char name[24];
+    Sint32 score;
+    Uint32 left; //Subtree of the entries ranked above this one
+    Uint32 right; //And below it
+    Uint32 size; //Entries in the subtree of this one
+};
+
+struct LeaderboardHeader
+{
+    char magic[8];
+    Uint32 count; //Entries in the file
+    Uint32 capacity; //Entries the file has room for
+    Uint32 root;
+    Uint32 dirty; //Set on the disk while the file is open, so that a crash leaves a tree to rebuild rather than a broken one
+};
+
+//Every score ever saved, in a memory mapped file. The entries are ordered by a treap that knows the
+//size of every subtree: a higher score ranks above a lower one, and of two equal scores the one that
+//was saved first. Saving a score and finding the rank of any score take O(log n), a page of k entries
+//from any rank takes O(log n + k), so the highscore screen opens as fast with millions of entries as
+//with ten. Nothing is read or parsed when the file is opened, only the pages of the tree that are
+//used are brought in.
+//The kernel writes changed pages back in any order, so the dirty mark is on the disk for as long as the
+//file is open and only taken off after everything else is there. A writer thread flushes the file after
+//every saved score, so the game never waits for the disk.
+class Leaderboard
+{
+public:
+    static const Uint32 NO_ENTRY = 0xFFFFFFFF;
+    
+    Leaderboard()
+    : file_(-1), header_(NULL), entries_(NULL), mapped_(0), saved_(0), flushed_(0), running_(false) {}
+    ~Leaderboard(); //Flushes what is left and marks the file clean
+    
+    bool open(const string& path);
+    Uint32 size() const { return (header_ != NULL) ? header_->count : 0; }
+    Uint32 insert(const char* name, int score); //Returns the rank of the new entry, 0 if it couldn't be saved
+    Uint32 rank_of(int score) const; //The rank a score saved now would get
+    
+    //Calls f(rank, entry) for count entries from first_rank on, best first
+    template<typename F>
+    void visit(Uint32 first_rank, Uint32 count, F& f) const;
+    
+private:
+    static const Uint32 FIRST_CAPACITY = 1024;
+    
+    bool map(Uint32 capacity);
+    void flush_loop(); //Runs on its own thread
+    static Uint32 priority(Uint32 entry);
+    bool ranks_above(Uint32 a, Uint32 b) const;
+    Uint32 size_of(Uint32 entry) const { return (entry != NO_ENTRY) ? entries_[entry].size : 0; }
+    void update_size(Uint32 entry);
+    Uint32 link(Uint32 root, Uint32 entry, Uint32& above); //Returns the new root of the subtree
+    void rebuild();
+    
+    template<typename F>
+    void visit_below(Uint32 root, Uint32 offset, Uint32 first_rank, Uint32 last_rank, F& f) const;
+    
+    int file_;
+    LeaderboardHeader* header_;
+    LeaderboardEntry* entries_;
+    size_t mapped_;
+    mutex mapping_; //Held by the writer while it flushes, and by map() while it moves the mapping
+    atomic<Uint32> saved_; //Scores saved, and the ones of them that are flushed
+    Uint32 flushed_;
+    atomic<bool> running_;
+    thread writer_;
+};
+
+Leaderboard::~Leaderboard()
+{
+    if (writer_.joinable())
+    {
+        running_ = false;
+        writer_.join();
+    }
+    if (header_ != NULL)
+    {
+        //Everything else is on the disk before the dirty mark comes off
+        msync(header_, mapped_, MS_SYNC);
+        header_->dirty = 0;
+        msync(header_, sizeof(LeaderboardHeader), MS_SYNC);
+        munmap(header_, mapped_);
+    }
+    if (file_ >= 0)
+        close(file_);
+}
+
+bool Leaderboard::open(const string& path)
+{
+    file_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat info;
+    if (file_ < 0 || fstat(file_, &info) != 0)
+        return false;
+    
+    if (info.st_size == 0)
+    {
+        if (!map(FIRST_CAPACITY))
+            return false;
+        memcpy(header_->magic, "TETRISLB", 8);
+        header_->count = 0;
+        header_->capacity = FIRST_CAPACITY;
+        header_->root = NO_ENTRY;
     }
     else
     {
-        x = object.get_xPos();
-        x_ = x+5;
+        LeaderboardHeader header;
+        if (pread(file_, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, "TETRISLB", 8) != 0 ||
+            header.count > header.capacity || info.st_size < off_t(sizeof(header) + header.capacity*sizeof(LeaderboardEntry)))
+        {
+            fprintf(stderr, "%s is not a leaderboard\n", path.c_str());
+            return false;
+        }
+        if (!map(header.capacity))
+            return false;
+        if (header_->dirty != 0)
+            rebuild();
+    }
+    
+    //The tree is only trusted again once the file is closed cleanly
+    header_->dirty = 1;
+    if (msync(header_, mapped_, MS_SYNC) != 0)
+        return false;
+    
+    running_ = true;
+    writer_ = thread(&Leaderboard::flush_loop, this);
+    return true;
+}
+
+void Leaderboard::flush_loop()
+{
+    for (;;)
+    {
+        //Stop only when every saved score is on the disk
+        const bool stopping = !running_;
+        const Uint32 saved = saved_.load();
+        if (saved != flushed_)
+        {
+            lock_guard<mutex> lock(mapping_);
+            msync(header_, mapped_, MS_SYNC);
+            flushed_ = saved;
+        }
+        else if (stopping)
+            break;
+        else
+            this_thread::sleep_for(chrono::milliseconds(20));
+    }
+}
+
+bool Leaderboard::map(Uint32 capacity)
+{
+    const size_t length = sizeof(LeaderboardHeader) + size_t(capacity)*sizeof(LeaderboardEntry);
+    struct stat info;
+    if (fstat(file_, &info) != 0 || (info.st_size < off_t(length) && ftruncate(file_, length) != 0))
+        return false;
+    
+    void* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, file_, 0);
+    if (mapping == MAP_FAILED)
+        return false;
+    lock_guard<mutex> lock(mapping_);
+    if (header_ != NULL)
+        munmap(header_, mapped_);
+    header_ = static_cast<LeaderboardHeader*>(mapping);
+    entries_ = reinterpret_cast<LeaderboardEntry*>(header_ + 1);
+    mapped_ = length;
+    return true;
+}
+
+Uint32 Leaderboard::priority(Uint32 entry)
+{
+    //The treap priorities are hashed from the entry numbers, so they need no room in the file
+    Uint32 x = entry * 0x9E3779B1u;
+    x ^= x >> 16;
+    x *= 0x85EBCA6Bu;
+    x ^= x >> 13;
+    return x;
+}
+
+bool Leaderboard::ranks_above(Uint32 a, Uint32 b) const
+{
+    return entries_[a].score > entries_[b].score || (entries_[a].score == entries_[b].score && a < b);
+}
+
+void Leaderboard::update_size(Uint32 entry)
+{
+    entries_[entry].size = size_of(entries_[entry].left) + size_of(entries_[entry].right) + 1;
+}
+
+Uint32 Leaderboard::link(Uint32 root, Uint32 entry, Uint32& above)
+{
+    if (root == NO_ENTRY)
+        return entry;
+    
+    LeaderboardEntry& node = entries_[root];
+    if (ranks_above(entry, root))
+    {
+        node.left = link(node.left, entry, above);
+        update_size(root);
+        //Rotates the child with the higher priority up
+        const Uint32 child = node.left;
+        if (priority(child) <= priority(root))
+            return root;
+        node.left = entries_[child].right;
+        entries_[child].right = root;
+        update_size(root);
+        update_size(child);
+        return child;
     }
+    
+    above += size_of(node.left) + 1;
+    node.right = link(node.right, entry, above);
+    update_size(root);
+    const Uint32 child = node.right;
+    if (priority(child) <= priority(root))
+        return root;
+    node.right = entries_[child].left;
+    entries_[child].left = root;
+    update_size(root);
+    update_size(child);
+    return child;
+}
+
+Uint32 Leaderboard::insert(const char* name, int score)
+{
+    if (header_ == NULL || (header_->count == header_->capacity && !map(header_->capacity*2)))
+        return 0;
+    if (header_->count == header_->capacity)
+        header_->capacity *= 2;
+    
+    //The dirty mark is on the disk, a crash before the writer has flushed this leaves a tree to rebuild
+    const Uint32 entry = header_->count;
+    LeaderboardEntry& added = entries_[entry];
+    memset(&added, 0, sizeof(added));
+    strncpy(added.name, name, sizeof(added.name) -1);
+    added.score = score;
+    added.left = added.right = NO_ENTRY;
+    added.size = 1;
+    
+    header_->count = entry + 1;
+    Uint32 above = 0;
+    header_->root = link(header_->root, entry, above);
+    
+    ++saved_;
+    return above + 1;
+}
 
-    if (object.get_yPos() > (BOARD_HEIGHT -5)) // If our 5x5 object is outside the bottom boarder of the gameboard
+void Leaderboard::rebuild()
+{
+    //The count can reach the disk before the entry it counts, an entry that never got there is all zeros
+    Uint32 count = 0;
+    for (Uint32 entry = 0; entry < header_->count; ++entry)
     {
-        y = object.get_yPos();
-        y_ = BOARD_HEIGHT;
+        if (entries_[entry].size != 0)
+            entries_[count++] = entries_[entry];
     }
-    else
+    header_->count = count;
+    
+    header_->root = NO_ENTRY;
+    for (Uint32 entry = 0; entry < header_->count; ++entry)
     {
-        y = object.get_yPos();
-        y_ = y+5;
+        entries_[entry].left = entries_[entry].right = NO_ENTRY;
+        entries_[entry].size = 1;
+        Uint32 above = 0;
+        header_->root = link(header_->root, entry, above);
     }
-    
-    for (int i = x; i < x_; ++i)
+}
+
+Uint32 Leaderboard::rank_of(int score) const
+{
+    //Equal scores that are already saved stay above
+    Uint32 above = 0;
+    Uint32 node = (header_ != NULL) ? header_->root : NO_ENTRY;
+    while (node != NO_ENTRY)
     {
-        for (int j = y; j < y_; ++j)
+        if (entries_[node].score >= score)
         {
-            if ((boardMatrix[i][j] != 0 // If two blocks have collided
-                 && object.matrix_[i-object.get_xPos()][j-object.get_yPos()] != 0))
-                return false;
+            above += size_of(entries_[node].left) + 1;
+            node = entries_[node].right;
         }
+        else
+            node = entries_[node].left;
     }
+    return above + 1;
+}
 
-    return true;
+template<typename F>
+void Leaderboard::visit(Uint32 first_rank, Uint32 count, F& f) const
+{
+    if (header_ != NULL && count > 0)
+        visit_below(header_->root, 0, max(first_rank, 1u), max(first_rank, 1u) + count - 1, f);
+}
+
+template<typename F>
+void Leaderboard::visit_below(Uint32 root, Uint32 offset, Uint32 first_rank, Uint32 last_rank, F& f) const
+{
+    //offset is the number of entries ranked above the subtree, only the subtrees that hold wanted ranks are entered
+    if (root == NO_ENTRY)
+        return;
+    const LeaderboardEntry& node = entries_[root];
+    const Uint32 rank = offset + size_of(node.left) + 1;
+    if (first_rank < rank)
+        visit_below(node.left, offset, first_rank, last_rank, f);
+    if (first_rank <= rank && rank <= last_rank)
+        f(rank, node);
+    if (rank < last_rank)
+        visit_below(node.right, rank, first_rank, last_rank, f);
+}
+
+//Board positions harvested from recorded games, for opening books and for finding the positions that
+//games tend to go wrong from. A position is the standard boards taken blocks, packed six rows of ten
+//bits to a word from the bottom up, the bottom row in the high bits of rows[0]. That way boards with the
+//same bottom rows sort next to each other, and "the bottom k rows look like this" is one range of the
+//sorted index. Every position is kept once, found again by its hash, and with POSITIONS_MIRRORED a
+//position and its mirror image are kept as one.
+const int POSITION_ROWS = 24;
+const int POSITION_COLUMNS = 10;
+const int POSITION_HEIGHTS = POSITION_ROWS*POSITION_COLUMNS + 1; //Sums of the column heights, 0-240
+const Uint32 POSITIONS_MIRRORED = 1;
+
+static_assert(Board::width == POSITION_COLUMNS && Board::rows == POSITION_ROWS, "Positions are standard boards");
+
+struct PositionEntry
+{
+    Uint64 rows[4];
+    Uint32 seen; //Games that got here
+    Uint32 best_score; //Of those games
+    Uint64 score_sum;
+    Uint64 pieces_left_sum; //Objects those games placed after this position
+};
+
+struct PositionHeader
+{
+    char magic[8];
+    Uint32 flags;
+    Uint32 count; //Entries in the file
+    Uint32 capacity; //Entries the file has room for
+    Uint32 indexed; //Entries in the sorted indices, the ones after them are searched one by one
+    Uint32 height_start[POSITION_HEIGHTS + 1]; //Where every height sum starts in by_height
+};
+
+//Sets the bit of a block in a packed position, row 0 is the bottom one
+void set_position_block(Uint64* rows, int row, int x)
+{
+    rows[row/6] |= Uint64(1) << (54 - 10*(row % 6) + x);
 }
 
-void Board::store_object(Object& current)
+bool position_block(const Uint64* rows, int row, int x)
 {
-    for (int x = current.get_xPos(); x<current.get_xPos()+5; ++x)
+    return (rows[row/6] >> (54 - 10*(row % 6) + x)) & 1;
+}
+
+void mirror_position(const Uint64* rows, Uint64* mirrored)
+{
+    memset(mirrored, 0, 4*sizeof(Uint64));
+    for (int row = 0; row < POSITION_ROWS; ++row)
     {
-        for (int y = current.get_yPos(); y<current.get_yPos()+5; ++y)
+        for (int x = 0; x < POSITION_COLUMNS; ++x)
         {
-            if (current.matrix_[x-current.get_xPos()][y-current.get_yPos()] != 0)
-                boardMatrix[x][y] = current.matrix_[x-current.get_xPos()][y-current.get_yPos()];
+            if (position_block(rows, row, x))
+                set_position_block(mirrored, row, POSITION_COLUMNS - 1 - x);
         }
     }
 }
 
-void Board::clear_row(Object& current)
+bool position_less(const Uint64* a, const Uint64* b)
 {
-    int rows_cleared = 0;
-    
-    for (int y=current.get_yPos(); y<(current.get_yPos()+5); ++y) // Loop through possible rows in y-direction to clear
+    return lexicographical_compare(a, a + 4, b, b + 4);
+}
+
+//Column heights of a packed position, returns their sum
+int position_heights(const Uint64* rows, int* heights)
+{
+    int sum = 0;
+    for (int x = 0; x < POSITION_COLUMNS; ++x)
     {
-        for (int x=0; x<BOARD_WIDTH; ++x) // Loop through the whole row in x-direction
+        heights[x] = 0;
+        for (int row = POSITION_ROWS - 1; row >= 0 && heights[x] == 0; --row)
         {
-            if (boardMatrix[x][y] == 0)
-                break;
-            if (x == 9) // If we looped through and the row was empty on blocks
-            {
-                drop_blocks(y); // Move down all the overlying blocks
-                ++rows_cleared;
-            }
+            if (position_block(rows, row, x))
+                heights[x] = row + 1;
         }
+        sum += heights[x];
     }
+    return sum;
+}
+
+//Memory mapped file: the header, the entries, the hash table of entry numbers plus one, 0 for a free
+//slot, then the entry numbers sorted by their rows and sorted by their height sums. The file grows by
+//doubling, which rehashes the entries and leaves the indices to be built again.
+class PositionDatabase
+{
+public:
+    static const Uint32 NO_ENTRY = 0xFFFFFFFF;
     
-    increase_score(rows_cleared);
+    PositionDatabase()
+    : file_(-1), header_(NULL), entries_(NULL), slots_(NULL), by_rows_(NULL), by_height_(NULL), mapped_(0) {}
+    ~PositionDatabase();
+    
+    bool open(const string& path, bool mirrored); //mirrored only counts for a new file
+    Uint32 size() const { return header_->count; }
+    bool is_mirrored() const { return (header_->flags & POSITIONS_MIRRORED) != 0; }
+    const PositionEntry& get(Uint32 entry) const { return entries_[entry]; }
+    
+    void canonical(const Board&, Uint64* rows) const; //Packs a board the way it is kept
+    Uint32 add(const Uint64* rows); //Returns the entry of a packed position, NO_ENTRY if the file can't grow
+    void record_game(const vector<Uint32>& entries, Uint32 score); //The positions one game went through, in order
+    void build_index();
+    
+    //Calls f(entry) for every position whose bottom rows are pattern, pattern[0] is the bottom row
+    template<typename F>
+    void match(const vector<Uint16>& pattern, F& f) const;
+    //The count positions with the column heights closest to heights, closest first, as (distance, entry)
+    void closest(const int* heights, int count, vector<pair<int, Uint32> >& found) const;
+    
+private:
+    static const Uint32 FIRST_CAPACITY = 1 << 16;
+    
+    bool map(Uint32 capacity);
+    static Uint64 hash(const Uint64* rows);
+    Uint32 find_slot(const Uint64* rows) const; //The slot of the rows, or the free one where they go
+    int distance(const int* heights, Uint32 entry) const;
+    template<typename F>
+    void match_range(const Uint64* low, const Uint64* high, F& f) const;
+    
+    int file_;
+    PositionHeader* header_;
+    PositionEntry* entries_;
+    Uint32* slots_; //2*capacity of them
+    Uint32* by_rows_;
+    Uint32* by_height_;
+    size_t mapped_;
+};
+
+PositionDatabase::~PositionDatabase()
+{
+    if (header_ != NULL)
+        munmap(header_, mapped_);
+    if (file_ >= 0)
+        close(file_);
 }
 
-void Board::drop_blocks(int& y_init)
+bool PositionDatabase::open(const string& path, bool mirrored)
 {
-    for (int y = y_init; y>0; --y) // Move all stored blocks from the top to y_init, in y-direction, down one step
+    file_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat info;
+    if (file_ < 0 || fstat(file_, &info) != 0)
+        return false;
+    
+    if (info.st_size == 0)
     {
-        for (int x=0; x<BOARD_WIDTH; ++x)
-        {
-            boardMatrix[x][y] = boardMatrix[x][y-1];
-        }
+        if (!map(FIRST_CAPACITY))
+            return false;
+        memcpy(header_->magic, "TETRISPD", 8);
+        header_->flags = mirrored ? POSITIONS_MIRRORED : 0;
+        header_->count = 0;
+        header_->capacity = FIRST_CAPACITY;
+        header_->indexed = 0;
+        return true;
+    }
+    
+    PositionHeader header;
+    if (pread(file_, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, "TETRISPD", 8) != 0 ||
+        header.count > header.capacity || header.indexed > header.count)
+    {
+        fprintf(stderr, "%s is not a position database\n", path.c_str());
+        return false;
     }
+    return map(header.capacity);
 }
 
-bool Board::isGameover(Object& current)
+bool PositionDatabase::map(Uint32 capacity)
 {
-    if (!isMovementPossible(current))
-        return true;
-    return false;
+    const size_t length = sizeof(PositionHeader) + size_t(capacity)*(sizeof(PositionEntry) + 4*sizeof(Uint32));
+    struct stat info;
+    if (fstat(file_, &info) != 0 || (info.st_size < off_t(length) && ftruncate(file_, length) != 0))
+        return false;
+    
+    void* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, file_, 0);
+    if (mapping == MAP_FAILED)
+        return false;
+    if (header_ != NULL)
+        munmap(header_, mapped_);
+    header_ = static_cast<PositionHeader*>(mapping);
+    entries_ = reinterpret_cast<PositionEntry*>(header_ + 1);
+    slots_ = reinterpret_cast<Uint32*>(entries_ + capacity);
+    by_rows_ = slots_ + 2*size_t(capacity);
+    by_height_ = by_rows_ + capacity;
+    mapped_ = length;
+    return true;
 }
 
-void Board::increase_score(int& rows)
+Uint64 PositionDatabase::hash(const Uint64* rows)
 {
-    if (rows == 1)
-        score_ += 100;
-    else if(rows == 2)
-        score_ += 250;
-    else if (rows == 3)
-        score_ += 400;
-    else if (rows == 4)
-        score_ += 550;
+    Uint64 h = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < 4; ++i)
+    {
+        h = (h ^ rows[i]) * 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 31;
+    }
+    return h;
 }
 
-void Board::print_score_level()
+Uint32 PositionDatabase::find_slot(const Uint64* rows) const
 {
-    stringstream ss;
-    stringstream ss2; //Vet ej varför det inte går att återanvända ss ??
-    char score[10];
-    char level[3];
-
-    ss << score_;
-    ss >> score;
-    ss2 << level_;
-    ss2 >> level;
-    
-    score_message = TTF_RenderText_Solid(font, score, textColor);
-    level_message = TTF_RenderText_Solid(font, level, textColor);
-    
-    apply_board(440, 222, 200, 258, background);
-    apply_surface(440, 222, score_message);
-    apply_surface(440, 325, level_message);
+    const Uint64 mask = 2*Uint64(header_->capacity) - 1;
+    for (Uint64 slot = hash(rows) & mask; ; slot = (slot + 1) & mask)
+    {
+        const Uint32 entry = slots_[slot];
+        if (entry == 0 || memcmp(entries_[entry - 1].rows, rows, sizeof(entries_[0].rows)) == 0)
+            return slot;
+    }
 }
 
-
-bool init()
+void PositionDatabase::canonical(const Board& board, Uint64* rows) const
 {
-    //Initialize all SDL subsystems
-    if( SDL_Init(SDL_INIT_EVERYTHING) == -1 )
+    memset(rows, 0, 4*sizeof(Uint64));
+    for (int row = 0; row < POSITION_ROWS; ++row)
     {
-        return false;
+        for (int x = 0; x < POSITION_COLUMNS; ++x)
+        {
+            if (board.get_cell(x, Board::rows - 1 - row) != 0)
+                set_position_block(rows, row, x);
+        }
     }
     
-    //Set up the screen
-    screen = SDL_SetVideoMode( SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_BPP, SDL_SWSURFACE );
-    
-    //If there was an error in setting up the screen
-    if( screen == NULL )
+    if (is_mirrored())
     {
-        return false;
+        Uint64 mirrored[4];
+        mirror_position(rows, mirrored);
+        if (position_less(mirrored, rows))
+            memcpy(rows, mirrored, sizeof(mirrored));
     }
+}
+
+Uint32 PositionDatabase::add(const Uint64* rows)
+{
+    Uint32 slot = find_slot(rows);
+    if (slots_[slot] != 0)
+        return slots_[slot] - 1;
     
-    if (TTF_Init() == -1)
+    if (header_->count == header_->capacity)
     {
-        return false;
+        //Twice the room, and every entry hashed again into the new table
+        const Uint32 capacity = header_->capacity;
+        if (capacity >= 0x80000000u || !map(2*capacity))
+            return NO_ENTRY;
+        header_->capacity = 2*capacity;
+        header_->indexed = 0; //The indices moved with the table, build_index makes them again
+        memset(header_->height_start, 0, sizeof(header_->height_start));
+        memset(slots_, 0, 2*size_t(header_->capacity)*sizeof(Uint32));
+        for (Uint32 entry = 0; entry < header_->count; ++entry)
+            slots_[find_slot(entries_[entry].rows)] = entry + 1;
+        slot = find_slot(rows);
     }
     
-    //Set the window caption
-    SDL_WM_SetCaption( "Tetris", NULL );
-    
-    //If everything initialized fine
-    return true;
+    const Uint32 entry = header_->count++;
+    PositionEntry& added = entries_[entry];
+    memcpy(added.rows, rows, sizeof(added.rows));
+    added.seen = 0;
+    added.best_score = 0;
+    added.score_sum = 0;
+    added.pieces_left_sum = 0;
+    slots_[slot] = entry + 1;
+    return entry;
 }
 
-bool load_files()
+void PositionDatabase::record_game(const vector<Uint32>& entries, Uint32 score)
 {
-    //Load the images
-    
-    blockI = load_image("Images/Blocks/I_Blue.png");
-    blockJ = load_image("Images/Blocks/J_Pink.png");
-    blockL = load_image("Images/Blocks/L_Bronze.png");
-    blockO = load_image("Images/Blocks/O_Red.png");
-    blockS = load_image("Images/Blocks/S_Yellow.png");
-    blockT = load_image("Images/Blocks/T_Orange.png");
-    blockZ = load_image("Images/Blocks/Z_Green.png");
-    edge = load_image("Images/Blocks/Edge.png");
-    background = load_image("Images/Background.png" );
-    background_menu = load_image("Images/Menu.png" );
-    background_hs = load_image("Images/Highscore_bg.png" );
-    transparent = load_image("Images/Transparent_Enter.png");
-    
-    play_button = load_image("Images/Buttons/Play.png");
-    play_marked = load_image("Images/Buttons/Play2.png");
-    highscore_button = load_image("Images/Buttons/Highscore.png");
-    highscore_marked = load_image("Images/Buttons/Highscore2.png");
-    quit_button = load_image("Images/Buttons/Quit.png");
-    quit_marked = load_image("Images/Buttons/Quit2.png");
-    
-    font = TTF_OpenFont("DrawingPad.ttf", 28 );
+    //A game that comes back to a position, like the empty board after a perfect clear, counts once there,
+    //with the objects it placed after it first got there
+    vector<pair<Uint32, Uint32> > visits(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i)
+        visits[i] = make_pair(entries[i], static_cast<Uint32>(i));
+    sort(visits.begin(), visits.end());
     
+    for (size_t i = 0; i < visits.size(); ++i)
+    {
+        if (i > 0 && visits[i].first == visits[i-1].first)
+            continue;
+        PositionEntry& entry = entries_[visits[i].first];
+        ++entry.seen;
+        entry.best_score = max(entry.best_score, score);
+        entry.score_sum += score;
+        entry.pieces_left_sum += entries.size() - 1 - visits[i].second;
+    }
+}
+
+void PositionDatabase::build_index()
+{
+    const Uint32 count = header_->count;
+    for (Uint32 entry = 0; entry < count; ++entry)
+        by_rows_[entry] = entry;
+    sort(by_rows_, by_rows_ + count, [this](Uint32 a, Uint32 b) { return position_less(entries_[a].rows, entries_[b].rows); });
     
-    //If there was an error in loading the image
-    if( background == NULL || blockI == NULL || blockJ == NULL || blockL == NULL || blockO == NULL || blockS == NULL || blockT == NULL || blockZ == NULL || font == NULL)
+    //Counted by height sum, then placed, so the entries of every sum are together
+    Uint32* start = header_->height_start;
+    memset(start, 0, sizeof(header_->height_start));
+    vector<Uint8> sums(count);
+    for (Uint32 entry = 0; entry < count; ++entry)
     {
-        return false;
+        int heights[POSITION_COLUMNS];
+        sums[entry] = position_heights(entries_[entry].rows, heights);
+        ++start[sums[entry] + 1];
     }
+    for (int sum = 0; sum < POSITION_HEIGHTS; ++sum)
+        start[sum + 1] += start[sum];
+    vector<Uint32> placed(start, start + POSITION_HEIGHTS);
+    for (Uint32 entry = 0; entry < count; ++entry)
+        by_height_[placed[sums[entry]]++] = entry;
     
-    //If everything loaded fine
-    return true;
+    header_->indexed = count;
 }
 
-void clean_up()
+template<typename F>
+void PositionDatabase::match_range(const Uint64* low, const Uint64* high, F& f) const
 {
-    //Free the images
-    SDL_FreeSurface(background);
-    SDL_FreeSurface(blockI);
-    SDL_FreeSurface(blockJ);
-    SDL_FreeSurface(blockL);
-    SDL_FreeSurface(blockO);
-    SDL_FreeSurface(blockS);
-    SDL_FreeSurface(blockT);
-    SDL_FreeSurface(blockZ);
-    SDL_FreeSurface(edge);
-    SDL_FreeSurface(score_message);
-    SDL_FreeSurface(level_message);
-    SDL_FreeSurface(play_button);
-    SDL_FreeSurface(play_marked);
-    SDL_FreeSurface(highscore_button);
-    SDL_FreeSurface(highscore_marked);
-    SDL_FreeSurface(quit_button);
-    SDL_FreeSurface(quit_marked);
-    SDL_FreeSurface(background_hs);
-    SDL_FreeSurface(background_menu);
-    SDL_FreeSurface(transparent);
-    //SDL_FreeSurface(highscore_candidate);
+    const Uint32* first = lower_bound(by_rows_, by_rows_ + header_->indexed, low,
+                                      [this](Uint32 entry, const Uint64* rows) { return position_less(entries_[entry].rows, rows); });
+    for (const Uint32* it = first; it != by_rows_ + header_->indexed && !position_less(high, entries_[*it].rows); ++it)
+        f(*it);
     
-    //Quit SDL
-    SDL_Quit();
+    for (Uint32 entry = header_->indexed; entry < header_->count; ++entry)
+    {
+        const Uint64* rows = entries_[entry].rows;
+        if (!position_less(rows, low) && !position_less(high, rows))
+            f(entry);
+    }
 }
 
-int get_new_random(Object& current)
+template<typename F>
+void PositionDatabase::match(const vector<Uint16>& pattern, F& f) const
 {
-    int next_type = (SDL_GetTicks() % 7) +1;
+    //The positions with the pattern as their bottom rows lie between the pattern with nothing above it
+    //and the pattern with every bit above it set
+    const int k = min(static_cast<int>(pattern.size()), POSITION_ROWS);
+    Uint64 low[4] = { 0, 0, 0, 0 };
+    for (int row = 0; row < k; ++row)
+    {
+        for (int x = 0; x < POSITION_COLUMNS; ++x)
+        {
+            if (pattern[row] & (1 << x))
+                set_position_block(low, row, x);
+        }
+    }
+    Uint64 high[4];
+    memcpy(high, low, sizeof(low));
+    for (int word = 0; word < 4; ++word)
+    {
+        const int rows_in = max(0, min(6, k - 6*word)); //Pattern rows in this word, in its high bits
+        high[word] |= (rows_in == 6) ? 0 : (~Uint64(0) >> (10*rows_in));
+    }
+    match_range(low, high, f);
     
-    while(next_type == current.get_type())
+    //In a mirrored database the position may have been kept as its mirror image
+    if (is_mirrored())
     {
-        next_type = (SDL_GetTicks() % 7) +1;
+        Uint64 mirrored_low[4];
+        Uint64 mirrored_high[4];
+        mirror_position(low, mirrored_low);
+        if (memcmp(mirrored_low, low, sizeof(low)) == 0)
+            return;
+        memcpy(mirrored_high, mirrored_low, sizeof(mirrored_low));
+        for (int word = 0; word < 4; ++word)
+            mirrored_high[word] |= high[word] & ~low[word];
+        match_range(mirrored_low, mirrored_high, f);
     }
-
-    return next_type;
 }
 
-void update_predicted_position(Object& predicted_position, Object& current, Board& board)
+int PositionDatabase::distance(const int* heights, Uint32 entry) const
 {
-    predicted_position = current;
-    while (board.isMovementPossible(predicted_position))
+    int other[POSITION_COLUMNS];
+    position_heights(entries_[entry].rows, other);
+    int direct = 0;
+    int mirrored = 0;
+    for (int x = 0; x < POSITION_COLUMNS; ++x)
     {
-        predicted_position.set_yPos(predicted_position.get_yPos() +1);
+        direct += abs(heights[x] - other[x]);
+        mirrored += abs(heights[x] - other[POSITION_COLUMNS - 1 - x]);
     }
-    predicted_position.set_yPos(predicted_position.get_yPos() -1);
+    return is_mirrored() ? min(direct, mirrored) : direct;
 }
 
-void view_menu(bool& quit, string& state)
+void PositionDatabase::closest(const int* heights, int count, vector<pair<int, Uint32> >& found) const
 {
-    Tetris tetris;
-    tetris.apply_surface(0, 0, background_menu);
-    SDL_Flip(screen);
-    Uint8 menu_state = 0;
+    found.clear();
+    if (count <= 0)
+        return;
+    int sum = 0;
+    for (int x = 0; x < POSITION_COLUMNS; ++x)
+        sum += heights[x];
     
-    bool leave_state = false;
+    //Keeps the count closest so far as a max heap, the farthest of them on top
+    auto offer = [&](Uint32 entry)
+    {
+        const pair<int, Uint32> candidate(distance(heights, entry), entry);
+        if (static_cast<int>(found.size()) < count)
+        {
+            found.push_back(candidate);
+            push_heap(found.begin(), found.end());
+        }
+        else if (candidate < found.front())
+        {
+            pop_heap(found.begin(), found.end());
+            found.back() = candidate;
+            push_heap(found.begin(), found.end());
+        }
+    };
     
-    while(!leave_state)
+    for (Uint32 entry = header_->indexed; entry < header_->count; ++entry)
+        offer(entry);
+    
+    //Two positions are at least as far apart as their height sums, so the sums are searched outwards
+    //from the one asked for until they are farther than the farthest position kept
+    const Uint32* start = header_->height_start;
+    for (int step = 0; step < POSITION_HEIGHTS && header_->indexed > 0; ++step)
     {
-        while(SDL_PollEvent(&event))
+        if (static_cast<int>(found.size()) == count && step > found.front().first)
+            break;
+        const int sums[2] = { sum - step, sum + step };
+        for (int i = 0; i < (step == 0 ? 1 : 2); ++i)
         {
-            
-            if (menu_state == 0)
-            {
-                tetris.apply_surface(0, 0, background_menu);
-                tetris.apply_surface(205, 150, play_marked);
-                tetris.apply_surface(205, 150+64, highscore_button);
-                tetris.apply_surface(205, 150+(64*2), quit_button);
-                SDL_Flip(screen);
-            }
-            else if (menu_state == 1)
-            {
-                tetris.apply_surface(0, 0, background_menu);
-                tetris.apply_surface(205, 150, play_button);
-                tetris.apply_surface(205, 150+64, highscore_marked);
-                tetris.apply_surface(205, 150+(64*2), quit_button);
-                SDL_Flip(screen);
-            }
-            else if (menu_state == 2)
-            {
-                tetris.apply_surface(0, 0, background_menu);
-                tetris.apply_surface(205, 150, play_button);
-                tetris.apply_surface(205, 150+64, highscore_button);
-                tetris.apply_surface(205, 150+(64*2), quit_marked);
-                SDL_Flip(screen);
-            }
-            
-            //If the user has Xed out the window
-            if( event.type == SDL_QUIT )
-            {
-                leave_state = true;
-                //Quit the program
-                quit = true;
-            }
-            
-            if (event.type == SDL_KEYDOWN)
-            {
-                if (event.key.keysym.sym == SDLK_DOWN && menu_state < 2)
-                    ++menu_state;
-                
-                if (event.key.keysym.sym == SDLK_UP && menu_state > 0)
-                    --menu_state;
-                
-                if (event.key.keysym.sym == SDLK_RETURN)
-                {
-                    if (menu_state == 0)
-                    {
-                        leave_state = true;
-                        state = "PLAY";
-                    }
-                    else if (menu_state == 1)
-                    {
-                        leave_state = true;
-                        state = "HIGHSCORE";
-                    }
-                    else if (menu_state == 2)
-                    {
-                        leave_state = true;
-                        quit = true;
-                    }
-                }
-            }
-            
+            if (sums[i] < 0 || sums[i] >= POSITION_HEIGHTS)
+                continue;
+            for (Uint32 at = start[sums[i]]; at < start[sums[i] + 1]; ++at)
+                offer(by_height_[at]);
         }
-        
     }
+    sort_heap(found.begin(), found.end());
+}
 
+//Reads one column of an analytics chunk, count values into the field of every record
+template<typename T, typename Record>
+void read_column(istream& file, Record* records, Uint32 count, T Record::* field)
+{
+    for (Uint32 i = 0; i < count; ++i)
+        file.read(reinterpret_cast<char*>(&(records[i].*field)), sizeof(T));
 }
 
-int run_game(bool& quit, string& state)
+//The same for a column an older version kept in a smaller type
+template<typename Stored, typename T, typename Record>
+void read_column_as(istream& file, Record* records, Uint32 count, T Record::* field)
 {
-    bool leave_state = false;
-    //Bool to check if there is a saved object
-    bool saved_object_exist = false;
-    
-    Tetris tetris; //Create main-class
-    Object current(get_new_random(current)); //Create our current Tetris-object
-    Object next = current; //Create next Tetris-object
-    if (next.get_type() < 7)
+    for (Uint32 i = 0; i < count; ++i)
     {
-        Object temp(get_new_random(temp) +1);
-        next = temp;
+        Stored value = 0;
+        file.read(reinterpret_cast<char*>(&value), sizeof(value));
+        records[i].*field = value;
     }
-    else
+}
+
+//Replays the games of an analytics file on the standard board and adds every position they went through,
+//with how the game ended. Only sessions of standard games with the standard pieces are used, version 1
+//sessions don't say what they played and are left out too. Games without an end, or that don't fit the
+//standard board, are left out, so a game's positions are kept packed until its end comes in.
+bool harvest_positions(const string& path, PositionDatabase& database, Uint64& games, Uint64& positions)
+{
+    ifstream file(path.c_str(), ios::binary);
+    if (!file)
     {
-        Object temp(get_new_random(temp) -1);
-        next = temp;
+        fprintf(stderr, "Can't open the analytics file %s\n", path.c_str());
+        return false;
     }
     
-    Object saved_object(get_new_random(current));
-    Object predicted_position(current.get_type());
-    Board board; //Create the gameboard
-    
-    //For level increasement
-    int speed = 800;
-    int objects = 1; //Counts
-
-    //Apply the background to the screen
-    tetris.apply_surface( 0, 0, background );
-    
-    //Update the screen
-    SDL_Flip(screen);
-    
+    struct Replay
+    {
+        Replay() : broken(false) {}
+        
+        Board board;
+        vector<Uint64> rows; //Four words for every position
+        bool broken;
+    };
+    map<Uint32, Replay> replays; //By game number, the pieces of a game come before its end
+    bool standard = false; //The session is of standard games
+    Uint32 session = 0; //Its version
+    piece_set = &standard_set; //Which are replayed with the standard pieces
     
-    Uint32 time = SDL_GetTicks();
+    auto read = [&](void* data, size_t size) { return static_cast<bool>(file.read(static_cast<char*>(data), size)); };
     
-    //While the user hasn't quit
-    while(!leave_state)
+    vector<PieceRecord> pieces;
+    vector<GameRecord> ends;
+    vector<Uint32> entries;
+    char kind;
+    while (file.get(kind))
     {
+        if (kind == 'T')
+        {
+            //A new session starts its game numbers over
+            char magic[3];
+            Uint32 version, started;
+            if (!read(magic, 3) || memcmp(magic, "ANL", 3) != 0 || !read(&version, 4) || !read(&started, 4))
+                break;
+            Uint8 pieces = 0xFF;
+            Uint8 length = 0;
+            char variant[256];
+            if (version >= 2 && (!read(&pieces, 1) || !read(&length, 1) || !read(variant, length)))
+                break;
+            session = version;
+            standard = version >= 2 && pieces < PIECE_SETS && piece_sets[pieces] == &standard_set
+                && string(variant, length) == "standard";
+            replays.clear();
+            continue;
+        }
         
-        if (objects == 20)
-        {
-            if (speed != 125)
-                speed -= 75;
-            objects = 0;
-            board.increase_level();
-        }
-        
-        
-        next.draw_next();
-        
-        if(saved_object_exist)
-            saved_object.draw_saved_object();
-        
-        //Let the piece fall down after xx ms
-        if ((SDL_GetTicks() - time) >= speed)
+        Uint32 count;
+        if ((kind != 'P' && kind != 'G') || !read(&count, sizeof(count)))
+            break;
+        if (kind == 'P')
         {
-            current.set_yPos(current.get_yPos() +1);
-            if (!board.isMovementPossible(current))
+            pieces.resize(count);
+            read_column(file, &pieces[0], count, &PieceRecord::game);
+            read_column(file, &pieces[0], count, &PieceRecord::type);
+            read_column(file, &pieces[0], count, &PieceRecord::rotation);
+            read_column(file, &pieces[0], count, &PieceRecord::x);
+            read_column(file, &pieces[0], count, &PieceRecord::y);
+            read_column(file, &pieces[0], count, &PieceRecord::lines);
+            read_column(file, &pieces[0], count, &PieceRecord::time);
+            read_column(file, &pieces[0], count, &PieceRecord::keys);
+            if (session >= 3)
             {
-                current.set_yPos(current.get_yPos() -1);
-                board.store_object(current);
-                board.clear_row(current);
-                current = next;
-                ++objects;
-                next = Object(get_new_random(next));
-                if (board.isGameover(current))
-                {
-                    leave_state = true;
-                    state = "GAME OVER";
-                }
+                read_column(file, &pieces[0], count, &PieceRecord::height);
+                read_column(file, &pieces[0], count, &PieceRecord::holes);
             }
-            
-            update_predicted_position(predicted_position, current, board);
-            board.draw_board();
-            current.draw_object();
-            predicted_position.draw_predicted_position();
-            time = SDL_GetTicks();
-            
-            board.print_score_level();
-            
-            SDL_Flip(screen);
- 
-        }
-        //While there's an event to handle
-        while(SDL_PollEvent(&event))
-        {
-            //If the user has Xed out the window
-            if( event.type == SDL_QUIT )
+            else
             {
-                leave_state = true;
-                //Quit the program
-                quit = true;
+                read_column_as<Uint16>(file, &pieces[0], count, &PieceRecord::height);
+                read_column_as<Uint16>(file, &pieces[0], count, &PieceRecord::holes);
             }
-            
-            //If a key was pressed
-            if (event.type == SDL_KEYDOWN)
+            for (Uint32 i = 0; i < count && file && standard; ++i)
             {
-                if (event.key.keysym.sym == SDLK_ESCAPE)
-                {
-                    state = "MENU";
-                    leave_state = true;
-                }
-                
-                if (event.key.keysym.sym == SDLK_DOWN)
-                {
-                    current.set_yPos(current.get_yPos() + 1);
-                    if (!board.isMovementPossible(current))
-                    {
-                        current.set_yPos(current.get_yPos() -1);
-                    }
-                    update_predicted_position(predicted_position, current, board);
-                    board.draw_board();
-                    current.draw_object();
-                    predicted_position.draw_predicted_position();
-                }
-                
-                if (event.key.keysym.sym == SDLK_UP)
-                {
-                    current.rotate_left();
-                    if (!board.isMovementPossible(current))
-                    {
-                        current.rotate_right();
-                    }
-                    update_predicted_position(predicted_position, current, board);
-                    board.draw_board();
-                    current.draw_object();
-                    predicted_position.draw_predicted_position();
-                }
-                
-                if (event.key.keysym.sym == SDLK_RIGHT)
-                {
-                    current.set_xPos(current.get_xPos() + 1);
-                    if (!board.isMovementPossible(current))
-                    {
-                        current.set_xPos(current.get_xPos() -1);
-                    }
-                    update_predicted_position(predicted_position, current, board);
-                    board.draw_board();
-                    current.draw_object();
-                    predicted_position.draw_predicted_position();
-                }
-                
-                if (event.key.keysym.sym == SDLK_LEFT)
-                {
-                    current.set_xPos(current.get_xPos() - 1);
-                    if (!board.isMovementPossible(current))
-                    {
-                        current.set_xPos(current.get_xPos() +1);
-                    }
-                    update_predicted_position(predicted_position, current, board);
-                    board.draw_board();
-                    current.draw_object();
-                    predicted_position.draw_predicted_position();
-                }
-                
-                if (event.key.keysym.sym == SDLK_z)
-                {
-                    current.rotate_left();
-                    if (!board.isMovementPossible(current))
-                    {
-                        current.rotate_right();
-                    }
-                    update_predicted_position(predicted_position, current, board);
-                    board.draw_board();
-                    current.draw_object();
-                    predicted_position.draw_predicted_position();
-                }
-                
-                if (event.key.keysym.sym == SDLK_x)
-                {
-                    current.rotate_right();
-                    if (!board.isMovementPossible(current))
-                    {
-                        current.rotate_left();
-                    }
-                    update_predicted_position(predicted_position, current, board);
-                    board.draw_board();
-                    current.draw_object();
-                    predicted_position.draw_predicted_position();
-                }
-                
-                if (event.key.keysym.sym == SDLK_SPACE)
+                Replay& replay = replays[pieces[i].game];
+                if (replay.broken)
+                    continue;
+                Object locked = rotated_object(pieces[i].type, pieces[i].rotation, pieces[i].x, pieces[i].y);
+                if (pieces[i].type == 0 || pieces[i].type > piece_set->count || locked.get_yPos() < 0 || !replay.board.isMovementPossible(locked))
                 {
-                    while (board.isMovementPossible(current))
-                    {
-                        current.set_yPos((current.get_yPos()+1));
-                    }
-                    current.set_yPos(current.get_yPos() -1);
-                    
-                    board.store_object(current);
-                    board.clear_row(current);
-                    current = next;
-                    ++objects;
-                    next = Object(get_new_random(next));
-                    
-                    board.draw_board();
+                    replay.broken = true;
+                    continue;
                 }
-                
-                if (event.key.keysym.sym == SDLK_LSHIFT && !current.isExchanged())
+                replay.board.store_object(locked);
+                replay.board.clear_row(locked);
+                replay.rows.resize(replay.rows.size() + 4);
+                database.canonical(replay.board, &replay.rows[replay.rows.size() - 4]);
+            }
+        }
+        else
+        {
+            ends.resize(count);
+            read_column(file, &ends[0], count, &GameRecord::game);
+            read_column(file, &ends[0], count, &GameRecord::pieces);
+            read_column(file, &ends[0], count, &GameRecord::duration);
+            read_column(file, &ends[0], count, &GameRecord::actions);
+            read_column(file, &ends[0], count, &GameRecord::score);
+            read_column(file, &ends[0], count, &GameRecord::level);
+            read_column(file, &ends[0], count, &GameRecord::pieces_per_second);
+            read_column(file, &ends[0], count, &GameRecord::actions_per_minute);
+            for (Uint32 i = 0; i < count && file; ++i)
+            {
+                auto replay = replays.find(ends[i].game);
+                if (replay == replays.end())
+                    continue;
+                if (!replay->second.broken)
                 {
-                    Object temp = saved_object;
-                    if(saved_object_exist == false)
-                    {
-                        saved_object = current;
-                        current = next;
-                        next = Object(get_new_random(next));
-                        saved_object_exist = true;
-                    }
-                    else
+                    const vector<Uint64>& rows = replay->second.rows;
+                    entries.clear();
+                    for (size_t at = 0; at < rows.size(); at += 4)
                     {
-                        saved_object = current;
-                        temp.set_xPos(3);
-                        temp.set_yPos(0);
-                        current = temp;
+                        entries.push_back(database.add(&rows[at]));
+                        if (entries.back() == PositionDatabase::NO_ENTRY)
+                            return false;
                     }
-                    current.set_exchanged();
-                    saved_object.draw_saved_object();
-                    board.draw_board();
+                    database.record_game(entries, ends[i].score);
+                    ++games;
+                    positions += entries.size();
                 }
+                replays.erase(replay);
             }
-            
-            SDL_Flip(screen);
-            
         }
-        
     }
-    return board.get_score();
+    return true;
 }
 
-bool sortFunction(pair<string,int> i,pair<string, int> j)
+//Reads a pattern of bottom rows, drawn like puzzle rows with the bottom one last, '.' is empty and anything else a block
+bool load_position_pattern(const string& path, vector<Uint16>& pattern)
 {
-    if(j.second > i.second)
+    ifstream file(path.c_str());
+    vector<string> lines;
+    string line;
+    while (getline(file, line))
+    {
+        if (!line.empty())
+            lines.push_back(line);
+    }
+    if (lines.empty() || static_cast<int>(lines.size()) > POSITION_ROWS)
         return false;
+    
+    pattern.clear();
+    for (size_t i = lines.size(); i-- > 0; )
+    {
+        if (static_cast<int>(lines[i].size()) != POSITION_COLUMNS)
+            return false;
+        Uint16 row = 0;
+        for (int x = 0; x < POSITION_COLUMNS; ++x)
+        {
+            if (lines[i][x] != '.')
+                row |= 1 << x;
+        }
+        pattern.push_back(row);
+    }
     return true;
 }
 
-void view_highscore(bool& quit, string& state, vector< pair<string, int>>& score_vector)
+void print_position(const PositionDatabase& database, Uint32 entry)
 {
-    Tetris tetris;
-    tetris.apply_surface(0, 0, background_hs);
-    SDL_Flip(screen);
-    bool leave_state = false;
+    const PositionEntry& position = database.get(entry);
+    int heights[POSITION_COLUMNS];
+    position_heights(position.rows, heights);
+    printf("seen %u, mean score %.0f, best %u, mean pieces left %.1f, heights", position.seen,
+           position.seen > 0 ? double(position.score_sum)/position.seen : 0.0, position.best_score,
+           position.seen > 0 ? double(position.pieces_left_sum)/position.seen : 0.0);
+    for (int x = 0; x < POSITION_COLUMNS; ++x)
+        printf(" %d", heights[x]);
+    printf("\n");
+}
+
+//Harvests analytics files into a position database and answers a pattern or a closest heights query
+int run_position_database(const string& path, bool mirrored, const vector<string>& harvest, const string& pattern_file,
+                          const string& closest_heights, int results)
+{
+    PositionDatabase database;
+    if (!database.open(path, mirrored))
+    {
+        fprintf(stderr, "Can't open the position database %s\n", path.c_str());
+        return 1;
+    }
     
-    score_vector.clear();
+    if (!harvest.empty())
+    {
+        const Uint64 start = precise_ticks();
+        Uint64 games = 0;
+        Uint64 positions = 0;
+        for (size_t i = 0; i < harvest.size(); ++i)
+        {
+            if (!harvest_positions(harvest[i], database, games, positions))
+                return 1;
+        }
+        database.build_index();
+        printf("harvested %llu games, %llu positions, %u distinct in the database%s, %.3f s\n",
+               static_cast<unsigned long long>(games), static_cast<unsigned long long>(positions), database.size(),
+               database.is_mirrored() ? " with mirrors folded" : "", (precise_ticks() - start)/1000000.0);
+    }
+    
+    if (!pattern_file.empty())
+    {
+        vector<Uint16> pattern;
+        if (!load_position_pattern(pattern_file, pattern))
+        {
+            fprintf(stderr, "%s is not a pattern of board rows\n", pattern_file.c_str());
+            return 1;
+        }
+        
+        //The most seen positions first
+        vector<Uint32> found;
+        Uint64 seen = 0;
+        const Uint64 start = precise_ticks();
+        auto collect = [&](Uint32 entry) { found.push_back(entry); seen += database.get(entry).seen; };
+        database.match(pattern, collect);
+        const Uint64 time = precise_ticks() - start;
+        sort(found.begin(), found.end(), [&](Uint32 a, Uint32 b) { return database.get(a).seen > database.get(b).seen; });
+        printf("%u positions, seen %llu times, match the bottom %u rows in %llu us\n", static_cast<Uint32>(found.size()),
+               static_cast<unsigned long long>(seen), static_cast<Uint32>(pattern.size()), static_cast<unsigned long long>(time));
+        for (size_t i = 0; i < found.size() && static_cast<int>(i) < results; ++i)
+            print_position(database, found[i]);
+    }
+    
+    if (!closest_heights.empty())
+    {
+        int heights[POSITION_COLUMNS] = {};
+        istringstream values(closest_heights);
+        for (int x = 0; x < POSITION_COLUMNS; ++x)
+        {
+            char comma;
+            if (!(values >> heights[x]) || (x + 1 < POSITION_COLUMNS && !(values >> comma)))
+            {
+                fprintf(stderr, "-closest takes %d heights like 0,1,2,...\n", POSITION_COLUMNS);
+                return 1;
+            }
+        }
+        vector<pair<int, Uint32> > found;
+        const Uint64 start = precise_ticks();
+        database.closest(heights, results, found);
+        printf("%u closest positions in %llu us\n", static_cast<Uint32>(found.size()), static_cast<unsigned long long>(precise_ticks() - start));
+        for (size_t i = 0; i < found.size(); ++i)
+        {
+            printf("distance %d: ", found[i].first);
+            print_position(database, found[i].second);
+        }
+    }
+    return 0;
+}
+
+//Brings the scores of the old text table into a new leaderboard
+void import_highscore(Leaderboard& leaderboard)
+{
+    if (leaderboard.size() > 0)
+        return;
     
     string name;
     int score;
@@ -992,51 +8274,53 @@ void view_highscore(bool& quit, string& state, vector< pair<string, int>>& score
     
     while(file >> name >> score)
     {
-        score_vector.push_back(make_pair(name, score));
+        leaderboard.insert(name.c_str(), score);
     }
-    sort(score_vector.begin(), score_vector.end(), sortFunction);
     file.close();
+}
+
+//Shows a page of the leaderboard around the given rank, Up and Down turn the pages
+void view_highscore(bool& quit, GameState& state, Leaderboard& leaderboard, Uint32 shown_rank)
+{
+    const Uint32 PAGE = 10;
+    Scene scene(HIGHSCORE);
+    Tetris tetris;
+    bool leave_state = false;
     
+    //The page starts with a multiple of PAGE and one, so that the top ten are a page of their own
+    Uint32 first_rank = (max(shown_rank, 1u) - 1)/PAGE*PAGE + 1;
     
     int Y = 120;
-    string str_;
-    stringstream ss;
-    for(int i = 0; i < score_vector.size(); ++i)
+    char str_[32];
+    auto draw_entry = [&](Uint32 rank, const LeaderboardEntry& entry)
     {
-        ss << score_vector.at(i).first;
-        
-        str_ = ss.str();
-        ss.str("");
-        highscore_candidate = TTF_RenderText_Solid(font, str_.c_str(), textColor);
-        tetris.apply_surface(200, Y, highscore_candidate);
-        SDL_Flip(screen);
+        //Placeringsiffran, right aligned so that long ones fit
+        snprintf(str_, sizeof(str_), "%u.", rank);
+        highscore_candidate = TTF_RenderText_Solid(font, str_, textColor);
+        tetris.apply_text(190 - ((highscore_candidate != NULL) ? layout.to_layout(highscore_candidate->w) : 0), Y, str_, highscore_candidate);
         SDL_FreeSurface(highscore_candidate);
+        highscore_candidate = NULL;
         
-        ss << score_vector.at(i).second;
-        str_ = ss.str();
-        ss.str("");
-        
-        highscore_candidate = TTF_RenderText_Solid(font, str_.c_str(), textColor);
-        tetris.apply_surface(350, Y, highscore_candidate);
-        SDL_Flip(screen);
+        highscore_candidate = TTF_RenderText_Solid(font, entry.name, textColor);
+        tetris.apply_text(200, Y, entry.name, highscore_candidate);
         SDL_FreeSurface(highscore_candidate);
-        Y += 25;
-    }
-    
-    //Placeringsiffran
-    Y = 120;
-    for(int i = 1; i<=10; ++i)
-    {
-        ss << i << '.';
-        str_ = ss.str();
-        ss.str("");
+        highscore_candidate = NULL;
         
-        highscore_candidate = TTF_RenderText_Solid(font, str_.c_str(), textColor);
-        tetris.apply_surface(160, Y, highscore_candidate);
-        SDL_Flip(screen);
+        snprintf(str_, sizeof(str_), "%d", entry.score);
+        highscore_candidate = TTF_RenderText_Solid(font, str_, textColor);
+        tetris.apply_text(350, Y, str_, highscore_candidate);
         SDL_FreeSurface(highscore_candidate);
+        highscore_candidate = NULL;
         Y += 25;
-    }
+    };
+    auto draw_page = [&]()
+    {
+        tetris.apply_surface(0, 0, background_hs);
+        Y = 120;
+        leaderboard.visit(first_rank, PAGE, draw_entry);
+        renderer->present();
+    };
+    draw_page();
     
     while(!leave_state)
     {
@@ -1054,7 +8338,17 @@ void view_highscore(bool& quit, string& state, vector< pair<string, int>>& score
                 if (event.key.keysym.sym == SDLK_ESCAPE)
                 {
                     leave_state = true;
-                    state = "MENU";
+                    state = MENU;
+                }
+                else if (event.key.keysym.sym == SDLK_UP && first_rank > PAGE)
+                {
+                    first_rank -= PAGE;
+                    draw_page();
+                }
+                else if (event.key.keysym.sym == SDLK_DOWN && first_rank + PAGE <= leaderboard.size())
+                {
+                    first_rank += PAGE;
+                    draw_page();
                 }
             }
         }
@@ -1062,11 +8356,12 @@ void view_highscore(bool& quit, string& state, vector< pair<string, int>>& score
     }
 }
 
-void save_highscore(bool& quit, string& state, int& score, vector< pair<string, int>>& score_vector)
+void save_highscore(bool& quit, GameState& state, int& score, Leaderboard& leaderboard, Uint32& shown_rank)
 {
+    Scene scene(GAME_OVER);
     Tetris tetris;
     tetris.apply_surface(0, 0, transparent);
-    SDL_Flip(screen);
+    renderer->present();
     
     bool leave_state = false;
     bool name_entered = false;
@@ -1093,7 +8388,7 @@ void save_highscore(bool& quit, string& state, int& score, vector< pair<string,
                     {
                         name_entered = true;
                         leave_state = true;
-                        state = "MENU";
+                        state = MENU;
                     }
                     
                     string temp_copy = name_str;
@@ -1152,8 +8447,8 @@ void save_highscore(bool& quit, string& state, int& score, vector< pair<string,
                 tetris.apply_surface(0, 0, background);
                 tetris.apply_surface(0, 0, transparent);
                 //Show the name
-                tetris.apply_surface((SCREEN_WIDTH - name->w)/2, (SCREEN_HEIGHT - name->h)/2, name);
-                SDL_Flip(screen);
+                tetris.apply_text((SCREEN_WIDTH - layout.to_layout(name->w))/2, (SCREEN_HEIGHT - layout.to_layout(name->h))/2, name_str.c_str(), name);
+                renderer->present();
             }
             
             //If the enter key was pressed
@@ -1161,64 +8456,211 @@ void save_highscore(bool& quit, string& state, int& score, vector< pair<string,
             {
                 //Free the old message surface
                 SDL_FreeSurface(name);
+                name = NULL;
                 
-                if(score_vector.size() < 10)
-                {
-                    score_vector.push_back(make_pair(name_str, score));
-                }
-                
-                else
-                {
-                    score_vector.pop_back();
-                    score_vector.push_back(make_pair(name_str, score));
-                }
-                
-                sort(score_vector.begin(), score_vector.end(), sortFunction);
-                
-                remove("Highscore.txt");
-                fstream file;
-                file.open("Highscore.txt", ios_base::in|ios_base::out|ios_base::trunc);
-                
-                
-                for(int i = 0; i < score_vector.size(); ++i)
+                //The highscore screen opens on the page of the new entry
+                shown_rank = leaderboard.insert(name_str.c_str(), score);
+                if (shown_rank == 0)
                 {
-                    file << score_vector.at(i).first;
-                    file << " "; 
-                    file << score_vector.at(i).second;
-                    file << endl; 
+                    fprintf(stderr, "Can't save the highscore\n");
+                    shown_rank = 1;
                 }
                 
-                file.close();
-        
-                
+
                 //Change the flag
                 name_entered = true;
                 leave_state = true;
-                state = "HIGHSCORE";
+                state = HIGHSCORE;
             }
         }
     }
 }
 
-void check_score(bool& quit, string& state, int& score, vector< pair<string, int>>& score_vector)
+void check_score(bool& quit, GameState& state, int& score, Leaderboard& leaderboard, Uint32& shown_rank)
 {
-    if (score_vector.size() < 10 || score_vector.at(score_vector.size()-1).second < score)
-        save_highscore(quit, state, score, score_vector);
+    //The leaderboard keeps every score, not just the top ten
+    if (score > 0)
+        save_highscore(quit, state, score, leaderboard, shown_rank);
     else
     {
-    state = "MENU"; //visa gameover bara
+    state = MENU; //visa gameover bara
     }
 }
 
+//Built with TETRIS_LIBRARY the game is left out, and the file is a library of the training environment
+#ifndef TETRIS_LIBRARY
+
 // Main
 int main( int argc, char* args[] )
 {
     //Make sure the program waits for a quit
     bool quit = false;
     
+    GameState state = MENU;
+    string variant = "standard"; //Board variant, e.g. "drill", "wide", "extrawide" or "endurance"
+    int gate_frames = 0; //Frames for the allocation gate to check, 0 plays normally
+    int load_rate = 0; //Synthetic keys per second for the input load test, 0 plays normally
+    double load_seconds = 10;
+    string load_pattern = "m4r2d1h1"; //How often the load test moves, rotates, hard drops and holds
+    string backend = "software"; //Renderer backend, "software", "batch", "null" or "terminal"
+    string spectate; //File or unix:path to publish the game to
+    string shared_name; //Shared memory to export the live game to, like /tetris
+    string shared_read; //Shared memory of a game to print, instead of playing
+    string watch; //File or unix:path of a game to watch
+    vector<string> grid; //Files or unix:paths of the games to watch in a grid
+    int grid_fps = 30;
+    string analytics_file = "Analytics.dat"; //Where the games are recorded, "none" to not record them
+    int perft_depth = 0; //Depth to run perft to instead of playing, 0 plays normally
+    Uint32 perft_seed = 1; //Also picks the objects of a versus game
+    int threads = max(static_cast<int>(thread::hardware_concurrency()), 1); //For perft, the solver and the spectator grid
+    bool perft_divide = false; //Count the states after every first placement on its own
+    int env_games = 0; //Games to benchmark the training environment with, 0 plays normally
+    string puzzle; //Puzzle file to solve instead of playing
+    string position_file; //Position database to harvest into or query instead of playing
+    vector<string> harvest; //Analytics files to harvest positions from
+    bool mirror_positions = false; //A new position database keeps a position and its mirror image as one
+    string position_pattern; //File of bottom rows to find the positions of
+    string closest_heights; //Column heights to find the closest positions to, like 0,1,2,2,3,3,2,1,0,0
+    int position_results = 10;
+    
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = args[i];
+        if (arg == "-allocgate")
+            gate_frames = (i+1 < argc) ? atoi(args[++i]) : 100000;
+        else if (arg == "-inputload" && i+1 < argc)
+            load_rate = atoi(args[++i]);
+        else if (arg == "-loadtime" && i+1 < argc)
+            load_seconds = atof(args[++i]);
+        else if (arg == "-loadpattern" && i+1 < argc)
+            load_pattern = args[++i];
+        else if (arg == "-renderer" && i+1 < argc)
+            backend = args[++i];
+        else if (arg == "-spectate" && i+1 < argc)
+            spectate = args[++i];
+        else if (arg == "-shm" && i+1 < argc)
+            shared_name = args[++i];
+        else if (arg == "-shmread" && i+1 < argc)
+            shared_read = args[++i];
+        else if (arg == "-watch" && i+1 < argc)
+            watch = args[++i];
+        else if (arg == "-grid")
+        {
+            while (i+1 < argc && args[i+1][0] != '-')
+                grid.push_back(args[++i]);
+        }
+        else if (arg == "-fps" && i+1 < argc)
+            grid_fps = atoi(args[++i]);
+        else if (arg == "-analytics" && i+1 < argc)
+            analytics_file = args[++i];
+        else if (arg == "-perft" && i+1 < argc)
+            perft_depth = atoi(args[++i]);
+        else if (arg == "-seed" && i+1 < argc)
+            perft_seed = strtoul(args[++i], NULL, 10);
+        else if (arg == "-threads" && i+1 < argc)
+            threads = max(atoi(args[++i]), 1);
+        else if (arg == "-divide")
+            perft_divide = true;
+        else if (arg == "-solve" && i+1 < argc)
+            puzzle = args[++i];
+        else if (arg == "-posdb" && i+1 < argc)
+            position_file = args[++i];
+        else if (arg == "-harvest")
+        {
+            while (i+1 < argc && args[i+1][0] != '-')
+                harvest.push_back(args[++i]);
+        }
+        else if (arg == "-mirror")
+            mirror_positions = true;
+        else if (arg == "-match" && i+1 < argc)
+            position_pattern = args[++i];
+        else if (arg == "-closest" && i+1 < argc)
+            closest_heights = args[++i];
+        else if (arg == "-results" && i+1 < argc)
+            position_results = max(atoi(args[++i]), 0);
+        else if (arg == "-envbench" && i+1 < argc)
+            env_games = atoi(args[++i]);
+        else if (arg == "-bot")
+        {
+            bot_settings.enabled = true;
+            if (i+1 < argc && isdigit(args[i+1][0]))
+                bot_settings.budget = atoi(args[++i]);
+        }
+        else if (arg == "-das" && i+1 < argc)
+            auto_shift_settings.das = static_cast<Uint64>(atof(args[++i])*1000);
+        else if (arg == "-arr" && i+1 < argc)
+            auto_shift_settings.arr = static_cast<Uint64>(atof(args[++i])*1000);
+        else if (arg == "-sdf" && i+1 < argc)
+            auto_shift_settings.soft_drop_factor = max(atoi(args[++i]), 1);
+        else if (arg == "-renderthread")
+            threaded_rendering = true;
+        else if (arg == "-window" && i+1 < argc)
+            sscanf(args[++i], "%dx%d", &window_settings.width, &window_settings.height);
+        else if (arg == "-fullscreen")
+            window_settings.fullscreen = true;
+        else if (arg == "-pieces" && i+1 < argc)
+        {
+            piece_set = find_piece_set(args[++i]);
+            if (piece_set == NULL)
+            {
+                fprintf(stderr, "There is no piece set %s\n", args[i]);
+                return 1;
+            }
+        }
+        else if (arg == "-assetbudget" && i+1 < argc)
+            asset_settings.budget = static_cast<size_t>(max(atoi(args[++i]), 0)) << 10; //KB
+        else if (arg == "-versus" && i+2 < argc)
+        {
+            netplay_settings.local_port = atoi(args[++i]);
+            netplay_settings.remote_port = atoi(args[++i]);
+        }
+        else if (arg == "-peer" && i+1 < argc)
+            netplay_settings.remote_host = args[++i];
+        else if (arg == "-netdelay" && i+1 < argc)
+            netplay_settings.delay = atoi(args[++i]);
+        else if (arg == "-netloss" && i+1 < argc)
+            netplay_settings.loss = atoi(args[++i]);
+        else if (arg[0] != '-')
+            variant = arg;
+    }
+    
+    bot_settings.threads = threads;
+    netplay_settings.seed = perft_seed;
+    if (bot_settings.enabled && variant == "endurance")
+    {
+        fprintf(stderr, "The bot looks at the whole board for every drop, it can't play the endurance board\n");
+        bot_settings.enabled = false;
+    }
+    
+    if (!shared_read.empty())
+        return read_shared_game(shared_read); //Needs no window
+    if (perft_depth > 0)
+        return perft_variant(variant, perft_depth, perft_seed, threads, perft_divide); //Needs no window
+    if (!position_file.empty())
+        return run_position_database(position_file, mirror_positions, harvest, position_pattern, closest_heights, position_results);
+    if (!puzzle.empty())
+        return solve_variant(variant, puzzle, threads);
+    if (env_games > 0 && piece_set != &standard_set)
+    {
+        fprintf(stderr, "The training environment observes the seven standard objects, it plays without -pieces\n");
+        return 1;
+    }
+    if (env_games > 0)
+        return run_env_benchmark(env_games, threads);
+    
+    if (gate_frames > 0 || load_rate > 0 || backend == "terminal")
+        SDL_putenv((char*)"SDL_VIDEODRIVER=dummy"); //No window is needed
+    
     //Initialize
     if( init() == false )
         return 1;
+    
+    //SDL 1.2 can't pump events on one thread while another draws, which the game thread does without an event thread
+    if (threaded_rendering && !threaded_events)
+    {
+        fprintf(stderr, "-renderthread needs SDLs event thread, which this platform doesn't have, the game draws on its own thread\n");
+        threaded_rendering = false;
+    }
    
     //Load the files
     if(load_files() == false)
@@ -1226,20 +8668,108 @@ int main( int argc, char* args[] )
         return 1;
     }
     
-    string state = "MENU";
+    renderer = create_renderer(backend);
+    
+    if (!watch.empty())
+    {
+        watch_stream(watch, quit);
+        clean_up();
+        return 0;
+    }
+    
+    if (!grid.empty())
+    {
+        watch_grid(grid, grid_fps, threads, quit);
+        clean_up();
+        return 0;
+    }
+    
+    if (netplay_settings.local_port != 0)
+    {
+        play_versus(quit);
+        clean_up();
+        return 0;
+    }
+    
+    Analytics recorder;
+    if (analytics_file != "none")
+    {
+        if (!recorder.open(analytics_file, variant))
+            fprintf(stderr, "Can't record the games to %s\n", analytics_file.c_str());
+        else
+            analytics = &recorder;
+    }
+    
+    SpectatorStream stream;
+    if (!spectate.empty())
+    {
+        if (!stream.open(spectate))
+            fprintf(stderr, "Can't publish the game to %s\n", spectate.c_str());
+        else
+            spectator_stream = &stream;
+    }
+    
+    SharedStateExport shared_export;
+    if (!shared_name.empty())
+    {
+        if (!shared_export.open(shared_name))
+            fprintf(stderr, "Can't export the game to shared memory %s\n", shared_name.c_str());
+        else
+            shared_state = &shared_export;
+    }
+    
+    if (gate_frames > 0)
+    {
+#ifdef TETRIS_ALLOCATION_GATE
+        AllocationGate gate(gate_frames);
+        allocation_gate = &gate;
+        while (!gate.done() && !quit)
+        {
+            gate.start_game();
+            play_variant(variant, quit, state);
+        }
+        allocation_gate = NULL;
+        clean_up();
+        return gate.report();
+#else
+        fprintf(stderr, "The allocation gate needs a build with TETRIS_ALLOCATION_GATE defined\n");
+        clean_up();
+        return 1;
+#endif
+    }
+    
+    if (load_rate > 0)
+    {
+        InputLoad load(load_rate, load_seconds, perft_seed, load_pattern);
+        input_load = &load;
+        while (!load.done() && !quit)
+            play_variant(variant, quit, state);
+        input_load = NULL;
+        clean_up();
+        return load.report();
+    }
+    
     int score;
-    vector< pair<string, int>> score_vector;
+    Uint32 shown_rank = 1; //The highscore screen shows the page of this rank
+    Leaderboard leaderboard;
+    if (!leaderboard.open("Leaderboard.dat"))
+        fprintf(stderr, "Can't open the leaderboard, the scores won't be saved\n");
+    else
+        import_highscore(leaderboard);
     
     while (quit == false)
     {
-        if (state == "MENU")
+        if (state == MENU)
             view_menu(quit, state);
-        if (state == "PLAY")
-            score = run_game(quit, state);
-        if (state == "HIGHSCORE")
-            view_highscore(quit, state, score_vector);
-        if (state == "GAME OVER")
-            check_score(quit, state, score, score_vector);
+        if (state == PLAY)
+            score = play_variant(variant, quit, state);
+        if (state == HIGHSCORE)
+        {
+            view_highscore(quit, state, leaderboard, shown_rank);
+            shown_rank = 1;
+        }
+        if (state == GAME_OVER)
+            check_score(quit, state, score, leaderboard, shown_rank);
     }
     
     //Free the surface and quit SDL
@@ -1248,3 +8778,4 @@ int main( int argc, char* args[] )
     return 0;
 }
 
+#endif